@@ -0,0 +1,198 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "mpmc_queue.h"
+
+/*
+    接收缓冲的块池：块的大小固定，用完还回池里，池里放满了才free
+    连接平时只用http_conn借来的读缓冲，请求头太大或请求体在读缓冲里放不下时才来这里取块，
+    一个请求用到的多个块用next串成一条链；chunk_queue是串在一起的块上的字节队列，
+    给io_uring后端暂存工作线程来不及处理的数据
+    多个reactor线程同时取还，空闲块放在无锁的mpmc_queue里
+*/
+struct buf_chunk {
+    static const int SIZE = 8192;
+    buf_chunk* next;
+    char data[SIZE];
+};
+
+// 用块串起来的字节队列，从尾部追加、从头部取走；所有成员为0就是空队列
+struct chunk_queue {
+    buf_chunk* head;
+    buf_chunk* tail;
+    int head_off;   // 头块中已经取走的字节数
+    int tail_len;   // 尾块中已经写入的字节数
+    int chunks;
+
+    bool empty() const { return head == nullptr; }
+    inline bool append(const char* data, int len); // 取不到块时返回false，已经追加的部分保留
+    // 头部连续的一段数据，返回长度
+    int front(const char** data) const {
+        *data = head->data + head_off;
+        return (head == tail ? tail_len : buf_chunk::SIZE) - head_off;
+    }
+    inline void consume(int len); // len不超过front()返回的长度
+    inline void clear();
+};
+
+class buffer_pool {
+public:
+    static const int MAX_FREE = 1024; // 池里最多缓存的空闲块数
+
+    static buffer_pool& instance() {
+        static buffer_pool pool;
+        return pool;
+    }
+
+    // 内存不够时返回nullptr
+    buf_chunk* get() {
+        buf_chunk* chunk = nullptr;
+        if (!m_free.pop(chunk)) {
+            chunk = (buf_chunk*) malloc(sizeof(buf_chunk));
+            if (!chunk) return nullptr;
+        }
+        chunk->next = nullptr;
+        return chunk;
+    }
+
+    // 归还chunk和它后面链上的所有块
+    void put(buf_chunk* chunk) {
+        while (chunk) {
+            buf_chunk* next = chunk->next;
+            if (!m_free.push(chunk)) {
+                free(chunk);
+            }
+            chunk = next;
+        }
+    }
+
+private:
+    buffer_pool() : m_free(MAX_FREE) {}
+    ~buffer_pool() {
+        buf_chunk* chunk;
+        while (m_free.pop(chunk)) {
+            free(chunk);
+        }
+    }
+
+private:
+    mpmc_queue<buf_chunk*> m_free;
+};
+
+/*
+    固定大小对象的池，每个线程前面有一个本地的小缓存：取还都在本线程的缓存里，不碰共享的队列
+    本地缓存放满时把一半交给共享的mpmc_queue，本地空了先从共享的取，都没有才malloc；
+    线程退出（线程池缩减）时本地缓存的全部交回共享的队列，共享的也放满了才free
+    T要能直接malloc/free（没有构造和析构）
+    用于连接的I/O缓冲：一般由同一个reactor线程借出和还回，工作线程也会还，共享的队列在线程之间搬运
+*/
+template <class T>
+class local_pool {
+public:
+    static const int LOCAL_MAX = 32;    // 每个线程最多缓存的空闲对象数
+    static const int SHARED_MAX = 1024; // 共享队列最多缓存的空闲对象数
+
+    // 内存不够时返回nullptr
+    static T* get() {
+        cache& c = local();
+        if (c.count > 0) {
+            return c.items[--c.count];
+        }
+        T* obj = nullptr;
+        if (shared().pop(obj)) {
+            return obj;
+        }
+        return (T*) malloc(sizeof(T));
+    }
+
+    static void put(T* obj) {
+        cache& c = local();
+        if (c.count == LOCAL_MAX) {
+            c.spill(LOCAL_MAX / 2);
+        }
+        c.items[c.count++] = obj;
+    }
+
+private:
+    struct cache {
+        T* items[LOCAL_MAX];
+        int count;
+        // 最近还回来的n个交给共享的队列
+        void spill(int n) {
+            while (n-- > 0) {
+                T* obj = items[--count];
+                if (!shared().push(obj)) {
+                    free(obj);
+                }
+            }
+        }
+        ~cache() { spill(count); }
+    };
+    struct shared_queue : mpmc_queue<T*> {
+        shared_queue() : mpmc_queue<T*>(SHARED_MAX) {}
+        ~shared_queue() {
+            T* obj;
+            while (this->pop(obj)) {
+                free(obj);
+            }
+        }
+    };
+
+    // thread_local的对象零初始化，count从0开始
+    static cache& local() {
+        static thread_local cache c;
+        return c;
+    }
+    static mpmc_queue<T*>& shared() {
+        static shared_queue q;
+        return q;
+    }
+};
+
+bool chunk_queue::append(const char* data, int len) {
+    while (len > 0) {
+        if (!tail || tail_len == buf_chunk::SIZE) {
+            buf_chunk* chunk = buffer_pool::instance().get();
+            if (!chunk) return false;
+            if (tail) tail->next = chunk;
+            else head = chunk;
+            tail = chunk;
+            tail_len = 0;
+            ++chunks;
+        }
+        int n = buf_chunk::SIZE - tail_len;
+        if (n > len) n = len;
+        memcpy(tail->data + tail_len, data, n);
+        tail_len += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+void chunk_queue::consume(int len) {
+    head_off += len;
+    if (head_off == (head == tail ? tail_len : buf_chunk::SIZE)) {
+        // 头块取完了
+        buf_chunk* next = head->next;
+        head->next = nullptr;
+        buffer_pool::instance().put(head);
+        head = next;
+        head_off = 0;
+        --chunks;
+        if (!head) {
+            tail = nullptr;
+            tail_len = 0;
+        }
+    }
+}
+
+void chunk_queue::clear() {
+    buffer_pool::instance().put(head);
+    head = tail = nullptr;
+    head_off = tail_len = chunks = 0;
+}
+
+#endif
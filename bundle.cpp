@@ -0,0 +1,177 @@
+#include "bundle.h"
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+bool asset_bundle::open(const char* path) {
+    m_path = path;
+    m_current = load();
+    if (!m_current) {
+        m_path.clear();
+        return false;
+    }
+    printf("资源包 %s: %u 个文件, %zu KB\n", path, m_current->count, m_current->size / 1024);
+    return true;
+}
+
+asset_bundle::~asset_bundle() {
+    if (m_current) {
+        release(m_current);
+    }
+}
+
+/*
+    整个文件只读映射，索引和每个条目的路径、内容都检查一遍在包内，路径要严格递增，
+    之后查找和发送时不用再检查；打包工具写到一半的、截断的或者别的文件都不加载
+*/
+asset_bundle::image* asset_bundle::load() {
+    int fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("资源包 %s: %s\n", m_path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(bundle_header)) {
+        printf("资源包 %s: 文件太小\n", m_path.c_str());
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    char* base = (char*) mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        printf("资源包 %s: mmap: %s\n", m_path.c_str(), strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    const char* error = nullptr;
+    const bundle_header* h = (const bundle_header*) base;
+    const bundle_entry* entries = (const bundle_entry*) (base + h->index_off);
+    if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0 || h->version != BUNDLE_VERSION) {
+        error = "不是资源包或者版本不对";
+    } else if (h->size != size) {
+        error = "大小不对，可能还没写完";
+    } else if (h->index_off % alignof(bundle_entry) != 0 || h->index_off > size
+               || h->count > (size - h->index_off) / sizeof(bundle_entry)) {
+        error = "索引超出了文件";
+    } else {
+        for (uint32_t i = 0; i < h->count && !error; ++i) {
+            const bundle_entry& e = entries[i];
+            if (e.path_off > size || e.path_len > size - e.path_off || e.path_len == 0 || base[e.path_off] != '/'
+                || e.last_modified_len > sizeof(e.last_modified)) {
+                error = "路径超出了文件";
+                break;
+            }
+            if (i > 0) {
+                std::string_view prev(base + entries[i - 1].path_off, entries[i - 1].path_len);
+                if (prev >= std::string_view(base + e.path_off, e.path_len)) {
+                    error = "索引没有排好序";
+                    break;
+                }
+            }
+            if (e.variants[0].off == 0) {
+                error = "缺少原文件的内容";
+            }
+            for (int v = 0; v < BUNDLE_VARIANTS; ++v) {
+                const bundle_variant& var = e.variants[v];
+                if (var.off != 0 && (var.off > size || var.len > size - var.off || var.etag_len > sizeof(var.etag))) {
+                    error = "内容超出了文件";
+                }
+            }
+        }
+    }
+    if (error) {
+        printf("资源包 %s: %s\n", m_path.c_str(), error);
+        munmap(base, size);
+        close(fd);
+        return nullptr;
+    }
+
+    // 查找时随机访问索引，先读进页缓存；文件内容按需缺页
+    madvise(base + h->index_off, h->count * sizeof(bundle_entry), MADV_WILLNEED);
+    image* img = new image;
+    img->fd = fd;
+    img->base = base;
+    img->size = size;
+    img->entries = entries;
+    img->count = h->count;
+    img->refs.store(1, std::memory_order_relaxed);
+    return img;
+}
+
+asset_bundle::image* asset_bundle::acquire() {
+    if (m_reload.load(std::memory_order_relaxed) && m_reload.exchange(false)) {
+        reload();
+    }
+    if (m_report.load(std::memory_order_relaxed) && m_report.exchange(false)) {
+        report();
+    }
+    m_lock.lock();
+    image* img = m_current;
+    if (img) {
+        img->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_lock.unlock();
+    return img;
+}
+
+void asset_bundle::release(image* img) {
+    if (img->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        destroy(img);
+    }
+}
+
+// 新包检查通过才换上，否则继续用旧包；旧包在最后一个引用它的响应发完后释放
+void asset_bundle::reload() {
+    image* img = load();
+    if (!img) {
+        printf("资源包 %s: 重新加载失败，继续使用之前的包\n", m_path.c_str());
+        return;
+    }
+    m_lock.lock();
+    image* old = m_current;
+    m_current = img;
+    m_lock.unlock();
+    printf("资源包 %s: 换成了新包，%u 个文件\n", m_path.c_str(), img->count);
+    if (old) {
+        release(old);
+    }
+}
+
+void asset_bundle::destroy(image* img) {
+    munmap(img->base, img->size);
+    close(img->fd);
+    delete img;
+}
+
+const bundle_entry* asset_bundle::find(const image* img, std::string_view path) {
+    uint32_t lo = 0;
+    uint32_t hi = img->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = path_of(img, &img->entries[mid]).compare(path);
+        if (c == 0) {
+            return &img->entries[mid];
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return nullptr;
+}
+
+void asset_bundle::report() {
+    unsigned long hits = m_hits.load(std::memory_order_relaxed);
+    unsigned long misses = m_misses.load(std::memory_order_relaxed);
+    m_lock.lock();
+    uint32_t count = m_current ? m_current->count : 0;
+    m_lock.unlock();
+    printf("bundle: %u files, hits %lu, misses %lu (%.1f%% hit)\n", count, hits, misses,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    fflush(stdout);
+}
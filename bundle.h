@@ -0,0 +1,108 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include "locker.h"
+
+/*
+    资源包：tools/bundle_pack把整个文档根目录打成一个只读的文件，服务器启动时整个mmap进来
+    命中时do_request不用stat/open/mmap，一次二分查找就得到内容、长度、ETag、Last-Modified和压缩的版本；
+    不在包里的路径照常去文件系统找
+    文件格式（打包和读取在同一种机器上，整数都是本机字节序）：
+        bundle_header
+        路径字符串（不以'\0'结尾，由bundle_entry记下位置和长度）
+        bundle_entry[count]，按路径的字节序排好，可以二分查找
+        各个文件的内容：超过一页的从页边界开始，小文件按64字节对齐挤在一起
+    部署时打好新包rename到原来的路径，kill -HUP让服务器换上新包；
+    正在发送的响应引用着旧包，发完最后一个才munmap
+*/
+
+static const char BUNDLE_MAGIC[8] = { 'W', 'S', 'B', 'U', 'N', 'D', 'L', 'E' };
+static const uint32_t BUNDLE_VERSION = 1;
+// 每个文件的几种内容，下标和http_conn::CONTENT_CODING一致：原文件、br、zstd、gzip
+static const int BUNDLE_VARIANTS = 4;
+
+struct bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;           // 文件数
+    uint64_t index_off;       // bundle_entry数组的位置
+    uint64_t size;            // 整个包的大小，截断的包不加载
+};
+
+struct bundle_variant {
+    uint64_t off;             // 内容在包中的位置，0表示没有这个版本（0处是bundle_header）
+    uint64_t len;
+    char etag[40];            // 按内容算的ETag（带引号），换了包内容不变时也不变
+    uint32_t etag_len;
+    uint32_t pad;
+};
+
+struct bundle_entry {
+    uint64_t path_off;        // 以'/'开头的请求路径
+    uint32_t path_len;
+    uint32_t last_modified_len;
+    int64_t mtime;            // 打包时原文件的修改时间，If-Modified-Since用
+    char last_modified[32];   // 预先格式化好的Last-Modified
+    bundle_variant variants[BUNDLE_VARIANTS];
+};
+
+class asset_bundle {
+public:
+    // 一个加载了的包，带引用计数：asset_bundle持有一个，每个正在使用它的请求或响应各持有一个
+    struct image {
+        int fd;
+        char* base;
+        size_t size;
+        const bundle_entry* entries;
+        uint32_t count;
+        std::atomic<int> refs;
+    };
+
+    static asset_bundle& instance() {
+        static asset_bundle bundle;
+        return bundle;
+    }
+
+    // 启动时加载，失败时打印原因并返回false；path记下来，重新加载时还用它
+    bool open(const char* path);
+    bool enabled() const { return !m_path.empty(); }
+
+    // 当前的包，多了一个引用，用完调用release；没有加载成功时返回nullptr
+    image* acquire();
+    void release(image* img);
+    // 在包中找请求的路径，没有时返回nullptr
+    static const bundle_entry* find(const image* img, std::string_view path);
+    static std::string_view path_of(const image* img, const bundle_entry* e) {
+        return std::string_view(img->base + e->path_off, e->path_len);
+    }
+
+    // 信号处理函数中调用：下一次查找时重新加载包（部署新包之后）
+    void request_reload() { m_reload.store(true, std::memory_order_relaxed); }
+    void request_report() { m_report.store(true, std::memory_order_relaxed); }
+    void count(bool hit) { (hit ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed); }
+    void report();
+
+private:
+    asset_bundle() : m_current(nullptr), m_reload(false), m_report(false), m_hits(0), m_misses(0) {}
+    ~asset_bundle();
+
+    image* load(); // 打开、映射并检查m_path，失败返回nullptr
+    void reload();
+    static void destroy(image* img);
+
+    std::string m_path;
+    locker m_lock;            // 保护m_current和取得它的引用，换包时不会拿到正在释放的旧包
+    image* m_current;
+    std::atomic<bool> m_reload;
+    std::atomic<bool> m_report;
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+#include "locker.h"
+
+/*
+    按排队时间做过载控制（CoDel，Controlled Delay）
+    任务入队时打时间戳，出队时算出它排了多久（sojourn time）：
+    - 排队时间低于target，说明队列能及时消化，什么都不做
+    - 连续interval这么久都高于target，说明是持续的积压而不是突发，进入丢弃状态，
+      丢掉（拒绝）当前任务，之后按 interval/sqrt(丢弃次数) 的间隔继续丢，
+      直到某个任务的排队时间重新低于target
+    和按队列长度拒绝相比，它不关心队列有多长，只保证排队时延不会无限增长，
+    短暂的突发不会被误伤
+    多个工作线程同时出队，排队时间正常的快路径只读几个原子变量，超过target时才加锁
+*/
+class codel {
+public:
+    codel() : m_target_ns(0), m_interval_ns(0), m_first_above(0), m_dropping(false),
+    m_drop_next(0), m_count(0), m_last_count(0) {}
+
+    // target_ms为0表示不启用
+    void set(int target_ms, int interval_ms) {
+        m_target_ns = (uint64_t) target_ms * 1000000;
+        m_interval_ns = (uint64_t) interval_ms * 1000000;
+    }
+
+    bool enabled() const { return m_target_ns > 0; }
+
+    // 出队时调用，返回是否应该拒绝这个任务
+    bool should_drop(uint64_t enqueue_ns, uint64_t now_ns) {
+        uint64_t sojourn = now_ns > enqueue_ns ? now_ns - enqueue_ns : 0;
+        if (sojourn < m_target_ns) {
+            if (m_first_above.load(std::memory_order_relaxed) != 0 || m_dropping.load(std::memory_order_relaxed)) {
+                m_locker.lock();
+                m_first_above.store(0, std::memory_order_relaxed);
+                m_dropping.store(false, std::memory_order_relaxed);
+                m_locker.unlock();
+            }
+            return false;
+        }
+
+        bool drop = false;
+        m_locker.lock();
+        if (!m_dropping.load(std::memory_order_relaxed)) {
+            uint64_t first_above = m_first_above.load(std::memory_order_relaxed);
+            if (first_above == 0) {
+                // 第一次超过target，开始计时
+                m_first_above.store(now_ns + m_interval_ns, std::memory_order_relaxed);
+            } else if (now_ns >= first_above) {
+                // 持续了一个interval，进入丢弃状态；刚退出不久又进来时沿用之前的丢弃频率
+                drop = true;
+                m_dropping.store(true, std::memory_order_relaxed);
+                uint32_t delta = m_count - m_last_count;
+                m_count = (delta > 1 && (int64_t)(now_ns - m_drop_next) < (int64_t)(16 * m_interval_ns)) ? delta : 1;
+                m_last_count = m_count;
+                m_drop_next = control_law(now_ns);
+            }
+        } else if (now_ns >= m_drop_next) {
+            drop = true;
+            ++m_count;
+            m_drop_next = control_law(m_drop_next);
+        }
+        m_locker.unlock();
+        return drop;
+    }
+
+private:
+    uint64_t control_law(uint64_t t) const {
+        return t + (uint64_t)(m_interval_ns / sqrt((double) m_count));
+    }
+
+private:
+    uint64_t m_target_ns;   // 可以接受的排队时间
+    uint64_t m_interval_ns; // 超过target持续多久才开始丢
+    std::atomic<uint64_t> m_first_above; // 超过target后，到这个时间还没降下来就进入丢弃状态
+    std::atomic<bool> m_dropping;
+    uint64_t m_drop_next;   // 下一次丢弃的时间
+    uint32_t m_count;       // 这一轮丢弃状态中丢了多少个
+    uint32_t m_last_count;  // 上一轮进入丢弃状态时的m_count
+    locker m_locker;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* 服务器运行参数，由main解析命令行得到，传给各个reactor */
+struct server_config {
+    int port;            // 监听端口
+    int reactor_num;     // reactor（epoll事件循环）数量
+    int backlog;         // listen的全连接队列长度
+    int defer_accept;    // TCP_DEFER_ACCEPT秒数，0表示不启用
+    bool use_uring;      // 使用io_uring后端，内核不支持时退回epoll
+    int idle_timeout;    // keep-alive连接空闲超时（秒），以下0表示不限
+    int header_timeout;  // 读完请求头的超时
+    int body_timeout;    // 读完请求体的超时
+    int write_timeout;   // 发送响应停滞的超时
+    int thread_num;      // 工作线程数（动态伸缩时为最少线程数）
+    int max_thread_num;  // 最多工作线程数，大于thread_num时按负载动态伸缩
+    bool work_stealing;  // 线程池使用每线程本地队列+工作窃取
+    bool pin_cpu;        // 把reactor和工作线程绑定到CPU上
+    int queue_target;    // 任务排队时间的目标（毫秒），持续超过就回503，0表示不启用
+    int queue_interval;  // 排队时间持续超过目标多久才开始拒绝（毫秒）
+    int max_header_kb;   // 请求行加请求头的最大长度（KB）
+    bool sendfile;       // 文件内容用sendfile发送，不mmap（只对epoll后端有效）
+    int cache_mb;        // 热点文件缓存的容量（MB），0表示不启用
+    int cache_check_ms;  // 缓存的文件多久重新stat一次，确认没有被修改（毫秒）
+    int path_ttl_ms;     // 路径缓存里"不存在"的结论保留多久（毫秒）
+    int path_entries;    // 路径缓存最多多少条，0表示不启用
+    int gzip_level;      // 没有预先压缩好的文件时按这个级别gzip压缩并缓存，0表示不压缩
+    const char* tls_cert; // TLS的证书链（PEM），nullptr表示不启用TLS
+    const char* tls_key;  // 证书的私钥（PEM）
+    const char* bundle;   // tools/bundle_pack打好的资源包，nullptr表示直接从文档根目录读文件
+
+    server_config() :
+    port(0), reactor_num(1), backlog(1024), defer_accept(0), use_uring(false),
+    idle_timeout(60), header_timeout(10), body_timeout(30), write_timeout(30),
+    thread_num(4), max_thread_num(32), work_stealing(false), pin_cpu(false),
+    queue_target(5), queue_interval(100), max_header_kb(32), sendfile(false),
+    cache_mb(64), cache_check_ms(1000), path_ttl_ms(1000), path_entries(65536), gzip_level(0), tls_cert(nullptr), tls_key(nullptr), bundle(nullptr) {}
+};
+
+#endif
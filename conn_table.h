@@ -0,0 +1,52 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stdlib.h>
+#include <atomic>
+#include <exception>
+#include <new>
+#include "http_conn.h"
+
+/*
+    按fd下标的连接表，代替一次new出MAX_FD个http_conn：
+    表本身只是一个指针数组（calloc的，没用到的页不占物理内存），
+    某个fd第一次accept时才创建它的http_conn，之后一直留着给同一个fd复用，
+    常驻内存随同时打开过的连接数增长，和MAX_FD无关
+    不在关闭时释放：旧连接的超时、io_uring迟到的cqe在关闭后还可能按fd找到这个对象（靠gen/m_sockfd识别出是旧的）
+    多个reactor共用一张表，fd在进程内唯一，同一个fd同时只会被一个reactor accept
+*/
+class conn_table {
+public:
+    explicit conn_table(int max_fd) : m_max_fd(max_fd) {
+        m_slots = (std::atomic<http_conn*>*) calloc(max_fd, sizeof(std::atomic<http_conn*>));
+        if (!m_slots) throw std::exception();
+    }
+    ~conn_table() {
+        for (int i = 0; i < m_max_fd; ++i) {
+            delete m_slots[i].load(std::memory_order_relaxed);
+        }
+        free(m_slots);
+    }
+
+    // accept到fd时由reactor调用，内存不够时返回nullptr
+    http_conn* open(int fd) {
+        http_conn* conn = m_slots[fd].load(std::memory_order_acquire);
+        if (!conn) {
+            conn = new (std::nothrow) http_conn;
+            if (!conn) return nullptr;
+            m_slots[fd].store(conn, std::memory_order_release);
+        }
+        return conn;
+    }
+
+    // 已经open过的fd（事件、cqe和关闭都只针对accept到的连接）
+    http_conn& operator[](int fd) {
+        return *m_slots[fd].load(std::memory_order_acquire);
+    }
+
+private:
+    int m_max_fd;
+    std::atomic<http_conn*>* m_slots;
+};
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <zlib.h>
+#include "locker.h"
+#include "timer_wheel.h"
+
+/*
+    热点静态文件的缓存：按完整路径缓存打开的fd、stat的结果和整个文件的只读映射
+    命中时do_request不用stat/open/mmap，发完也不用munmap/close，所有工作线程共用同一个映射
+    - 条目带引用计数：缓存本身持有一个，每个正在发送它的响应各持有一个；
+      被淘汰或发现文件变了时只是从表里摘掉，最后一个响应发完才真正munmap/close
+    - 按路径的哈希分成SHARDS片，每片一把锁、一个哈希表和一条LRU链表，字节数超过每片的容量时从链表尾淘汰
+    - 每个条目最多check_ms毫秒重新stat一次，inode、大小、修改时间或权限变了就丢掉，按未命中处理
+    - 放得进一片的文件才缓存（容量/SHARDS），更大的文件还是每次映射自己要发送的部分
+    - 条目上还可以挂一份gzip压缩后的内容（第一次需要时压缩），和文件内容一起计入容量，随条目一起淘汰和失效
+    用到zlib，链接时加-lz
+*/
+class file_cache {
+public:
+    static const int SHARDS = 16;
+    static const size_t ENTRY_OVERHEAD = 256; // 每个条目除文件内容以外大约占用的内存，空文件也要计入容量
+
+    struct entry {
+        std::string path;
+        int fd;
+        struct stat st;
+        char* addr;             // 整个文件的只读映射，空文件为nullptr
+        std::atomic<int> refs;
+        uint64_t checked_ms;    // 上次确认文件没变的时间，在所属分片的锁内读写
+        char* gzip;             // gzip压缩后的内容，没有压缩过或者压缩后没有明显变小时为nullptr
+        size_t gzip_len;
+        bool gzip_tried;        // 已经压缩过，gzip和gzip_len不会再变；这三个在所属分片的锁内写
+        entry* prev;            // 所属分片的LRU链表，表头是最近用过的
+        entry* next;
+    };
+
+    static file_cache& instance() {
+        static file_cache cache;
+        return cache;
+    }
+
+    // 容量为0表示不启用，在创建工作线程之前调用
+    void configure(size_t capacity, int check_ms) {
+        m_capacity = capacity;
+        m_shard_capacity = capacity / SHARDS;
+        m_check_ms = check_ms;
+    }
+    bool enabled() const { return m_capacity > 0; }
+
+    // 查找path，返回的条目多了一个引用，用完调用release；没有缓存或文件变了时返回nullptr
+    entry* acquire(const char* path) {
+        if (m_report.load(std::memory_order_relaxed) && m_report.exchange(false)) {
+            report();
+        }
+        std::string_view key(path);
+        shard& s = shard_of(key);
+        uint64_t now = now_ms();
+
+        s.lock.lock();
+        auto it = s.map.find(key);
+        if (it == s.map.end()) {
+            s.lock.unlock();
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        entry* e = it->second;
+        e->refs.fetch_add(1, std::memory_order_relaxed);
+        move_to_front(s, e);
+        // 到了检查时间只由一个线程去stat，其他线程照常使用
+        bool check = now >= e->checked_ms + m_check_ms;
+        if (check) {
+            e->checked_ms = now;
+        }
+        s.lock.unlock();
+
+        if (check) {
+            struct stat st;
+            if (stat(path, &st) < 0 || !same_file(st, e->st)) {
+                remove(s, e);
+                release(e);
+                m_stale.fetch_add(1, std::memory_order_relaxed);
+                m_misses.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        }
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return e;
+    }
+
+    // 未命中后，调用者stat过并确认可以发送的普通文件：打开、映射后放进缓存，返回的条目带一个引用
+    // 文件太大或打开、映射失败时返回nullptr，调用者自己处理
+    entry* insert(const char* path, const struct stat& st) {
+        if (!S_ISREG(st.st_mode) || (size_t) st.st_size + ENTRY_OVERHEAD > m_shard_capacity) {
+            return nullptr;
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        char* addr = nullptr;
+        if (st.st_size > 0) {
+            addr = (char*) mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+        }
+        entry* e = new entry;
+        e->path = path;
+        e->fd = fd;
+        e->st = st;
+        e->addr = addr;
+        e->refs.store(2, std::memory_order_relaxed); // 缓存一个，调用者一个
+        e->checked_ms = now_ms();
+        e->gzip = nullptr;
+        e->gzip_len = 0;
+        e->gzip_tried = false;
+        e->prev = e->next = nullptr;
+
+        std::string_view key(e->path);
+        shard& s = shard_of(key);
+        entry* dropped = nullptr; // 在锁外释放的条目，用next串起来
+        s.lock.lock();
+        auto it = s.map.find(key);
+        if (it != s.map.end()) {
+            entry* old = it->second;
+            if (same_file(old->st, st)) {
+                // 别的线程刚放进去同一个文件，用它的
+                old->refs.fetch_add(1, std::memory_order_relaxed);
+                move_to_front(s, old);
+                s.lock.unlock();
+                destroy(e);
+                return old;
+            }
+            unlink(s, old);
+            old->next = dropped;
+            dropped = old;
+        }
+        s.map.emplace(key, e);
+        push_front(s, e);
+        evict(s, e, dropped);
+        s.lock.unlock();
+
+        release_all(dropped);
+        return e;
+    }
+
+    // 条目的gzip压缩版本：第一次调用时用level级压缩整个文件，之后直接返回同一份
+    // 压缩后省不到1/8时记下不值得压缩，返回false，调用者发送原文件
+    bool compressed(entry* e, int level, const char** data, size_t* len) {
+        shard& s = shard_of(std::string_view(e->path));
+        s.lock.lock();
+        bool tried = e->gzip_tried;
+        s.lock.unlock();
+
+        if (!tried) {
+            // 在锁外压缩，几个线程同时第一次请求同一个文件时只留下先压缩完的那份
+            size_t out_len = 0;
+            char* out = gzip_compress(e->addr, e->st.st_size, level, out_len);
+            if (out && out_len >= (size_t) e->st.st_size - e->st.st_size / 8) {
+                free(out);
+                out = nullptr;
+            }
+            entry* dropped = nullptr;
+            s.lock.lock();
+            if (!e->gzip_tried) {
+                e->gzip_tried = true;
+                e->gzip = out;
+                e->gzip_len = out ? out_len : 0;
+                out = nullptr;
+                auto it = s.map.find(std::string_view(e->path));
+                if (it != s.map.end() && it->second == e) {
+                    // 还在缓存里才计入容量，已经摘掉的条目在最后一个引用释放时连同压缩的内容一起释放
+                    s.bytes += e->gzip_len;
+                    evict(s, e, dropped);
+                }
+            }
+            s.lock.unlock();
+            free(out);
+            release_all(dropped);
+        }
+
+        *data = e->gzip;
+        *len = e->gzip_len;
+        return e->gzip != nullptr;
+    }
+
+    void release(entry* e) {
+        if (e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy(e);
+        }
+    }
+
+    // 信号处理函数中调用：下一次查找时打印统计
+    void request_report() { m_report.store(true, std::memory_order_relaxed); }
+
+    void report() {
+        unsigned long hits = m_hits.load(std::memory_order_relaxed);
+        unsigned long misses = m_misses.load(std::memory_order_relaxed);
+        size_t bytes = 0;
+        size_t count = 0;
+        for (int i = 0; i < SHARDS; ++i) {
+            m_shards[i].lock.lock();
+            bytes += m_shards[i].bytes;
+            count += m_shards[i].map.size();
+            m_shards[i].lock.unlock();
+        }
+        printf("file cache: %zu entries, %zu/%zu KB, hits %lu, misses %lu (%.1f%% hit), evictions %lu, stale %lu\n",
+               count, bytes / 1024, m_capacity / 1024, hits, misses,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+               m_evictions.load(std::memory_order_relaxed), m_stale.load(std::memory_order_relaxed));
+        fflush(stdout);
+    }
+
+private:
+    struct shard {
+        locker lock;
+        std::unordered_map<std::string_view, entry*> map; // 键指向条目自己的path
+        entry* head;
+        entry* tail;
+        size_t bytes;
+        shard() : head(nullptr), tail(nullptr), bytes(0) {}
+    };
+
+    file_cache() : m_capacity(0), m_shard_capacity(0), m_check_ms(0), m_report(false),
+    m_hits(0), m_misses(0), m_evictions(0), m_stale(0) {}
+
+    ~file_cache() {
+        for (int i = 0; i < SHARDS; ++i) {
+            while (m_shards[i].head) {
+                entry* e = m_shards[i].head;
+                unlink(m_shards[i], e);
+                release(e);
+            }
+        }
+    }
+
+    shard& shard_of(std::string_view key) {
+        return m_shards[std::hash<std::string_view>()(key) % SHARDS];
+    }
+
+    static bool same_file(const struct stat& a, const struct stat& b) {
+        return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size && a.st_mode == b.st_mode
+            && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+    }
+
+    static size_t cost(const entry* e) { return e->st.st_size + e->gzip_len + ENTRY_OVERHEAD; }
+
+    // 带gzip头和尾的压缩结果，malloc分配
+    static char* gzip_compress(const char* data, size_t size, int level, size_t& out_len) {
+        if (size == 0 || size > UINT_MAX) {
+            return nullptr;
+        }
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // windowBits加16表示输出gzip格式而不是zlib格式
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return nullptr;
+        }
+        size_t bound = deflateBound(&zs, size);
+        char* out = (char*) malloc(bound);
+        if (!out) {
+            deflateEnd(&zs);
+            return nullptr;
+        }
+        zs.next_in = (Bytef*) data;
+        zs.avail_in = size;
+        zs.next_out = (Bytef*) out;
+        zs.avail_out = bound;
+        int ret = deflate(&zs, Z_FINISH);
+        out_len = zs.total_out;
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END) {
+            free(out);
+            return nullptr;
+        }
+        return out;
+    }
+
+    void release_all(entry* dropped) {
+        while (dropped) {
+            entry* next = dropped->next;
+            release(dropped);
+            dropped = next;
+        }
+    }
+
+    // 文件变了：如果表里还是这个条目就摘掉并释放缓存的引用（可能已经被别的线程摘掉或替换了）
+    void remove(shard& s, entry* e) {
+        s.lock.lock();
+        auto it = s.map.find(std::string_view(e->path));
+        bool found = it != s.map.end() && it->second == e;
+        if (found) {
+            unlink(s, e);
+        }
+        s.lock.unlock();
+        if (found) {
+            release(e);
+        }
+    }
+
+    // 以下在分片的锁内调用
+    void push_front(shard& s, entry* e) {
+        e->prev = nullptr;
+        e->next = s.head;
+        if (s.head) s.head->prev = e;
+        else s.tail = e;
+        s.head = e;
+        s.bytes += cost(e);
+    }
+
+    // 超过容量时从链表尾淘汰，keep（刚用到的条目）不淘汰；淘汰的条目用next串到dropped上，在锁外释放
+    void evict(shard& s, entry* keep, entry*& dropped) {
+        while (s.bytes > m_shard_capacity && s.tail != keep) {
+            entry* victim = s.tail;
+            unlink(s, victim);
+            victim->next = dropped;
+            dropped = victim;
+            m_evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void move_to_front(shard& s, entry* e) {
+        if (s.head == e) return;
+        e->prev->next = e->next;
+        if (e->next) e->next->prev = e->prev;
+        else s.tail = e->prev;
+        e->prev = nullptr;
+        e->next = s.head;
+        s.head->prev = e;
+        s.head = e;
+    }
+
+    // 从表和链表中摘掉，缓存持有的引用交给调用者在锁外释放
+    void unlink(shard& s, entry* e) {
+        s.map.erase(std::string_view(e->path));
+        if (e->prev) e->prev->next = e->next;
+        else s.head = e->next;
+        if (e->next) e->next->prev = e->prev;
+        else s.tail = e->prev;
+        e->prev = e->next = nullptr;
+        s.bytes -= cost(e);
+    }
+
+    static void destroy(entry* e) {
+        if (e->addr) {
+            munmap(e->addr, e->st.st_size);
+        }
+        free(e->gzip);
+        close(e->fd);
+        delete e;
+    }
+
+private:
+    size_t m_capacity;
+    size_t m_shard_capacity;
+    int m_check_ms;
+    shard m_shards[SHARDS];
+    std::atomic<bool> m_report;
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_evictions;
+    std::atomic<unsigned long> m_stale;
+};
+
+#endif
@@ -0,0 +1,502 @@
+#include "hpack.h"
+
+static const int STATIC_COUNT = 61;
+
+// RFC 7541 附录A
+static const hpack_field static_table[STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 附录B，最后一个是EOS；码是规范的（同样长度的码按符号顺序连续），解码时按长度区间查
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const uint8_t huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 规范Huffman码的解码表：每种长度的第一个码、个数，以及按(长度, 符号)排好序的符号
+struct huffman_decode_table {
+    uint32_t first[31];
+    uint32_t count[31];
+    uint16_t offset[31];
+    uint16_t symbols[257];
+
+    huffman_decode_table() {
+        memset(count, 0, sizeof(count));
+        for (int s = 0; s < 257; ++s) {
+            ++count[huffman_lens[s]];
+        }
+        int n = 0;
+        for (int len = 0; len <= 30; ++len) {
+            offset[len] = n;
+            first[len] = ~0u;
+            for (int s = 0; s < 257; ++s) {
+                if (huffman_lens[s] == len) {
+                    if (first[len] == ~0u) {
+                        first[len] = huffman_codes[s];
+                    }
+                    symbols[n++] = s;
+                }
+            }
+        }
+    }
+};
+
+static const huffman_decode_table huffman_table;
+
+// 解码到out，返回长度；格式错误（出现EOS、多于7位或者不全是1的填充）返回-1，放不下返回-2
+static long huffman_decode(const uint8_t* p, size_t len, char* out, size_t room) {
+    uint64_t bits = 0;
+    int nbits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        bits = (bits << 8) | p[i];
+        nbits += 8;
+        while (nbits >= 5) {
+            int sym = -1;
+            int used = 0;
+            for (int l = 5; l <= 30 && l <= nbits; ++l) {
+                uint32_t code = (bits >> (nbits - l)) & ((1u << l) - 1);
+                if (code - huffman_table.first[l] < huffman_table.count[l]) {
+                    sym = huffman_table.symbols[huffman_table.offset[l] + code - huffman_table.first[l]];
+                    used = l;
+                    break;
+                }
+            }
+            if (sym < 0) {
+                if (nbits >= 30) {
+                    return -1;
+                }
+                break; // 还不够一个码
+            }
+            if (sym == 256) {
+                return -1;
+            }
+            if (n == room) {
+                return -2;
+            }
+            out[n++] = sym;
+            nbits -= used;
+        }
+        bits &= (1ULL << nbits) - 1;
+    }
+    // 结尾的填充是EOS的开头几位，也就是全1
+    if (nbits > 7 || bits != (1ULL << nbits) - 1) {
+        return -1;
+    }
+    return n;
+}
+
+static size_t huffman_length(std::string_view s) {
+    size_t bits = 0;
+    for (unsigned char c : s) {
+        bits += huffman_lens[c];
+    }
+    return (bits + 7) / 8;
+}
+
+static int huffman_encode(uint8_t* out, std::string_view s) {
+    uint64_t acc = 0;
+    int nbits = 0;
+    int n = 0;
+    for (unsigned char c : s) {
+        acc = (acc << huffman_lens[c]) | huffman_codes[c];
+        nbits += huffman_lens[c];
+        while (nbits >= 8) {
+            nbits -= 8;
+            out[n++] = acc >> nbits;
+        }
+    }
+    if (nbits > 0) {
+        out[n++] = (acc << (8 - nbits)) | ((1u << (8 - nbits)) - 1);
+    }
+    return n;
+}
+
+// 前缀为prefix位的整数（5.1节），太大（超过28位）时当作格式错误
+static bool decode_int(const uint8_t*& p, const uint8_t* end, int prefix, uint32_t& v) {
+    uint32_t max = (1u << prefix) - 1;
+    v = *p++ & max;
+    if (v < max) {
+        return true;
+    }
+    for (int shift = 0; p < end && shift <= 21; shift += 7) {
+        uint8_t b = *p++;
+        v += (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// first是第一个字节中前缀之外的标志位
+static int encode_int(uint8_t* out, int prefix, uint8_t first, uint32_t v) {
+    uint32_t max = (1u << prefix) - 1;
+    if (v < max) {
+        out[0] = first | v;
+        return 1;
+    }
+    out[0] = first | max;
+    v -= max;
+    int n = 1;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+static int encode_string(uint8_t* out, std::string_view s) {
+    size_t huffman = huffman_length(s);
+    if (huffman < s.size()) {
+        int n = encode_int(out, 7, 0x80, huffman);
+        return n + huffman_encode(out + n, s);
+    }
+    int n = encode_int(out, 7, 0, s.size());
+    memcpy(out + n, s.data(), s.size());
+    return n + s.size();
+}
+
+void hpack_table::evict(uint32_t room) {
+    while (m_count > 0 && m_size + room > m_max_size) {
+        const entry& e = m_entries[(m_head + m_count - 1) % CAPACITY];
+        m_size -= e.data.size() + ENTRY_OVERHEAD;
+        --m_count;
+    }
+}
+
+// 比整个表还大的条目不加入，但表会被清空（4.4节）
+void hpack_table::add(std::string_view name, std::string_view value) {
+    uint32_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+    evict(size);
+    if (size > m_max_size) {
+        return;
+    }
+    m_head = (m_head + CAPACITY - 1) % CAPACITY;
+    entry& e = m_entries[m_head];
+    e.data.assign(name.data(), name.size());
+    e.data.append(value.data(), value.size());
+    e.name_len = name.size();
+    m_size += size;
+    ++m_count;
+}
+
+void hpack_table::set_max_size(uint32_t size) {
+    m_max_size = size;
+    evict(0);
+}
+
+int hpack_table::find(std::string_view name, std::string_view value) const {
+    for (int i = 0; i < m_count; ++i) {
+        hpack_field f = at(i);
+        if (f.name == name && f.value == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+hpack_decoder::RESULT hpack_decoder::decode(const uint8_t* p, size_t len, char* storage, size_t storage_size,
+                                            hpack_field* fields, int max_fields, int& count) {
+    const uint8_t* end = p + len;
+    size_t used = 0;
+    count = 0;
+    bool too_large = false;
+    bool fields_seen = false;
+
+    // 拷一个字符串到storage，返回false表示格式错误；放不下时只记下too_large，动态表仍然要更新
+    char spill[hpack_table::DEFAULT_SIZE];
+    auto read_string = [&](std::string_view& s) -> bool {
+        if (p >= end) {
+            return false;
+        }
+        bool huffman = *p & 0x80;
+        uint32_t n;
+        if (!decode_int(p, end, 7, n) || n > (size_t) (end - p)) {
+            return false;
+        }
+        // storage放不下时先解到spill里，解出来的字符串只用来更新动态表
+        char* out = storage + used;
+        size_t room = storage_size - used;
+        if (too_large) {
+            out = spill;
+            room = sizeof(spill);
+        }
+        if (huffman) {
+            long r = huffman_decode(p, n, out, room);
+            if (r == -1) {
+                return false;
+            }
+            if (r == -2) {
+                if (out == spill) {
+                    return false; // 比整个动态表还长的字符串，当作格式错误
+                }
+                too_large = true;
+                out = spill;
+                r = huffman_decode(p, n, spill, sizeof(spill));
+                if (r < 0) {
+                    return false;
+                }
+            }
+            s = std::string_view(out, r);
+        } else {
+            if (n > room) {
+                if (out == spill || n > sizeof(spill)) {
+                    return false;
+                }
+                too_large = true;
+                out = spill;
+            }
+            memcpy(out, p, n);
+            s = std::string_view(out, n);
+        }
+        if (out != spill) {
+            used += s.size();
+        }
+        p += n;
+        return true;
+    };
+    // 下标对应的字段，1~61是静态表，之后是动态表
+    auto lookup = [&](uint32_t index, hpack_field& f) -> bool {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= (uint32_t) STATIC_COUNT) {
+            f = static_table[index - 1];
+            return true;
+        }
+        if (index - STATIC_COUNT > (uint32_t) m_table.count()) {
+            return false;
+        }
+        f = m_table.at(index - STATIC_COUNT - 1);
+        return true;
+    };
+    // 动态表中的名字和值在后面的插入中可能被覆盖，也要拷到storage里
+    auto emit = [&](std::string_view name, std::string_view value, bool copy_name, bool copy_value) {
+        if (count == max_fields) {
+            too_large = true;
+        }
+        if (too_large) {
+            return;
+        }
+        for (int i = 0; i < 2; ++i) {
+            std::string_view& s = i == 0 ? name : value;
+            if (!(i == 0 ? copy_name : copy_value)) {
+                continue;
+            }
+            if (s.size() > storage_size - used) {
+                too_large = true;
+                return;
+            }
+            memcpy(storage + used, s.data(), s.size());
+            s = std::string_view(storage + used, s.size());
+            used += s.size();
+        }
+        fields[count].name = name;
+        fields[count].value = value;
+        ++count;
+    };
+
+    while (p < end) {
+        uint8_t b = *p;
+        if (b & 0x80) {
+            // 6.1 已经在表中的字段
+            uint32_t index;
+            hpack_field f;
+            if (!decode_int(p, end, 7, index) || !lookup(index, f)) {
+                return ERROR;
+            }
+            bool dynamic = index > (uint32_t) STATIC_COUNT;
+            emit(f.name, f.value, dynamic, dynamic);
+            fields_seen = true;
+        } else if ((b & 0xe0) == 0x20) {
+            // 6.3 动态表大小更新，只能出现在块的开头
+            uint32_t size;
+            if (fields_seen || !decode_int(p, end, 5, size) || size > hpack_table::DEFAULT_SIZE) {
+                return ERROR;
+            }
+            m_table.set_max_size(size);
+        } else {
+            // 6.2 字面值：01加入动态表，0000不加入，0001永不加入
+            bool add = (b & 0xc0) == 0x40;
+            uint32_t index;
+            if (!decode_int(p, end, add ? 6 : 4, index)) {
+                return ERROR;
+            }
+            hpack_field f;
+            bool name_literal = index == 0;
+            if (name_literal) {
+                if (!read_string(f.name)) {
+                    return ERROR;
+                }
+            } else if (!lookup(index, f)) {
+                return ERROR;
+            }
+            if (!read_string(f.value)) {
+                return ERROR;
+            }
+            // 加入动态表可能覆盖f.name所在的条目，先输出
+            bool name_dynamic = !name_literal && index > (uint32_t) STATIC_COUNT;
+            emit(f.name, f.value, name_dynamic, false);
+            if (add) {
+                if (name_dynamic) {
+                    // 名字在动态表中，插入时可能被淘汰，先拷一份
+                    std::string name(f.name);
+                    m_table.add(name, f.value);
+                } else {
+                    m_table.add(f.name, f.value);
+                }
+            }
+            fields_seen = true;
+        }
+    }
+    return too_large ? TOO_LARGE : OK;
+}
+
+void hpack_encoder::set_peer_max_size(uint32_t size) {
+    if (size < m_table.max_size()) {
+        m_table.set_max_size(size);
+        m_size_update = true;
+    }
+}
+
+int hpack_encoder::begin_block(uint8_t* out) {
+    if (!m_size_update) {
+        return 0;
+    }
+    m_size_update = false;
+    return encode_int(out, 5, 0x20, m_table.max_size());
+}
+
+int hpack_encoder::indexed(uint8_t* out, int static_index) {
+    return encode_int(out, 7, 0x80, static_index);
+}
+
+int hpack_encoder::encode(uint8_t* out, int name_index, std::string_view name, std::string_view value, bool index) {
+    if (index) {
+        int i = m_table.find(name, value);
+        if (i >= 0) {
+            return encode_int(out, 7, 0x80, STATIC_COUNT + 1 + i);
+        }
+    }
+    int n = index ? encode_int(out, 6, 0x40, name_index) : encode_int(out, 4, 0, name_index);
+    if (name_index == 0) {
+        n += encode_string(out + n, name);
+    }
+    n += encode_string(out + n, value);
+    if (index) {
+        m_table.add(name, value);
+    }
+    return n;
+}
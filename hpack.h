@@ -0,0 +1,118 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+
+/*
+    HPACK（RFC 7541）：HTTP/2的头部压缩，每个连接一个解码器（请求）和一个编码器（响应）
+    - 静态表：61个常见字段，两边都知道，只发下标
+    - 动态表：每个方向各一个，按加入的先后编号，最新的是62；总大小（名字+值+32）超过上限时淘汰最旧的
+    - 字符串可以用固定的Huffman码压缩，浏览器几乎总是压缩的
+*/
+struct hpack_field {
+    std::string_view name;
+    std::string_view value;
+};
+
+// 动态表：固定大小的环，槽里的字符串被覆盖时复用之前的空间，预热之后不再分配内存
+class hpack_table {
+public:
+    static const uint32_t DEFAULT_SIZE = 4096; // SETTINGS_HEADER_TABLE_SIZE的默认值，也是这里支持的上限
+    static const int ENTRY_OVERHEAD = 32;      // 每个条目在表大小中额外算的字节数
+
+    hpack_table() : m_head(0), m_count(0), m_size(0), m_max_size(DEFAULT_SIZE) {}
+
+    int count() const { return m_count; }
+    uint32_t max_size() const { return m_max_size; }
+    // 第i个条目，0是最新的
+    hpack_field at(int i) const {
+        const entry& e = m_entries[(m_head + i) % CAPACITY];
+        return { std::string_view(e.data.data(), e.name_len),
+                 std::string_view(e.data.data() + e.name_len, e.data.size() - e.name_len) };
+    }
+    void add(std::string_view name, std::string_view value);
+    void set_max_size(uint32_t size); // 调用者保证不超过DEFAULT_SIZE
+    // 名字和值都相同的条目，返回下标，没有时返回-1
+    int find(std::string_view name, std::string_view value) const;
+
+private:
+    static const int CAPACITY = DEFAULT_SIZE / ENTRY_OVERHEAD + 1; // 每个条目至少32字节，条目数不会更多
+
+    struct entry {
+        std::string data; // 名字和值连在一起
+        uint32_t name_len;
+    };
+    void evict(uint32_t room); // 淘汰最旧的，直到再放room字节不超过上限
+
+    entry m_entries[CAPACITY];
+    int m_head;      // 最新条目所在的槽，新条目放在它前面
+    int m_count;
+    uint32_t m_size;
+    uint32_t m_max_size;
+};
+
+class hpack_decoder {
+public:
+    enum RESULT { OK, TOO_LARGE, ERROR };
+
+    /*
+        解码一个完整的头部块。名字和值拷到storage里（动态表之后可能淘汰它们），
+        fields指向storage，最多max_fields个；storage或fields放不下时返回TOO_LARGE，
+        这时动态表已经没法和对方保持一致，只能关闭连接；格式错误返回ERROR（COMPRESSION_ERROR）
+    */
+    RESULT decode(const uint8_t* p, size_t len, char* storage, size_t storage_size,
+                  hpack_field* fields, int max_fields, int& count);
+
+private:
+    hpack_table m_table;
+};
+
+class hpack_encoder {
+public:
+    hpack_encoder() : m_size_update(false) {}
+
+    // 对方的SETTINGS_HEADER_TABLE_SIZE：只会比默认值小时才需要缩小，下一个头部块开头通知对方
+    void set_peer_max_size(uint32_t size);
+    // 头部块的开头，有待通知的表大小变化时写进去，返回字节数
+    int begin_block(uint8_t* out);
+    /*
+        编码一个字段，返回写入的字节数
+        name_index：名字在静态表中的下标，0表示不在静态表里
+        index：加入动态表，同一连接后面的响应再出现同样的字段时只发一个字节的下标；
+        每个响应都不同的值（长度、ETag等）不加，免得把有用的条目挤出去
+        out要留够名字和值的长度再加10字节
+    */
+    int encode(uint8_t* out, int name_index, std::string_view name, std::string_view value, bool index);
+    // 只发静态表中的下标（如:status 200），返回1
+    static int indexed(uint8_t* out, int static_index);
+
+private:
+    hpack_table m_table;
+    bool m_size_update;
+};
+
+// 静态表中用到的下标
+enum HPACK_STATIC {
+    HPACK_STATUS_200 = 8,
+    HPACK_STATUS_204 = 9,
+    HPACK_STATUS_206 = 10,
+    HPACK_STATUS_304 = 11,
+    HPACK_STATUS_400 = 12,
+    HPACK_STATUS_404 = 13,
+    HPACK_STATUS_500 = 14,
+    HPACK_ACCEPT_RANGES = 18,
+    HPACK_ALLOW = 22,
+    HPACK_CONTENT_ENCODING = 26,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_RANGE = 30,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44,
+    HPACK_RETRY_AFTER = 53,
+    HPACK_VARY = 59,
+};
+
+#endif
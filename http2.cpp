@@ -0,0 +1,758 @@
+#include "http2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+const char http2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧的标志
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+// SETTINGS的参数
+static const int SETTINGS_HEADER_TABLE_SIZE = 0x1;
+static const int SETTINGS_ENABLE_PUSH = 0x2;
+static const int SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const int SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const int SETTINGS_MAX_FRAME_SIZE = 0x5;
+static const int SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+static const int64_t MAX_WINDOW = 0x7fffffff;
+// build()最后给每个流的RST_STREAM留的位置
+static const int RESET_ROOM = (http2_session::FRAME_HEADER + 4) * http2_session::MAX_STREAMS;
+
+static const char* upgrade_response =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+
+static inline uint32_t read_u32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline int frame_length(const uint8_t* p) {
+    return p[0] << 16 | p[1] << 8 | p[2];
+}
+
+// HTTP2-Settings是base64url（不带填充），返回解码后的长度，格式不对或放不下时返回-1
+static int base64url_decode(std::string_view in, uint8_t* out, int room) {
+    uint32_t acc = 0;
+    int bits = 0;
+    int n = 0;
+    for (char c : in) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-') v = 62;
+        else if (c == '_') v = 63;
+        else if (c == '=') break;
+        else return -1;
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == room) {
+                return -1;
+            }
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+http2_session::http2_session(int max_header_list) :
+    m_preface_left(PREFACE_LEN), m_settings_seen(false), m_frame_len(0),
+    m_block_len(0), m_block_size(max_header_list), m_block_stream(0), m_block_end_stream(false),
+    m_storage_size(max_header_list), m_field_count(0), m_request_stream(0),
+    m_active(0), m_last_stream(0), m_serial(0),
+    m_send_window(DEFAULT_WINDOW), m_initial_window(DEFAULT_WINDOW), m_peer_max_frame(MAX_FRAME), m_recv_unacked(0),
+    m_closing(false), m_peer_goaway(false), m_out_len(0), m_out_sent(0), m_headers_start(0) {
+    m_block = (uint8_t*) malloc(m_block_size);
+    m_storage = (char*) malloc(m_storage_size);
+    memset(m_streams, 0, sizeof(m_streams));
+}
+
+http2_session::~http2_session() {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i].id) {
+            release(m_streams[i]);
+        }
+    }
+    free(m_block);
+    free(m_storage);
+}
+
+void http2_session::write_frame_header(int length, int type, int flags, uint32_t id) {
+    uint8_t* p = m_out + m_out_len;
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = id >> 24;
+    p[6] = id >> 16;
+    p[7] = id >> 8;
+    p[8] = id;
+    m_out_len += FRAME_HEADER;
+}
+
+void http2_session::write_u32(uint32_t v) {
+    uint8_t* p = m_out + m_out_len;
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    m_out_len += 4;
+}
+
+// 服务端的SETTINGS：并发的流数和请求头的大小上限，其余用默认值
+void http2_session::start() {
+    write_frame_header(12, SETTINGS, 0, 0);
+    m_out[m_out_len++] = 0;
+    m_out[m_out_len++] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(MAX_STREAMS);
+    m_out[m_out_len++] = 0;
+    m_out[m_out_len++] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_u32(m_storage_size);
+}
+
+bool http2_session::upgrade(std::string_view settings) {
+    uint8_t payload[96];
+    int len = base64url_decode(settings, payload, sizeof(payload));
+    if (len < 0 || len % 6 != 0) {
+        return false;
+    }
+    int n = strlen(upgrade_response);
+    memcpy(m_out + m_out_len, upgrade_response, n);
+    m_out_len += n;
+    start();
+    // 101已经相当于确认了这些设置，不用再回SETTINGS ACK
+    if (!apply_settings(payload, len)) {
+        return true;
+    }
+    stream& s = m_streams[0];
+    memset(&s, 0, sizeof(s));
+    s.id = 1;
+    s.window = m_initial_window;
+    s.urgency = 3;
+    s.remote_closed = true;
+    s.body.fd = s.body.own_fd = -1;
+    m_active = 1;
+    m_last_stream = 1;
+    return true;
+}
+
+http2_session::EVENT http2_session::fail(ERROR_CODE code) {
+    shutdown(code);
+    return CLOSING;
+}
+
+void http2_session::shutdown(ERROR_CODE code) {
+    if (m_closing) {
+        return;
+    }
+    m_closing = true;
+    write_frame_header(8, GOAWAY, 0, 0);
+    write_u32(m_last_stream);
+    write_u32(code);
+}
+
+http2_session::stream* http2_session::find(uint32_t id) {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i].id == id) {
+            return &m_streams[i];
+        }
+    }
+    return nullptr;
+}
+
+void http2_session::release(stream& s) {
+    body_source& b = s.body;
+    if (b.cached) {
+        file_cache::instance().release(b.cached);
+    } else if (b.bundle) {
+        asset_bundle::instance().release(b.bundle);
+    } else {
+        if (b.map) {
+            munmap(b.map, b.map_size);
+        }
+        if (b.own_fd >= 0) {
+            close(b.own_fd);
+        }
+    }
+    memset(&b, 0, sizeof(b));
+    b.fd = b.own_fd = -1;
+}
+
+http2_session::EVENT http2_session::consume(const char* data, int len, int& used) {
+    const uint8_t* in = (const uint8_t*) data;
+    used = 0;
+    if (m_closing) {
+        used = len;
+        return CLOSING;
+    }
+    if (m_preface_left > 0) {
+        int n = std::min(len, m_preface_left);
+        used = n;
+        if (memcmp(in, PREFACE + PREFACE_LEN - m_preface_left, n) != 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        m_preface_left -= n;
+        if (m_preface_left > 0) {
+            return NEED_MORE;
+        }
+    }
+
+    // 跨两次读的帧拼到m_frame里，返回是否凑齐了n字节
+    auto fill = [&](int n) -> bool {
+        int k = std::min(n - m_frame_len, len - used);
+        if (k > 0) {
+            memcpy(m_frame + m_frame_len, in + used, k);
+            m_frame_len += k;
+            used += k;
+        }
+        return m_frame_len >= n;
+    };
+
+    while (true) {
+        if (m_out_len > OUT_SIZE - OUT_RESERVE) {
+            return OUTPUT_FULL;
+        }
+        const uint8_t* frame = nullptr;
+        if (m_frame_len == 0 && len - used >= FRAME_HEADER) {
+            int total = FRAME_HEADER + frame_length(in + used);
+            if (total > FRAME_HEADER + MAX_FRAME) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (len - used >= total) {
+                // 完整的帧就在读缓冲里，不用拷贝
+                frame = in + used;
+                used += total;
+            }
+        }
+        if (!frame) {
+            if (!fill(FRAME_HEADER)) {
+                return NEED_MORE;
+            }
+            int total = FRAME_HEADER + frame_length(m_frame);
+            if (total > FRAME_HEADER + MAX_FRAME) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (!fill(total)) {
+                return NEED_MORE;
+            }
+            frame = m_frame;
+            m_frame_len = 0;
+        }
+        EVENT ev = on_frame(frame);
+        if (ev != NEED_MORE) {
+            return ev;
+        }
+    }
+}
+
+// 处理一个完整的帧，NEED_MORE表示接着处理下一个
+http2_session::EVENT http2_session::on_frame(const uint8_t* frame) {
+    int length = frame_length(frame);
+    int type = frame[3];
+    int flags = frame[4];
+    uint32_t id = read_u32(frame + 5) & 0x7fffffff;
+    const uint8_t* p = frame + FRAME_HEADER;
+
+    // 头部块没收完时只能是它的CONTINUATION；序言之后的第一个帧必须是SETTINGS
+    if ((m_block_stream && type != CONTINUATION) || (!m_settings_seen && type != SETTINGS)) {
+        return fail(PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+        case DATA: {
+            if (id == 0 || id > m_last_stream) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if ((flags & FLAG_PADDED) && (length < 1 || p[0] >= length)) {
+                return fail(PROTOCOL_ERROR);
+            }
+            // 请求体不处理（只支持GET、HEAD、OPTIONS），但整个帧都算在连接的接收窗口里，要还给对方
+            m_recv_unacked += length;
+            if (m_recv_unacked >= DEFAULT_WINDOW / 2) {
+                write_frame_header(4, WINDOW_UPDATE, 0, 0);
+                write_u32(m_recv_unacked);
+                m_recv_unacked = 0;
+            }
+            stream* s = find(id);
+            if (s && (flags & FLAG_END_STREAM)) {
+                s->remote_closed = true;
+            }
+            return NEED_MORE;
+        }
+        case HEADERS: {
+            if (id == 0 || !(id & 1)) {
+                return fail(PROTOCOL_ERROR);
+            }
+            int off = 0;
+            int len = length;
+            if (flags & FLAG_PADDED) {
+                if (len < 1 || p[0] > len - 1) {
+                    return fail(PROTOCOL_ERROR);
+                }
+                len -= 1 + p[0];
+                off = 1;
+            }
+            if (flags & FLAG_PRIORITY) {
+                // RFC 7540的依赖和权重已经废弃，跳过
+                if (len < 5) {
+                    return fail(PROTOCOL_ERROR);
+                }
+                off += 5;
+                len -= 5;
+            }
+            if (flags & FLAG_END_HEADERS) {
+                return on_header_block(id, p + off, len, flags & FLAG_END_STREAM);
+            }
+            if ((size_t) len > m_block_size) {
+                return fail(ENHANCE_YOUR_CALM);
+            }
+            memcpy(m_block, p + off, len);
+            m_block_len = len;
+            m_block_stream = id;
+            m_block_end_stream = flags & FLAG_END_STREAM;
+            return NEED_MORE;
+        }
+        case CONTINUATION: {
+            if (id != m_block_stream || id == 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (m_block_len + length > m_block_size) {
+                return fail(ENHANCE_YOUR_CALM);
+            }
+            memcpy(m_block + m_block_len, p, length);
+            m_block_len += length;
+            if (!(flags & FLAG_END_HEADERS)) {
+                return NEED_MORE;
+            }
+            m_block_stream = 0;
+            return on_header_block(id, m_block, m_block_len, m_block_end_stream);
+        }
+        case PRIORITY:
+            if (id == 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (length != 5) {
+                reset_stream(id, FRAME_SIZE_ERROR);
+            }
+            return NEED_MORE;
+        case RST_STREAM: {
+            if (length != 4) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (id == 0 || id > m_last_stream) {
+                return fail(PROTOCOL_ERROR);
+            }
+            // 客户端取消了请求（比如页面跳走了），不用再发
+            stream* s = find(id);
+            if (s) {
+                release(*s);
+                s->id = 0;
+                --m_active;
+            }
+            return NEED_MORE;
+        }
+        case SETTINGS:
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (flags & FLAG_ACK) {
+                return length == 0 ? NEED_MORE : fail(FRAME_SIZE_ERROR);
+            }
+            if (length % 6 != 0) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (!apply_settings(p, length)) {
+                return CLOSING;
+            }
+            m_settings_seen = true;
+            write_frame_header(0, SETTINGS, FLAG_ACK, 0);
+            return NEED_MORE;
+        case PUSH_PROMISE:
+            return fail(PROTOCOL_ERROR);
+        case PING:
+            if (length != 8) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (!(flags & FLAG_ACK)) {
+                write_frame_header(8, PING, FLAG_ACK, 0);
+                memcpy(m_out + m_out_len, p, 8);
+                m_out_len += 8;
+            }
+            return NEED_MORE;
+        case GOAWAY:
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (length < 8) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            // 已经开始的流照常发完，之后关闭连接
+            m_peer_goaway = true;
+            return NEED_MORE;
+        case WINDOW_UPDATE: {
+            if (length != 4) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            uint32_t increment = read_u32(p) & 0x7fffffff;
+            if (id == 0) {
+                if (increment == 0) {
+                    return fail(PROTOCOL_ERROR);
+                }
+                m_send_window += increment;
+                return m_send_window > MAX_WINDOW ? fail(FLOW_CONTROL_ERROR) : NEED_MORE;
+            }
+            if (id > m_last_stream) {
+                return fail(PROTOCOL_ERROR);
+            }
+            stream* s = find(id);
+            if (!s) {
+                return NEED_MORE; // 已经发完（或者重置了）的流
+            }
+            if (increment == 0) {
+                reset_stream(id, PROTOCOL_ERROR);
+            } else if ((int64_t) s->window + increment > MAX_WINDOW) {
+                reset_stream(id, FLOW_CONTROL_ERROR);
+            } else {
+                s->window += increment;
+            }
+            return NEED_MORE;
+        }
+        case PRIORITY_UPDATE: {
+            // RFC 9218：流号，后面是和priority头部一样的值
+            if (id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (length < 4) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            stream* s = find(read_u32(p) & 0x7fffffff);
+            if (s) {
+                parse_priority(std::string_view((const char*) p + 4, length - 4), *s);
+            }
+            return NEED_MORE;
+        }
+        default:
+            // 不认识的帧类型忽略
+            return NEED_MORE;
+    }
+}
+
+bool http2_session::apply_settings(const uint8_t* p, int len) {
+    for (int i = 0; i + 6 <= len; i += 6) {
+        int id = p[i] << 8 | p[i + 1];
+        uint32_t value = read_u32(p + i + 2);
+        switch (id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                m_encoder.set_peer_max_size(value);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    fail(PROTOCOL_ERROR);
+                    return false;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > MAX_WINDOW) {
+                    fail(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                // 已经打开的流的窗口按差值调整，可能变成负数
+                int64_t delta = (int64_t) value - m_initial_window;
+                for (int j = 0; j < MAX_STREAMS; ++j) {
+                    if (m_streams[j].id) {
+                        if (m_streams[j].window + delta > MAX_WINDOW) {
+                            fail(FLOW_CONTROL_ERROR);
+                            return false;
+                        }
+                        m_streams[j].window += delta;
+                    }
+                }
+                m_initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < (uint32_t) MAX_FRAME || value > 0xffffff) {
+                    fail(PROTOCOL_ERROR);
+                    return false;
+                }
+                m_peer_max_frame = value;
+                break;
+            default:
+                // MAX_CONCURRENT_STREAMS限制的是我们推送的流，不推送；其余的忽略
+                break;
+        }
+    }
+    return true;
+}
+
+http2_session::EVENT http2_session::on_header_block(uint32_t id, const uint8_t* block, size_t len, bool end_stream) {
+    // 不管这个流接不接受都要解码，动态表要和对方保持一致
+    hpack_decoder::RESULT r = m_decoder.decode(block, len, m_storage, m_storage_size, m_fields, MAX_FIELDS, m_field_count);
+    m_block_len = 0;
+    if (r == hpack_decoder::ERROR) {
+        return fail(COMPRESSION_ERROR);
+    }
+    if (r == hpack_decoder::TOO_LARGE) {
+        // 超过了我们告诉对方的MAX_HEADER_LIST_SIZE
+        return fail(ENHANCE_YOUR_CALM);
+    }
+
+    stream* s = find(id);
+    if (s) {
+        // 已经打开的流上的第二个HEADERS是请求体后面的trailer，必须结束请求
+        if (s->remote_closed || !end_stream) {
+            return fail(PROTOCOL_ERROR);
+        }
+        s->remote_closed = true;
+        return NEED_MORE;
+    }
+    if (id <= m_last_stream) {
+        // 我们已经回应完并重置了的流，对方还在路上的帧忽略
+        return NEED_MORE;
+    }
+    m_last_stream = id;
+    if (m_closing || m_peer_goaway) {
+        return NEED_MORE;
+    }
+
+    if (m_active < MAX_STREAMS) {
+        for (int i = 0; i < MAX_STREAMS; ++i) {
+            if (m_streams[i].id == 0) {
+                s = &m_streams[i];
+                break;
+            }
+        }
+    }
+    if (!s) {
+        write_frame_header(4, RST_STREAM, 0, id);
+        write_u32(REFUSED_STREAM);
+        return NEED_MORE;
+    }
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->window = m_initial_window;
+    s->urgency = 3;
+    s->remote_closed = end_stream;
+    s->body.fd = s->body.own_fd = -1;
+    ++m_active;
+    for (int i = 0; i < m_field_count; ++i) {
+        if (m_fields[i].name == "priority") {
+            parse_priority(m_fields[i].value, *s);
+        } else if (m_fields[i].name == "content-length") {
+            std::string_view v = m_fields[i].value;
+            s->small_body = !v.empty() && v.size() <= 5 && v.find_first_not_of("0123456789") == std::string_view::npos
+                && atoi(std::string(v).c_str()) <= DEFAULT_WINDOW;
+        }
+    }
+    m_request_stream = id;
+    return REQUEST;
+}
+
+// priority: u=1, i（RFC 9218），不认识的参数忽略
+void http2_session::parse_priority(std::string_view value, stream& s) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+        while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+        if (item.size() == 3 && item[0] == 'u' && item[1] == '=' && item[2] >= '0' && item[2] <= '7') {
+            s.urgency = item[2] - '0';
+        } else if (item == "i" || item == "i=?1") {
+            s.incremental = true;
+        } else if (item == "i=?0") {
+            s.incremental = false;
+        }
+    }
+}
+
+void http2_session::begin_headers() {
+    m_headers_start = m_out_len;
+    m_out_len += FRAME_HEADER;
+    m_out_len += m_encoder.begin_block(m_out + m_out_len);
+}
+
+void http2_session::add_status(int status) {
+    uint8_t* out = m_out + m_out_len;
+    switch (status) {
+        case 200: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_200); return;
+        case 204: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_204); return;
+        case 206: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_206); return;
+        case 304: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_304); return;
+        case 400: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_400); return;
+        case 404: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_404); return;
+        case 500: m_out_len += hpack_encoder::indexed(out, HPACK_STATUS_500); return;
+    }
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%03d", status);
+    add_header(HPACK_STATUS_200, ":status", std::string_view(digits, 3), false);
+}
+
+void http2_session::end_headers(uint32_t id, const body_source* body) {
+    bool end_stream = !body || body->left == 0;
+    int length = m_out_len - m_headers_start - FRAME_HEADER;
+    int end = m_out_len;
+    m_out_len = m_headers_start;
+    write_frame_header(length, HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0), id);
+    m_out_len = end;
+
+    stream* s = find(id);
+    if (body) {
+        s->body = *body;
+    }
+    if (end_stream) {
+        s->done = true;
+    }
+}
+
+void http2_session::reset_stream(uint32_t id, ERROR_CODE code) {
+    write_frame_header(4, RST_STREAM, 0, id);
+    write_u32(code);
+    stream* s = find(id);
+    if (s) {
+        release(*s);
+        s->id = 0;
+        --m_active;
+    }
+}
+
+void http2_session::reap() {
+    if (m_out_sent == m_out_len) {
+        m_out_len = m_out_sent = 0;
+    }
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        stream& s = m_streams[i];
+        if (s.id && s.done) {
+            release(s);
+            s.id = 0;
+            --m_active;
+        }
+    }
+}
+
+/*
+    RFC 9218的调度：urgency小的先发；同样紧急时不是incremental的按流号一个个发完
+    （比如CSS、JS，只拿到一半没有用），incremental的（图片等）轮流每次发一帧
+    发送窗口用完的流跳过，等对方的WINDOW_UPDATE
+*/
+http2_session::stream* http2_session::pick() const {
+    if (m_send_window <= 0) {
+        return nullptr;
+    }
+    const stream* best = nullptr;
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        const stream& s = m_streams[i];
+        if (!s.id || s.done || s.body.left <= 0 || s.window <= 0) {
+            continue;
+        }
+        if (!best) {
+            best = &s;
+        } else if (s.urgency != best->urgency) {
+            if (s.urgency < best->urgency) best = &s;
+        } else if (s.incremental != best->incremental) {
+            if (!s.incremental) best = &s;
+        } else if (!s.incremental ? s.id < best->id : s.served < best->served) {
+            best = &s;
+        }
+    }
+    return const_cast<stream*>(best);
+}
+
+bool http2_session::closing() const {
+    if (m_closing) {
+        return true;
+    }
+    if (!m_peer_goaway) {
+        return false;
+    }
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i].id && !m_streams[i].done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool http2_session::ready() const {
+    return m_out_len > m_out_sent || (!m_closing && pick());
+}
+
+long http2_session::build(struct iovec* iv, int* iv_fd, off_t* iv_off, int max_iov, int& count) {
+    count = 0;
+    long total = 0;
+    // m_out中还没有放进iovec的部分：之前的控制帧、HEADERS和刚写的DATA帧头
+    auto flush = [&]() {
+        if (m_out_len > m_out_sent) {
+            iv[count].iov_base = m_out + m_out_sent;
+            iv[count].iov_len = m_out_len - m_out_sent;
+            iv_fd[count++] = -1;
+            total += m_out_len - m_out_sent;
+            m_out_sent = m_out_len;
+        }
+    };
+
+    long budget = BATCH_DATA;
+    int max_frame = m_peer_max_frame < MAX_FRAME ? m_peer_max_frame : MAX_FRAME;
+    // 每个DATA帧要一个帧头和一块内容，m_out里给最后的RST_STREAM留出位置
+    while (!m_closing && budget > 0 && count + 3 <= max_iov && m_out_len + FRAME_HEADER + RESET_ROOM <= OUT_SIZE) {
+        stream* s = pick();
+        if (!s) {
+            break;
+        }
+        long n = std::min<long>({ s->body.left, (long) max_frame, (long) s->window, (long) m_send_window, budget });
+        bool last = n == s->body.left;
+        write_frame_header(n, DATA, last ? FLAG_END_STREAM : 0, s->id);
+        flush();
+        body_source& b = s->body;
+        iv[count].iov_len = n;
+        if (b.addr) {
+            iv[count].iov_base = b.addr + b.off;
+            iv_fd[count] = -1;
+        } else {
+            iv[count].iov_base = nullptr;
+            iv_fd[count] = b.fd;
+            iv_off[count] = b.off;
+        }
+        ++count;
+        total += n;
+        b.off += n;
+        b.left -= n;
+        s->window -= n;
+        m_send_window -= n;
+        budget -= n;
+        s->served = ++m_serial;
+        if (last) {
+            s->done = true; // 这一批发完后回收
+        }
+    }
+
+    // 请求还没收完（有请求体）就已经回应完了的流，让对方不用再发（RFC 9113 8.1）
+    // 放在这一批的最后，和请求一起读到的END_STREAM已经处理过了；请求体不大时让对方发完，
+    // 有的客户端把上传中被重置当作请求失败
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        stream& s = m_streams[i];
+        if (s.id && s.done && !s.remote_closed && !s.small_body) {
+            write_frame_header(4, RST_STREAM, 0, s.id);
+            write_u32(NO_ERROR);
+            s.remote_closed = true;
+        }
+    }
+    flush();
+    return total;
+}
@@ -0,0 +1,162 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <string_view>
+#include "hpack.h"
+#include "file_cache.h"
+#include "bundle.h"
+
+/*
+    一个HTTP/2连接的协议状态（RFC 9113），由http_conn在协商成功后创建
+    - 输入：consume()按帧处理读缓冲里的数据，控制帧（SETTINGS、PING、WINDOW_UPDATE等）直接在这里回应，
+      一个请求的头部块收全并解码后返回REQUEST，由http_conn像HTTP/1.1一样用do_request找到文件
+    - 输出：响应头编码成HEADERS帧和控制帧一起放在m_out中，响应体（文件映射、fd或者错误页面）挂在流上，
+      build()按优先级和流量控制切成DATA帧，帧头在m_out中，内容直接指向文件，生成http_conn的一批iovec
+    和HTTP/1.1的流水线一样，一批发完之前不会再调用consume()/build()，所以这一批引用的内容不会被释放
+    只在处理这个连接的线程中使用（同一时刻只有一个线程），不加锁
+*/
+class http2_session {
+public:
+    // 帧类型
+    enum FRAME_TYPE { DATA = 0, HEADERS, PRIORITY, RST_STREAM, SETTINGS, PUSH_PROMISE, PING, GOAWAY,
+        WINDOW_UPDATE, CONTINUATION, PRIORITY_UPDATE = 0x10 };
+    // 错误码
+    enum ERROR_CODE { NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT,
+        STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR,
+        ENHANCE_YOUR_CALM, INADEQUATE_SECURITY, HTTP_1_1_REQUIRED };
+    /*
+        consume()的结果
+        NEED_MORE   :   输入都处理完了（不完整的帧已经拷进m_frame）
+        REQUEST     :   一个请求的头部收全了，由request_*()取出，回应之后再接着consume()
+        OUTPUT_FULL :   m_out剩得不多了，先把这一批发出去，剩下的输入留在读缓冲里
+        CLOSING     :   连接出错或者双方都结束了，发完GOAWAY就关闭
+    */
+    enum EVENT { NEED_MORE, REQUEST, OUTPUT_FULL, CLOSING };
+
+    static const char PREFACE[]; // 客户端的连接序言，之后是它的SETTINGS
+    static const int PREFACE_LEN = 24;
+    static const int FRAME_HEADER = 9;
+    static const int MAX_FRAME = 16384;         // 我们接收的帧大小上限（默认值），发送的DATA帧也不超过它
+    static const int MAX_STREAMS = 100;         // SETTINGS_MAX_CONCURRENT_STREAMS
+    static const int MAX_FIELDS = 64;           // 一个请求最多的字段数（含伪头部）
+    static const int OUT_SIZE = 16384;          // HEADERS、控制帧和DATA帧头的缓冲
+    static const int OUT_RESERVE = 4096;        // m_out剩余不到这么多时不再处理新的帧，放得下一个响应头和build()最后的RST_STREAM
+    static const long BATCH_DATA = 128 * 1024;  // 一批最多发多少DATA，新来的更紧急的请求最多等这么多
+    static const int32_t DEFAULT_WINDOW = 65535;
+
+    // 挂在流上的响应体：addr不为空时从内存发送，否则从fd发送（sendfile）；
+    // 发完后释放：来自文件缓存或资源包的只释放引用，否则munmap映射、close打开的文件
+    struct body_source {
+        char* addr;
+        int fd;
+        off_t off;                 // 下一个要发送的字节：addr中的偏移，或者文件中的位置
+        long left;
+        char* map;
+        size_t map_size;
+        int own_fd;
+        file_cache::entry* cached;
+        asset_bundle::image* bundle;
+    };
+
+    explicit http2_session(int max_header_list);
+    ~http2_session();
+
+    // 开始：prior knowledge（h2c或者ALPN的h2）时只发SETTINGS，等客户端的序言
+    void start();
+    // HTTP/1.1的Upgrade: h2c：先回101，再发SETTINGS；HTTP2-Settings按SETTINGS帧处理，
+    // 原来的请求成为流1（请求已经收完）。HTTP2-Settings格式不对时返回false，按HTTP/1.1回应
+    bool upgrade(std::string_view settings);
+
+    EVENT consume(const char* data, int len, int& used);
+
+    // REQUEST时的请求：流、头部字段（指向m_storage，下一次consume()之前有效）
+    uint32_t request_stream() const { return m_request_stream; }
+    const hpack_field* request_fields(int& count) const { count = m_field_count; return m_fields; }
+
+    // 响应头：begin_headers，逐个add_*，end_headers时挂上响应体（没有时为nullptr，HEADERS带END_STREAM）
+    void begin_headers();
+    void add_status(int status);
+    void add_header(int name_index, std::string_view name, std::string_view value, bool index) {
+        m_out_len += m_encoder.encode(m_out + m_out_len, name_index, name, value, index);
+    }
+    void end_headers(uint32_t id, const body_source* body);
+    void reset_stream(uint32_t id, ERROR_CODE code); // 出错时代替响应
+    void shutdown(ERROR_CODE code);                   // 发GOAWAY，之后关闭连接
+
+    // 上一批已经发完：回收发完了的流，清空m_out
+    void reap();
+    // 生成这一批：m_out中还没发的部分和按优先级选出的DATA帧，返回字节数
+    long build(struct iovec* iv, int* iv_fd, off_t* iv_off, int max_iov, int& count);
+    // 有没有马上能发的数据（没被流量控制挡住）
+    bool ready() const;
+    // 出错或者对方发了GOAWAY而所有的流都已经发完（包括这一批里最后的数据），这一批之后关闭连接
+    bool closing() const;
+    int active() const { return m_active; }
+
+private:
+    struct stream {
+        uint32_t id;         // 0表示空闲的槽
+        int32_t window;      // 发送窗口，对方改INITIAL_WINDOW_SIZE时可能变成负数
+        uint8_t urgency;     // RFC 9218的u，0最紧急，默认3
+        bool incremental;    // i：可以和同样紧急的流交替发送；否则按流的顺序一个个发完
+        bool remote_closed;  // 请求已经收完（END_STREAM）
+        bool small_body;     // content-length不超过流的接收窗口，对方一定能发完，回应完不用重置
+        bool done;           // 响应全部放进了某一批，那一批发完后回收
+        uint64_t served;     // 上次发送DATA时的序号，incremental的流轮流发送
+        body_source body;
+    };
+
+    EVENT on_frame(const uint8_t* frame);
+    EVENT on_header_block(uint32_t id, const uint8_t* block, size_t len, bool end_stream);
+    bool apply_settings(const uint8_t* p, int len); // 出错时已经调用了fail()
+    EVENT fail(ERROR_CODE code);                    // 连接错误
+    stream* find(uint32_t id);
+    stream* pick() const;                           // 下一个发送DATA的流
+    void release(stream& s);
+    void write_frame_header(int length, int type, int flags, uint32_t id);
+    void write_u32(uint32_t v);
+    static void parse_priority(std::string_view value, stream& s);
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    int m_preface_left;              // 客户端的序言还有多少字节没收到
+    bool m_settings_seen;            // 收到了客户端的第一个SETTINGS
+    uint8_t m_frame[FRAME_HEADER + MAX_FRAME]; // 跨两次读的帧先拼在这里
+    int m_frame_len;
+
+    uint8_t* m_block;                // HEADERS + CONTINUATION拼成的头部块
+    size_t m_block_len;
+    size_t m_block_size;
+    uint32_t m_block_stream;         // 正在等CONTINUATION的流，0表示没有
+    bool m_block_end_stream;
+
+    char* m_storage;                 // 解码出的名字和值
+    size_t m_storage_size;
+    hpack_field m_fields[MAX_FIELDS];
+    int m_field_count;
+    uint32_t m_request_stream;
+
+    stream m_streams[MAX_STREAMS];
+    int m_active;                    // 占用的槽
+    uint32_t m_last_stream;          // 收到过的最大的流号，GOAWAY中告诉对方处理到了哪里
+    uint64_t m_serial;
+
+    int64_t m_send_window;           // 连接的发送窗口
+    int32_t m_initial_window;        // 对方的SETTINGS_INITIAL_WINDOW_SIZE
+    int m_peer_max_frame;            // 对方的SETTINGS_MAX_FRAME_SIZE
+    int32_t m_recv_unacked;          // 收到的DATA还没有用WINDOW_UPDATE还给对方的字节数
+
+    bool m_closing;
+    bool m_peer_goaway;
+
+    uint8_t m_out[OUT_SIZE];
+    int m_out_len;
+    int m_out_sent;                  // m_out中已经放进iovec的部分
+    int m_headers_start;             // 正在编码的HEADERS帧在m_out中的位置
+};
+
+#endif
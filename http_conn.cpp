@@ -1,22 +1,181 @@
 # include "http_conn.h"
 
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
+// 错误页面的内容，状态行和响应头在header_templates中
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_416_form = "The requested range is not within the file.\n";
+const char* error_431_form = "The request header fields are too large.\n";
+
+// 服务器过载时直接回写的完整响应：连接数满时由reactor发送，线程池过载时由http_conn::reject()发送
+const char* busy_503_response =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 20\r\n"
+    "Content-Type:text/html\r\n"
+    "Connection: close\r\n"
+    "Retry-After: 1\r\n"
+    "\r\n"
+    "Server is too busy.\n";
 
 // 网站的根目录
 const char* doc_root = "/home/wzy/webserver/resources";
 
 
-int http_conn::m_epollfd = -1; // 所有socket上的事件也就是http_conn对象都注册到同一个epollfd上
-int http_conn::m_user_count = 0; // 统计当前用户数量
+std::atomic<int> http_conn::m_user_count(0); // 统计当前用户数量
+int http_conn::m_idle_timeout = 0;
+int http_conn::m_header_timeout = 0;
+int http_conn::m_body_timeout = 0;
+int http_conn::m_write_timeout = 0;
+int http_conn::m_recheck_ms = 0;
+int http_conn::m_max_header = http_conn::READ_BUFFER_SIZE;
+bool http_conn::m_sendfile = false;
+int http_conn::m_gzip_level = 0;
+
+// multipart/byteranges的分隔线，每个响应取一个新的
+static std::atomic<unsigned long> boundary_seq(0);
+
+// RFC 7231的HTTP日期（IMF-fixdate）：Sun, 06 Nov 1994 08:49:37 GMT，返回长度
+static int format_http_date(time_t t, char* buf, int size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// 只认IMF-fixdate，过时的RFC 850和asctime格式当作无效，条件按没有这个头部处理
+static bool parse_http_date(std::string_view text, time_t& t) {
+    char buf[40];
+    if (text.size() >= sizeof(buf)) {
+        return false;
+    }
+    memcpy(buf, text.data(), text.size());
+    buf[text.size()] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return false;
+    }
+    t = timegm(&tm);
+    return true;
+}
+
+// 十进制的非负整数，最多max_digits位
+static bool parse_decimal(std::string_view text, int max_digits, long long& n) {
+    if (text.empty() || (int) text.size() > max_digits) {
+        return false;
+    }
+    n = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        n = n * 10 + (c - '0');
+    }
+    return true;
+}
+
+// 去掉两边的空格和\t
+static std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// 逗号分隔的列表（如Connection）中有没有token，不区分大小写
+static bool has_token(std::string_view list, std::string_view token) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        if (equals_nocase(trim(list.substr(0, comma)), token)) {
+            return true;
+        }
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+    }
+    return false;
+}
+
+// 可以选择的内容编码，下标是CONTENT_CODING；q值相同时按这个顺序优先（压缩率从高到低）
+static const struct {
+    const char* name;   // Content-Encoding中的名字
+    const char* suffix; // 预先压缩好的文件的后缀
+} codings[] = {
+    { "identity", "" },
+    { "br", ".br" },
+    { "zstd", ".zst" },
+    { "gzip", ".gz" },
+};
+
+// Accept-Encoding: gzip;q=0.8, br, *;q=0.1 中coding的q值（千分之几）
+// 没有列出时看*，也没有*时为0；x-gzip等同于gzip；q值格式不对时按0处理
+static int accept_quality(std::string_view list, std::string_view coding) {
+    int listed = -1;
+    int star = 0;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+
+        size_t semi = item.find(';');
+        std::string_view name = trim(item.substr(0, semi));
+        int q = 1000;
+        if (semi != std::string_view::npos) {
+            std::string_view param = trim(item.substr(semi + 1));
+            q = 0;
+            if (param.size() >= 3 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                param.remove_prefix(2);
+                if (param[0] == '1') {
+                    q = 1000;
+                } else if (param[0] == '0' && param.size() > 2 && param[1] == '.') {
+                    // 小数点后最多三位
+                    int scale = 100;
+                    for (size_t i = 2; i < param.size() && i < 5 && param[i] >= '0' && param[i] <= '9'; ++i) {
+                        q += (param[i] - '0') * scale;
+                        scale /= 10;
+                    }
+                }
+            }
+        }
+        if (equals_nocase(name, coding) || (coding == "gzip" && equals_nocase(name, "x-gzip"))) {
+            listed = q;
+        } else if (name == "*") {
+            star = q;
+        }
+    }
+    return listed >= 0 ? listed : star;
+}
+
+bool http_conn::set_path_cache(int ttl_ms, int max_entries) {
+    return path_cache::instance().configure(doc_root, ttl_ms, max_entries > 0 ? max_entries : 0);
+}
+
+void http_conn::set_timeouts(int idle_ms, int header_ms, int body_ms, int write_ms) {
+    m_idle_timeout = idle_ms;
+    m_header_timeout = header_ms;
+    m_body_timeout = body_ms;
+    m_write_timeout = write_ms;
+
+    // 取启用的超时中最小的一个作为不限时阶段的复查间隔，都不启用时不挂时间轮
+    int t[4] = { idle_ms, header_ms, body_ms, write_ms };
+    m_recheck_ms = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (t[i] > 0 && (m_recheck_ms == 0 || t[i] < m_recheck_ms)) {
+            m_recheck_ms = t[i];
+        }
+    }
+}
+
+bool http_conn::timed_out(uint64_t now, uint64_t& next) const {
+    uint64_t d = deadline();
+    if (d == NO_DEADLINE) {
+        next = now + m_recheck_ms;
+        return false;
+    }
+    if (d > now) {
+        next = d;
+        return false;
+    }
+    return true;
+}
 
 // 设置文件描述符非阻塞
 void setnonblocking(int fd) {
@@ -24,7 +183,7 @@ void setnonblocking(int fd) {
     fcntl(fd, F_SETFL, flag);
 }
 
-// 向epoll加入描述符
+// 向epoll加入描述符，fd需要已经是非阻塞的（socket/accept4时带SOCK_NONBLOCK）
 void addfd(int epollfd, int fd, bool one_shot) {
     epoll_event event;
     event.data.fd = fd;
@@ -34,15 +193,6 @@ void addfd(int epollfd, int fd, bool one_shot) {
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);
-}
-
-// 从epoll中删除描述符
-void removefd(int epollfd, int fd) {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
 }
 
 // 修改描述符，重置epoll one shot事件，确保下次可读时触发，因为one shot只触发一次
@@ -54,16 +204,25 @@ void modfd(int epollfd, int fd, int ev) {
 }
 
 // 初始化
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr, io_backend* backend) {
     m_sockfd = sockfd;
     m_address = addr;
-
-    // 端口复用
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    // 添加到epoll中
-    addfd(m_epollfd, m_sockfd, true);
+    m_backend = backend;
+    m_timer.data = this;
+    arm_deadline(m_header_timeout); // 建连后要在header超时内发来完整的请求头
+
+    // 关掉Nagle：一批响应已经在一次sendmsg里了，再等对方（延迟的）ACK只会让流水线的下一批卡住几十毫秒；
+    // 要和下一批合并时由发送的一方带MSG_MORE
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // TLS：先握手，第一个可读事件由read()推进握手；创建失败时m_ssl为nullptr，第一次read()就关闭连接
+    m_ktls_send = false;
+    tls_context& tls = tls_context::instance();
+    if (tls.enabled()) {
+        m_ssl = tls.new_session(sockfd);
+    }
+    m_fresh = true;
 
     // 用户总数+1
     m_user_count++;
@@ -76,36 +235,77 @@ void http_conn::init() {
     bytes_to_send = 0;
     bytes_have_send = 0;
 
-    m_check_state = CHECK_STATE_REQUESTLINE; // 初始状态为解析首行
-    m_checked_idx = 0;
     m_start_line = 0;
+    m_checked_idx = 0;
     m_read_idx = 0;
+    m_write_idx = 0;
+    m_response_count = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    m_keep_alive = false;
+    m_more_pending = false;
+    m_range_count = 0;
+    m_header_too_large = false;
+
+    release_read_chain();
+    init_request();
+}
+
+void http_conn::init_request() {
+    m_check_state = CHECK_STATE_REQUESTLINE; // 初始状态为解析首行
+    m_request_start = m_checked_idx;
+    m_start_line = m_checked_idx;
 
     // 请求头
     m_method = GET;
-    m_url = nullptr;
-    m_version = nullptr;
-
-    m_host = 0;
-    m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
+    m_http10 = false;
+    m_request.reset();
 
-    m_linger = false; // 默认不保持链接 若Connection : keep-alive保持连接
+    m_linger = false; // 请求头读完后按HTTP版本和Connection决定是否保持连接
     m_content_length = 0;
+    m_body_start = 0;
+    m_body_left = 0;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    m_coding = CODING_IDENTITY;
+    m_vary = false;
+    m_compressed = nullptr;
+    m_bundle_entry = nullptr;
 }
 
-// 关闭连接
-void http_conn::close_conn() {
+// 关闭连接，只在事件循环线程中调用
+// close时内核会自动把fd从epoll中删除，不需要再EPOLL_CTL_DEL
+// close要放在最后：fd一释放就可能被别的reactor accept复用，并在这个对象上init新连接
+void http_conn::close_conn(bool close_fd) {
     if (m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        int fd = m_sockfd;
+        unmap();
+        release_read_chain();
+        detach_buffers();
+        if (m_h2) {
+            // 还没发完的流的文件在这里释放
+            delete m_h2;
+            m_h2 = nullptr;
+        }
+        if (m_ssl) {
+            // 握手完成的连接发一个close_notify，socket写不进去也不等
+            if (SSL_is_init_finished(m_ssl)) {
+                SSL_shutdown(m_ssl);
+            }
+            SSL_free(m_ssl);
+            m_ssl = nullptr;
+            ERR_clear_error();
+        }
         m_sockfd = -1;
         m_user_count--;
+        if (close_fd) {
+            if (m_header_too_large) {
+                // 和reject_busy一样：没读的请求头还在接收缓冲区里时close会发RST，客户端可能收不到431
+                char discard[1024];
+                while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+                shutdown(fd, SHUT_WR);
+            }
+            close(fd);
+        }
     }
 }
 
@@ -113,13 +313,48 @@ void http_conn::close_conn() {
 bool http_conn::read() {
     printf("*** 读取中 ***\n");
 
-    if (m_read_idx >= READ_BUFFER_SIZE) {
+    if (tls_context::instance().enabled()) {
+        if (!m_ssl || (handshaking() && !handshake())) {
+            return false;
+        }
+        if (handshaking()) {
+            // 握手还要等对方，handshake()已经注册了事件
+            return true;
+        }
+    }
+
+    if (!attach_buffers()) {
         return false;
     }
+    if (m_read_idx >= m_read_size) {
+        // 缓冲满了还不是一个完整的请求
+        GROW_RESULT grown = grow_read_buf();
+        if (grown == GROW_TOO_LARGE) {
+            // 请求头太大，不再读，交给工作线程回431
+            return true;
+        }
+        if (grown != GROW_OK) {
+            return false;
+        }
+    }
+    if (m_read_idx == 0) {
+        // 新请求的第一个字节，开始计算读请求头的超时；之后不再延长，防止slowloris
+        arm_deadline(m_header_timeout);
+    }
 
     while (1)
     {
-        int read_len = recv(m_sockfd, &m_read_buf[m_read_idx], READ_BUFFER_SIZE - m_read_idx, 0); // 最后的flag位置=0时和read效果几乎相同
+        if (m_read_idx >= m_read_size) {
+            // 正在收请求体时把已经跳过的部分腾出来接着收
+            if (reading_body() && grow_read_buf() == GROW_OK) {
+                continue;
+            }
+            // 缓冲满了就先处理已经读到的（流水线的）请求，剩下的数据留在socket里，
+            // 处理完重新注册EPOLLIN时还会触发
+            break;
+        }
+        int read_len = m_ssl ? tls_recv(&m_read_buf[m_read_idx], m_read_size - m_read_idx)
+                             : recv(m_sockfd, &m_read_buf[m_read_idx], m_read_size - m_read_idx, 0); // 最后的flag位置=0时和read效果几乎相同
         if (read_len == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据了
@@ -134,15 +369,145 @@ bool http_conn::read() {
         } else {
             // 正常读
             m_read_idx += read_len;
-            
+            if (m_check_state == CHECK_STATE_CONTENT) {
+                // 请求体不用等工作线程，收到就跳过
+                parse_content();
+            }
         }
     }
-    printf("*** 从客户端读取到了数据如下 ***\n%s\n", m_read_buf);
+    printf("*** 从客户端读取到了数据如下 ***\n%.*s\n", m_read_idx, m_read_buf);
     return true;
 }
 
+// 后端已经把数据收到了自己的缓冲里，拷贝到读缓冲后交给状态机
+int http_conn::feed(const char* data, int len) {
+    if (!attach_buffers()) {
+        return 0;
+    }
+    if (m_read_idx == 0) {
+        arm_deadline(m_header_timeout);
+    }
+    int fed = 0;
+    while (len > 0) {
+        int room = m_read_size - m_read_idx;
+        if (room == 0) {
+            // 正在收请求体时把已经跳过的部分腾出来接着收
+            if (reading_body() && grow_read_buf() == GROW_OK) {
+                continue;
+            }
+            break;
+        }
+        int n = len < room ? len : room;
+        memcpy(&m_read_buf[m_read_idx], data, n);
+        m_read_idx += n;
+        data += n;
+        len -= n;
+        fed += n;
+        if (m_check_state == CHECK_STATE_CONTENT) {
+            parse_content();
+        }
+    }
+    return fed;
+}
+
+// 读缓冲满了请求还不完整时由事件循环线程调用，这时读到的数据工作线程都已经解析过
+http_conn::GROW_RESULT http_conn::grow_read_buf() {
+    if (!m_bufs) {
+        // 之前没借到缓冲（feed()一个字节也没放进去），再借一次
+        return attach_buffers() ? GROW_OK : GROW_FAILED;
+    }
+    if (m_check_state == CHECK_STATE_CONTENT) {
+        // 请求体收到的部分都已经跳过，从请求体开头重新写，不用更多内存
+        if (m_checked_idx == m_read_idx && m_body_start < m_read_size) {
+            m_read_idx = m_checked_idx = m_start_line = m_body_start;
+            return GROW_OK;
+        }
+        // 请求头正好占满了读缓冲，请求体换一块接着收
+    } else if ((m_read_chain && m_start_line == 0) || (m_read_chunks + 1) * buf_chunk::SIZE > m_max_header) {
+        // 已经解析完的行留在原处，只把没收完的这一行搬到新块里：一行超过一块，或者整个请求头超过上限
+        // HTTP/2时没有可以回应的请求，直接关闭
+        if (m_h2) {
+            return GROW_FAILED;
+        }
+        m_header_too_large = true;
+        return GROW_TOO_LARGE;
+    }
+
+    buf_chunk* chunk = buffer_pool::instance().get();
+    if (!chunk) {
+        return GROW_FAILED;
+    }
+    int left = m_read_idx - m_start_line;
+    memcpy(chunk->data, m_read_buf + m_start_line, left);
+    chunk->next = m_read_chain;
+    m_read_chain = chunk;
+    ++m_read_chunks;
+
+    m_read_buf = chunk->data;
+    m_read_size = buf_chunk::SIZE;
+    m_read_idx = left;
+    m_checked_idx -= m_start_line;
+    m_start_line = 0;
+    m_request_start = 0;
+    m_body_start = 0;
+    return GROW_OK;
+}
+
+void http_conn::release_read_chain() {
+    if (m_read_chain) {
+        buffer_pool::instance().put(m_read_chain);
+        m_read_chain = nullptr;
+    }
+    m_read_chunks = 0;
+    m_read_buf = m_bufs ? m_bufs->read_buf : nullptr;
+    m_read_size = m_bufs ? READ_BUFFER_SIZE : 0;
+}
+
+bool http_conn::attach_buffers() {
+    if (m_bufs) {
+        return true;
+    }
+    m_bufs = local_pool<io_buffers>::get();
+    if (!m_bufs) {
+        return false;
+    }
+    m_write_buf = m_bufs->write_buf;
+    m_responses = m_bufs->responses;
+    m_iv = m_bufs->iv;
+    m_iv_fd = m_bufs->iv_fd;
+    m_iv_off = m_bufs->iv_off;
+    m_ranges = m_bufs->ranges;
+    m_real_file = m_bufs->real_file;
+    // 还缓冲时读缓冲是空的，也没有块
+    m_read_buf = m_bufs->read_buf;
+    m_read_size = READ_BUFFER_SIZE;
+    return true;
+}
+
+// 调用者保证读缓冲是空的（m_read_idx为0，没有块），也没有还没发完的响应
+void http_conn::detach_buffers() {
+    if (!m_bufs) {
+        return;
+    }
+    local_pool<io_buffers>::put(m_bufs);
+    m_bufs = nullptr;
+    m_write_buf = nullptr;
+    m_responses = nullptr;
+    m_iv = nullptr;
+    m_iv_fd = nullptr;
+    m_iv_off = nullptr;
+    m_ranges = nullptr;
+    m_real_file = nullptr;
+    m_read_buf = nullptr;
+    m_read_size = 0;
+}
+
 // 主状态机 解析请求 使用下面几个方法
 http_conn::HTTP_CODE http_conn::process_read() {
+    if (m_header_too_large) {
+        // 读缓冲已经放不下这个请求头（见grow_read_buf），不再解析
+        return HEADER_TOO_LARGE;
+    }
     // 初始状态
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
@@ -157,7 +522,9 @@ http_conn::HTTP_CODE http_conn::process_read() {
         // 获取一行数据
         text = getline();
         m_start_line = m_checked_idx;
-        printf("%s\n", text);
+        if (m_check_state != CHECK_STATE_CONTENT) {
+            printf("%s\n", text);
+        }
 
         switch (m_check_state)
         {
@@ -173,7 +540,7 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 break;
             }
             case CHECK_STATE_CONTENT: {
-                ret = parse_content(text);
+                ret = parse_content();
                 if (ret == GET_REQUEST) return do_request();
                 line_status = LINE_OPEN;
                 break;
@@ -190,113 +557,153 @@ http_conn::HTTP_CODE http_conn::process_read() {
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
 
     // "GET /login HTTP/1.1"
-    m_url = strpbrk(text, " \t"); // 判断第二个参数中的字符哪个在text中最先出现
-    if (!m_url) { 
+    char* end = line_end();
+    char* url = (char*) scan_space(text, end); // 第一个空格或\t
+    if (url == end) {
         return BAD_REQUEST;
     }
-    // GET\0/index.html HTTP/1.1
-    *m_url++ = '\0';    // 置位空字符，字符串结束符
-    char* method = text;
-    if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较
+    m_request.method = std::string_view(text, url - text);
+    *url++ = '\0';    // 置位空字符，字符串结束符
+    if ( equals_nocase(m_request.method, "GET") ) { // 忽略大小写比较
         m_method = GET;
+    } else if ( equals_nocase(m_request.method, "HEAD") ) {
+        m_method = HEAD;
+    } else if ( equals_nocase(m_request.method, "OPTIONS") ) {
+        m_method = OPTIONS;
     } else {
         return BAD_REQUEST;
     }
     // /index.html HTTP/1.1
-    // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    m_version = strpbrk( m_url, " \t" );
-    if (!m_version) {
+    char* version = (char*) scan_space(url, end);
+    if (version == end) {
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';
-    if (strcasecmp( m_version, "HTTP/1.1") != 0 ) {
+    *version++ = '\0';
+    m_request.version = std::string_view(version, end - version);
+    if ( equals_nocase(m_request.version, "HTTP/1.0") ) {
+        m_http10 = true;
+    } else if ( !equals_nocase(m_request.version, "HTTP/1.1") ) {
         return BAD_REQUEST;
     }
+    std::string_view target(url, version - 1 - url);
+    // OPTIONS * HTTP/1.1：问的是整个服务器
+    if ( target == "*" && m_method == OPTIONS ) {
+        m_request.url = target;
+        m_check_state = CHECK_STATE_HEADER;
+        return NO_REQUEST;
+    }
     /**
      * http://192.168.110.129:10000/index.html
     */
-    if (strncasecmp(m_url, "http://", 7) == 0 ) {   
-        m_url += 7;
-        // 在参数 str 所指向的字符串中搜索第一次出现字符 c（一个无符号字符）的位置。
-        m_url = strchr( m_url, '/' );
+    if (target.size() >= 7 && equals_nocase(target.substr(0, 7), "http://")) {
+        target.remove_prefix(7);
+        // 跳过主机名，从路径的'/'开始
+        size_t slash = target.find('/');
+        target.remove_prefix(slash == std::string_view::npos ? target.size() : slash);
     }
-    if ( !m_url || m_url[0] != '/' ) {
+    if ( target.empty() || target[0] != '/' ) {
         return BAD_REQUEST;
     }
+    m_request.url = target;
     m_check_state = CHECK_STATE_HEADER; // 检查状态从请求行变成检查头
     return NO_REQUEST;
 }
 
-// 解析http请求头
+// 解析http请求头 每个头部都记在m_request中，请求头结束时再取出需要的
 http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
     // 遇到空行，表示头部字段解析完毕
     if( text[0] == '\0' ) {
+        // Connection是逗号分隔的选项：HTTP/1.1默认保持连接，除非有close；HTTP/1.0要显式地keep-alive
+        std::string_view connection = m_request.get(HDR_CONNECTION);
+        m_linger = m_http10 ? has_token( connection, "keep-alive" ) : !has_token( connection, "close" );
+
+        // Content-Length只能是十进制数字
+        std::string_view length = m_request.get(HDR_CONTENT_LENGTH);
+        if ( m_request.has(HDR_CONTENT_LENGTH) && !parse_length(length, m_content_length) ) {
+            return BAD_REQUEST;
+        }
+
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
         if ( m_content_length != 0 ) {
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_start = m_checked_idx;
+            m_body_left = m_content_length;
             return NO_REQUEST;
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text );
+    }
+
+    // 名字: 值，名字和冒号之间不能有空白（RFC 7230 3.2.4）
+    char* end = line_end();
+    char* colon = (char*) scan_char(text, end, ':');
+    if (colon == end || colon == text || colon[-1] == ' ' || colon[-1] == '\t') {
+        return BAD_REQUEST;
+    }
+    char* value = colon + 1;
+    value += strspn( value, " \t" );
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    if ( !m_request.add_header(std::string_view(text, colon - text), std::string_view(value, end - value)) ) {
+        printf( "*** 请求头部超过%d个 ***\n", http_request::MAX_HEADERS );
+        return BAD_REQUEST;
     }
     return NO_REQUEST;
 }
 
+// 十进制的非负整数，不超过int
+bool http_conn::parse_length(std::string_view text, int& length) {
+    long long n;
+    if (!parse_decimal(text, 9, n)) {
+        return false;
+    }
+    length = n;
+    return true;
+}
+
 // 解析http请求体 这里没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char* text) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
-    {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+// 收到多少跳过多少，不要求整个请求体同时在读缓冲里；读完后面可能紧跟着下一个流水线请求
+http_conn::HTTP_CODE http_conn::parse_content() {
+    int len = m_read_idx - m_checked_idx;
+    if ( len > m_body_left ) {
+        len = m_body_left;
     }
-    return NO_REQUEST;
+    m_checked_idx += len;
+    m_start_line = m_checked_idx;
+    m_body_left -= len;
+    return m_body_left == 0 ? GET_REQUEST : NO_REQUEST;
 }
 
 // 从状态机 依据\r\n来解析一行数据
+// 用scan_line_end一次16~32个字节地跳到下一个'\r'或'\n'，只在这两个字符上做判断
 http_conn::LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for ( ; m_checked_idx < m_read_idx; ++m_checked_idx) {
-        temp = m_read_buf[m_checked_idx];
+    if (m_checked_idx >= m_read_idx) {
+        return LINE_OPEN;
+    }
+    m_checked_idx = scan_line_end(m_read_buf + m_checked_idx, m_read_buf + m_read_idx) - m_read_buf;
+    if (m_checked_idx == m_read_idx) {
+        return LINE_OPEN;
+    }
 
-        if (temp == '\r') {
-            if ((m_checked_idx + 1) == m_read_idx) {
-                return LINE_OPEN;
-            } else if (m_read_buf[m_checked_idx + 1] == '\n') {
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        } else if(temp == '\n') {
-            if (m_checked_idx > 1 && m_read_buf[m_checked_idx - 1] == '\r') {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    if (m_read_buf[m_checked_idx] == '\r') {
+        if ((m_checked_idx + 1) == m_read_idx) {
+            return LINE_OPEN;
+        } else if (m_read_buf[m_checked_idx + 1] == '\n') {
+            m_read_buf[m_checked_idx++] = '\0';
+            m_read_buf[m_checked_idx++] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
     }
-    return LINE_OPEN;
+    // '\n'
+    if (m_checked_idx > 1 && m_read_buf[m_checked_idx - 1] == '\r') {
+        m_read_buf[m_checked_idx - 1] = '\0';
+        m_read_buf[m_checked_idx++] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
 }
 
 /*
@@ -305,12 +712,45 @@ http_conn::LINE_STATUS http_conn::parse_line() {
     映射到内存地址m_file_address处，并告诉调用者获取文件成功
 */
 http_conn::HTTP_CODE http_conn::do_request() {
+    // OPTIONS不涉及具体文件
+    if ( m_method == OPTIONS ) {
+        return OPTIONS_REQUEST;
+    }
+
     // "/home/wzy/webserver/resources"
     strcpy( m_real_file, doc_root );
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+    // 规范化：合并"//"、去掉"."和".."，".."超出文档根目录或者路径太长时拒绝
+    int url_len = path_cache::canonicalize( m_request.url, m_real_file + len, FILENAME_LEN - len );
+    if ( url_len < 0 ) {
+        return BAD_REQUEST;
+    }
+    // Content-Type按请求的路径，换成预先压缩好的文件后也不变
+    m_mime = mime_lookup( std::string_view( m_real_file, len + url_len ) );
+    // 资源包命中时元数据、ETag和各个压缩版本都是打包时准备好的，不用stat、open和mmap
+    if ( lookup_bundle( std::string_view( m_real_file + len, url_len ) ) ) {
+        select_coding();
+        make_validators();
+        if ( not_modified() ) {
+            return NOT_MODIFIED;
+        }
+        m_range_count = 0;
+        if ( m_method == GET && parse_range() == RANGE_NOT_SATISFIABLE ) {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        // 整个包已经映射好了，直接指向包里的内容（不用sendfile）
+        m_file_address = m_method == HEAD ? 0 : m_bundle->base + m_bundle_entry->variants[m_coding].off;
+        m_map_offset = 0;
+        m_map_size = m_file_stat.st_size;
+        return FILE_REQUEST;
+    }
+    // 文件缓存命中时直接用缓存的stat结果，否则获取m_real_file文件的相关的状态信息，-1失败，0成功
+    // 路径缓存记着最近stat过的结果，包括不存在的路径
+    file_cache& cache = file_cache::instance();
+    m_cache_entry = cache.enabled() ? cache.acquire( m_real_file ) : nullptr;
+    if ( m_cache_entry ) {
+        m_file_stat = m_cache_entry->st;
+    } else if ( path_cache::instance().stat( m_real_file, &m_file_stat ) < 0 ) {
         return NO_RESOURCE;
     }
 
@@ -324,86 +764,536 @@ http_conn::HTTP_CODE http_conn::do_request() {
         return BAD_REQUEST;
     }
 
+    // 选中压缩的版本时，下面的ETag、Range和长度都是针对压缩后的内容
+    select_coding();
+
+    // 客户端缓存的文件还是最新的，只回304，不用打开和映射文件
+    make_validators();
+    if ( not_modified() ) {
+        return NOT_MODIFIED;
+    }
+
+    // Range只对GET有效
+    m_range_count = 0;
+    if ( m_method == GET && parse_range() == RANGE_NOT_SATISFIABLE ) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+
+    // HEAD只要响应头，stat得到的元数据已经够了，不打开也不映射文件
+    if ( m_method == HEAD ) {
+        m_file_address = 0;
+        return FILE_REQUEST;
+    }
+
+    // 压缩好的内容在缓存条目上，sendfile时也从内存发送
+    if ( m_compressed ) {
+        m_file_address = (char*) m_compressed;
+        m_map_offset = 0;
+        m_map_size = m_file_stat.st_size;
+        return FILE_REQUEST;
+    }
+
+    // 没有命中时放进缓存，之后的请求共用这次打开的fd和整个文件的映射
+    if ( !m_cache_entry && cache.enabled() ) {
+        m_cache_entry = cache.insert( m_real_file, m_file_stat );
+    }
+    if ( m_cache_entry ) {
+        if ( use_sendfile() && m_file_stat.st_size > INLINE_BODY_MAX ) {
+            m_file_fd = m_cache_entry->fd;
+        } else {
+            m_file_address = m_cache_entry->addr;
+            m_map_offset = 0;
+            m_map_size = m_file_stat.st_size;
+        }
+        return FILE_REQUEST;
+    }
+
     // 以只读方式打开文件
     int fd = open( m_real_file, O_RDONLY );
+    if ( fd < 0 ) {
+        // stat之后刚被删掉
+        if ( errno == ENOENT || errno == ENOTDIR ) {
+            path_cache::instance().erase( m_real_file );
+            return NO_RESOURCE;
+        }
+        return INTERNAL_ERROR;
+    }
+
+    // sendfile：留着fd，发送时内核直接从页缓存拷到socket，没有mmap/munmap和缺页
+    if ( use_sendfile() ) {
+        m_file_fd = fd;
+        return FILE_REQUEST;
+    }
+
+    // 有Range时只映射从第一个范围所在的页到最后一个范围的结尾，大文件的一小段不用映射整个文件
+    static const long page_size = sysconf( _SC_PAGESIZE );
+    m_map_offset = 0;
+    m_map_size = m_file_stat.st_size;
+    if ( m_range_count > 0 ) {
+        m_map_offset = m_ranges[0].first & ~( off_t )( page_size - 1 );
+        m_map_size = m_ranges[m_range_count - 1].last + 1 - m_map_offset;
+    }
 
     /*
         //创建内存映射
 
         第一个参数0表示让系统自动选择映射区域的起始地址
-        第二个参数m_file_stat.st_size表示映射的文件大小
+        第二个参数m_map_size表示映射的大小
         第三个参数PROT_READ表示映射区域可读，不可写不可执行
         第四个参数MAP_PRIVATE表示创建一个私有的映射，即对映射区域的修改不会反映到文件中
         第五个参数fd表示要映射的文件描述符
-        最后一个参数0表示映射的文件偏移量为0。
+        最后一个参数m_map_offset表示映射的文件偏移量，必须是页大小的整数倍
     */ 
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ); // 请求体的数据
+    m_file_address = 0;
+    if ( m_map_size > 0 ) {
+        m_file_address = ( char* )mmap( 0, m_map_size, PROT_READ, MAP_PRIVATE, fd, m_map_offset ); // 请求体的数据
+        if ( m_file_address == MAP_FAILED ) {
+            m_file_address = 0;
+            close( fd );
+            return INTERNAL_ERROR;
+        }
+    }
     close( fd );
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
+/*
+    Accept-Encoding协商：文本类的文件按客户端的q值（相同时br > zstd > gzip）依次找预先压缩好的
+    file.br、file.zst、file.gz，要求不比原文件旧；轮到gzip而没有file.gz时，如果开启了压缩，
+    把原文件放进文件缓存，第一次请求时压缩，之后的请求直接用缓存里压缩好的内容
+    压缩后的内容长度不同，ETag（含长度）自然和原文件的不同
+*/
+void http_conn::select_coding() {
+    if ( !mime_at( m_mime ).compressible ) {
+        return;
+    }
+    m_vary = true;
+    if ( !m_request.has(HDR_ACCEPT_ENCODING) ) {
+        return;
+    }
+    std::string_view accept = m_request.get(HDR_ACCEPT_ENCODING);
+    int q[CODING_GZIP + 1] = { 0 };
+    for ( int c = CODING_BR; c <= CODING_GZIP; ++c ) {
+        q[c] = accept_quality( accept, codings[c].name );
+    }
+    // 按q值从高到低试，相同时保持br、zstd、gzip的顺序
+    while ( true ) {
+        int best = CODING_IDENTITY;
+        for ( int c = CODING_BR; c <= CODING_GZIP; ++c ) {
+            if ( q[c] > q[best] ) {
+                best = c;
+            }
+        }
+        if ( best == CODING_IDENTITY ) {
+            break;
+        }
+        if ( m_bundle_entry ) {
+            if ( use_bundle_variant( (CONTENT_CODING) best ) ) {
+                return;
+            }
+        } else if ( use_precompressed( (CONTENT_CODING) best ) || ( best == CODING_GZIP && use_gzip_cache() ) ) {
+            return;
+        }
+        q[best] = 0;
+    }
+}
+
+bool http_conn::use_gzip_cache() {
+    file_cache& cache = file_cache::instance();
+    if ( m_gzip_level <= 0 || !cache.enabled() || m_file_stat.st_size < COMPRESS_MIN ) {
+        return false;
+    }
+    if ( !m_cache_entry ) {
+        m_cache_entry = cache.insert( m_real_file, m_file_stat );
+    }
+    const char* data;
+    size_t len;
+    if ( !m_cache_entry || !cache.compressed( m_cache_entry, m_gzip_level, &data, &len ) ) {
+        return false;
+    }
+    m_coding = CODING_GZIP;
+    m_compressed = data;
+    m_file_stat.st_size = len;
+    return true;
+}
+
+bool http_conn::use_precompressed( CONTENT_CODING coding ) {
+    int len = strlen( m_real_file );
+    int suffix_len = strlen( codings[coding].suffix );
+    if ( len + suffix_len >= FILENAME_LEN ) {
+        return false;
+    }
+    char path[FILENAME_LEN];
+    memcpy( path, m_real_file, len );
+    memcpy( path + len, codings[coding].suffix, suffix_len + 1 );
+
+    file_cache& cache = file_cache::instance();
+    file_cache::entry* entry = cache.enabled() ? cache.acquire( path ) : nullptr;
+    struct stat st;
+    if ( entry ) {
+        st = entry->st;
+    } else if ( path_cache::instance().stat( path, &st ) < 0 ) {
+        return false;
+    }
+    // 比原文件旧的压缩文件可能是改文件之前生成的，不能用
+    bool older = st.st_mtim.tv_sec < m_file_stat.st_mtim.tv_sec
+        || ( st.st_mtim.tv_sec == m_file_stat.st_mtim.tv_sec && st.st_mtim.tv_nsec < m_file_stat.st_mtim.tv_nsec );
+    if ( !S_ISREG( st.st_mode ) || !( st.st_mode & S_IROTH ) || older ) {
+        if ( entry ) {
+            cache.release( entry );
+        }
+        return false;
+    }
+
+    if ( m_cache_entry ) {
+        cache.release( m_cache_entry );
+    }
+    m_cache_entry = entry;
+    m_file_stat = st;
+    memcpy( m_real_file, path, len + suffix_len + 1 );
+    m_coding = coding;
+    return true;
+}
+
+bool http_conn::lookup_bundle( std::string_view path ) {
+    asset_bundle& bundle = asset_bundle::instance();
+    if ( !bundle.enabled() ) {
+        return false;
+    }
+    m_bundle = bundle.acquire();
+    m_bundle_entry = m_bundle ? asset_bundle::find( m_bundle, path ) : nullptr;
+    bundle.count( m_bundle_entry != nullptr );
+    if ( !m_bundle_entry ) {
+        if ( m_bundle ) {
+            bundle.release( m_bundle );
+            m_bundle = nullptr;
+        }
+        return false;
+    }
+    // 包里只有可读的普通文件，其余的字段用不到
+    memset( &m_file_stat, 0, sizeof( m_file_stat ) );
+    m_file_stat.st_mode = S_IFREG | 0444;
+    m_file_stat.st_size = m_bundle_entry->variants[CODING_IDENTITY].len;
+    m_file_stat.st_mtime = m_bundle_entry->mtime;
+    return true;
+}
+
+bool http_conn::use_bundle_variant( CONTENT_CODING coding ) {
+    const bundle_variant& v = m_bundle_entry->variants[coding];
+    if ( v.off == 0 ) {
+        return false;
+    }
+    m_coding = coding;
+    m_file_stat.st_size = v.len;
+    return true;
+}
+
+/*
+    Range: bytes=0-499, 1000-, -500
+    结果放在m_ranges中：超出文件的部分截掉，按起点排好序，重叠或相邻的合并成一个
+    没有Range、If-Range不匹配、单位不是bytes、格式不对或者范围超过MAX_RANGES个时
+    忽略Range（m_range_count为0），整个文件返回200；所有范围都不在文件内时返回RANGE_NOT_SATISFIABLE
+*/
+http_conn::HTTP_CODE http_conn::parse_range() {
+    m_range_count = 0;
+    if ( !m_request.has(HDR_RANGE) || !if_range_matches() ) {
+        return FILE_REQUEST;
+    }
+    std::string_view spec = trim( m_request.get(HDR_RANGE) );
+    if ( spec.size() < 6 || !equals_nocase( spec.substr(0, 6), "bytes=" ) ) {
+        return FILE_REQUEST;
+    }
+    spec.remove_prefix(6);
+
+    long long size = m_file_stat.st_size;
+    int count = 0; // 格式正确的范围个数，包括不在文件内的
+    while ( !spec.empty() ) {
+        size_t comma = spec.find(',');
+        std::string_view item = trim( spec.substr(0, comma) );
+        spec.remove_prefix( comma == std::string_view::npos ? spec.size() : comma + 1 );
+        if ( item.empty() ) {
+            continue; // 列表中允许有空元素
+        }
+        if ( ++count > MAX_RANGES ) {
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
+
+        size_t dash = item.find('-');
+        if ( dash == std::string_view::npos ) {
+            m_range_count = 0;
+            return FILE_REQUEST;
+        }
+        long long first, last;
+        if ( dash == 0 ) {
+            // -500：最后500字节
+            long long suffix;
+            if ( !parse_decimal( item.substr(1), 18, suffix ) ) {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            if ( suffix == 0 || size == 0 ) {
+                continue;
+            }
+            first = suffix < size ? size - suffix : 0;
+            last = size - 1;
+        } else {
+            // 1000-：到文件结尾
+            if ( !parse_decimal( item.substr(0, dash), 18, first ) ) {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            if ( dash + 1 == item.size() ) {
+                last = size - 1;
+            } else if ( !parse_decimal( item.substr(dash + 1), 18, last ) || last < first ) {
+                m_range_count = 0;
+                return FILE_REQUEST;
+            }
+            if ( first >= size ) {
+                continue;
+            }
+            if ( last >= size ) {
+                last = size - 1;
+            }
+        }
+
+        // 插入排序，范围很少
+        int i = m_range_count++;
+        while ( i > 0 && m_ranges[i - 1].first > first ) {
+            m_ranges[i] = m_ranges[i - 1];
+            --i;
+        }
+        m_ranges[i].first = first;
+        m_ranges[i].last = last;
+    }
+    if ( count == 0 ) {
+        return FILE_REQUEST;
+    }
+    if ( m_range_count == 0 ) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+
+    // 合并重叠或相邻的范围
+    int n = 1;
+    for ( int i = 1; i < m_range_count; ++i ) {
+        if ( m_ranges[i].first <= m_ranges[n - 1].last + 1 ) {
+            if ( m_ranges[i].last > m_ranges[n - 1].last ) {
+                m_ranges[n - 1].last = m_ranges[i].last;
+            }
+        } else {
+            m_ranges[n++] = m_ranges[i];
+        }
+    }
+    m_range_count = n;
+    if ( m_h2 && n > 1 ) {
+        // HTTP/2不发multipart/byteranges（一个流只有一个响应体），多个范围时返回整个文件
+        m_range_count = 0;
+    }
+    return FILE_REQUEST;
+}
+
+// If-Range：文件没有变过Range才有效，否则要整个文件重新发
+// 值是ETag（强比较，弱ETag不算匹配）或者和Last-Modified完全一致的日期
+bool http_conn::if_range_matches() {
+    if ( !m_request.has(HDR_IF_RANGE) ) {
+        return true;
+    }
+    std::string_view value = trim( m_request.get(HDR_IF_RANGE) );
+    std::string_view etag( m_etag, m_etag_len );
+    if ( !value.empty() && ( value[0] == '"' || value.substr(0, 2) == "W/" ) ) {
+        return m_etag[0] == '"' && value == etag;
+    }
+    return value == std::string_view( m_last_modified, m_last_modified_len );
+}
+
+/*
+    ETag由inode、大小和纳秒级的修改时间组成，不用读文件内容
+    一秒之内刚改过的文件可能马上又被改写而时间戳不变（文件系统的时间精度不够时），这时给弱ETag
+*/
+void http_conn::make_validators() {
+    // 资源包里的ETag按内容算好了，重新打包时内容没变的文件ETag也不变
+    if ( m_bundle_entry ) {
+        const bundle_variant& v = m_bundle_entry->variants[m_coding];
+        memcpy( m_etag, v.etag, v.etag_len );
+        m_etag_len = v.etag_len;
+        memcpy( m_last_modified, m_bundle_entry->last_modified, m_bundle_entry->last_modified_len );
+        m_last_modified_len = m_bundle_entry->last_modified_len;
+        return;
+    }
+    unsigned long mtime_ns = m_file_stat.st_mtim.tv_sec * 1000000000UL + m_file_stat.st_mtim.tv_nsec;
+    bool weak = time( nullptr ) - m_file_stat.st_mtim.tv_sec < 1;
+    m_etag_len = snprintf( m_etag, sizeof( m_etag ), "%s\"%lx-%lx-%lx\"", weak ? "W/" : "",
+        (unsigned long) m_file_stat.st_ino, (unsigned long) m_file_stat.st_size, mtime_ns );
+    m_last_modified_len = format_http_date( m_file_stat.st_mtime, m_last_modified, sizeof( m_last_modified ) );
+}
+
+// If-None-Match: "a", W/"b" 或者 *，弱比较，任意一个匹配就是没有修改
+// 有If-None-Match时不看If-Modified-Since（RFC 7232 3.3）
+bool http_conn::not_modified() {
+    if ( m_request.has(HDR_IF_NONE_MATCH) ) {
+        std::string_view list = m_request.get(HDR_IF_NONE_MATCH);
+        std::string_view opaque( m_etag, m_etag_len );
+        if ( opaque.substr(0, 2) == "W/" ) {
+            opaque.remove_prefix(2);
+        }
+        if ( trim( list ) == "*" ) {
+            return true;
+        }
+        while ( true ) {
+            size_t quote = list.find('"');
+            if ( quote == std::string_view::npos ) {
+                return false;
+            }
+            size_t close = list.find('"', quote + 1);
+            if ( close == std::string_view::npos ) {
+                return false;
+            }
+            if ( list.substr(quote, close - quote + 1) == opaque ) {
+                return true;
+            }
+            list.remove_prefix(close + 1);
+        }
+    }
+    if ( m_request.has(HDR_IF_MODIFIED_SINCE) ) {
+        std::string_view value = trim( m_request.get(HDR_IF_MODIFIED_SINCE) );
+        // 客户端一般原样发回我们给的Last-Modified，先直接比较字符串
+        if ( value == std::string_view( m_last_modified, m_last_modified_len ) ) {
+            return true;
+        }
+        time_t since;
+        return parse_http_date( value, since ) && m_file_stat.st_mtime <= since;
+    }
+    return false;
+}
+
+// 对内存映射区执行munmap操作，sendfile打开的文件close，来自文件缓存和资源包的只释放引用，多个范围的分隔头还回块池
 void http_conn::unmap() {
+    if ( m_bundle ) {
+        asset_bundle::instance().release( m_bundle );
+        m_bundle = nullptr;
+        m_file_address = 0;
+    }
+    if ( m_cache_entry ) {
+        file_cache::instance().release( m_cache_entry );
+        m_cache_entry = nullptr;
+        m_file_address = 0;
+        m_file_fd = -1;
+    }
     if( m_file_address )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        munmap( m_file_address, m_map_size );
         m_file_address = 0;
     }
+    if ( m_file_fd >= 0 ) {
+        close( m_file_fd );
+        m_file_fd = -1;
+    }
+    for (int i = 0; i < m_response_count; ++i) {
+        response& r = m_responses[i];
+        if (r.bundle) {
+            asset_bundle::instance().release(r.bundle);
+            r.bundle = nullptr;
+            r.file_address = 0;
+        }
+        if (r.cached) {
+            file_cache::instance().release(r.cached);
+            r.cached = nullptr;
+            r.file_address = 0;
+            r.file_fd = -1;
+        }
+        if (r.file_address) {
+            munmap(r.file_address, r.map_size);
+            r.file_address = 0;
+        }
+        if (r.file_fd >= 0) {
+            close(r.file_fd);
+            r.file_fd = -1;
+        }
+    }
+    if (m_part_buf) {
+        buffer_pool::instance().put(m_part_buf);
+        m_part_buf = nullptr;
+    }
 }
 
 // 非阻塞写
 bool http_conn::write() {
     int temp = 0;
-    
+
+    if ( handshaking() ) {
+        // 握手时socket写满了，现在可写，接着握手；完成后等对方的请求
+        if ( !handshake() ) {
+            return false;
+        }
+        if ( !handshaking() ) {
+            m_backend->want_read(this);
+        }
+        return true;
+    }
+
     if ( bytes_to_send == 0 ) {
         // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
+        finish_response();
+        if (!has_pending_input()) {
+            m_backend->want_read(this);
+        }
         return true;
     }
 
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if ( m_iv_fd[m_iv_idx] >= 0 ) {
+            // 文件的块：内核直接从页缓存发送；发到哪里由advance()记在m_iv_off中，EAGAIN后从那里继续
+            off_t off = m_iv_off[m_iv_idx];
+            temp = sendfile(m_sockfd, m_iv_fd[m_iv_idx], &off, m_iv[m_iv_idx].iov_len);
+            if ( temp == 0 ) {
+                // 文件在stat之后被截短了，Content-Length已经发出去，只能关闭连接
+                unmap();
+                return false;
+            }
+        } else if ( m_ssl && !m_ktls_send ) {
+            temp = tls_send();
+        } else {
+            // 分散写，到下一个文件的块为止
+            // 后面的文件不大时带MSG_MORE，让响应头和文件内容凑在同样的报文段里；
+            // 大文件多一个报文段无所谓，而且实测在新连接上带MSG_MORE再sendfile几MB会慢好几倍
+            int end = m_iv_idx;
+            while ( end < m_iv_count && m_iv_fd[end] < 0 ) {
+                ++end;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = m_iv + m_iv_idx;
+            msg.msg_iovlen = end - m_iv_idx;
+            // 这是这一批最后的数据，而下一批马上就来时也带MSG_MORE，两批凑成满的报文段
+            bool more = end < m_iv_count ? m_iv[end].iov_len <= SENDFILE_MORE_MAX : m_more_pending;
+            temp = sendmsg(m_sockfd, &msg, more ? MSG_MORE : 0);
+        }
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                m_backend->want_write(this);
                 return true;
             }
             unmap();
             return false;
         }
 
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
-
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
-
-        if (bytes_to_send <= 0)
+        if (!advance(temp))
         {
             // 没有数据要发送了
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-
-            if (m_linger)
+            if (m_keep_alive)
             {
-                init();
+                // 读缓冲里还有流水线请求时不注册EPOLLIN，由reactor直接交给线程池
+                finish_response();
+                if (!has_pending_input()) {
+                    m_backend->want_read(this);
+                }
                 return true;
             }
             else
             {
+                unmap();
                 return false;
             }
         }
@@ -411,6 +1301,87 @@ bool http_conn::write() {
     }
 }
 
+int http_conn::get_iov(struct iovec** iov) {
+    *iov = m_iv + m_iv_idx;
+    return m_iv_count - m_iv_idx;
+}
+
+// 根据这次写出的字节数调整iovec，下次从未发送的位置继续
+bool http_conn::advance(int len) {
+    if (len > 0) {
+        // 发送有进展，重新计算发送停滞的超时
+        arm_deadline(m_write_timeout);
+    }
+    bytes_have_send += len;
+    bytes_to_send -= len;
+
+    // 跳过已经发完的内存块，调整发了一部分的那一块（文件的块调整文件中的位置）
+    while (len > 0 && m_iv_idx < m_iv_count) {
+        struct iovec& iv = m_iv[m_iv_idx];
+        if ((size_t) len >= iv.iov_len) {
+            len -= iv.iov_len;
+            iv.iov_len = 0;
+            ++m_iv_idx;
+        } else {
+            if (m_iv_fd[m_iv_idx] >= 0) {
+                m_iv_off[m_iv_idx] += len;
+            } else {
+                iv.iov_base = (char*) iv.iov_base + len;
+            }
+            iv.iov_len -= len;
+            len = 0;
+        }
+    }
+
+    return bytes_to_send > 0;
+}
+
+void http_conn::finish_response() {
+    unmap();
+    m_write_idx = 0;
+    m_response_count = 0;
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+
+    // 已经处理完的请求丢掉，后面（流水线）还没处理的数据移到缓冲开头
+    // 正在解析的请求已经解析出的指针跟着一起移动
+    // 用了块池的大请求处理完后，剩下的数据放得下时回到借来的读缓冲，把块都还回去
+    char* from = m_read_buf + m_request_start;
+    int left = m_read_idx - m_request_start;
+    char* to = m_read_buf;
+    if (m_read_chain && left <= READ_BUFFER_SIZE) {
+        to = m_bufs->read_buf;
+    }
+    if (from != to) {
+        memmove(to, from, left);
+        long shift = from - to;
+        m_read_idx = left;
+        m_checked_idx -= m_request_start;
+        m_start_line -= m_request_start;
+        m_body_start -= m_request_start;
+        m_request_start = 0;
+        m_request.rebase(-shift);
+    }
+    if (to != m_read_buf) {
+        release_read_chain();
+    } else if (m_read_chain && m_read_chain->next) {
+        // 剩下的数据只在当前这一块里，之前的块可以还了
+        buffer_pool::instance().put(m_read_chain->next);
+        m_read_chain->next = nullptr;
+        m_read_chunks = 1;
+    }
+
+    if (m_read_idx > 0) {
+        arm_deadline(m_header_timeout); // 已经有下一个请求的数据
+    } else {
+        arm_deadline(m_idle_timeout); // keep-alive，等下一个请求
+        // 空闲的连接不占着缓冲，下一个请求到了再借
+        detach_buffers();
+    }
+}
+
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response( const char* format, ... ) {
     /*
@@ -432,117 +1403,703 @@ bool http_conn::add_response( const char* format, ... ) {
     return true;
 }
 
+// 只在多个范围的响应中用到，其他响应的状态行在header_templates里
 bool http_conn::add_status_line( int status, const char* title ) {
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
-void http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line(); // 空行
+// 预先拼好的状态行和固定的头部
+bool http_conn::add_head( header_templates::STATUS status, int mime ) {
+    return append( header_templates::instance().get( status, mime, m_linger ) );
+}
+
+// 接在以"Content-Length: "结尾的模板后面
+bool http_conn::add_length( off_t content_len ) {
+    return append_uint( content_len ) && append( "\r\n" );
+}
+
+bool http_conn::add_content_length( off_t content_len ) {
+    return append( "Content-Length: " ) && add_length( content_len );
+}
+
+bool http_conn::add_validators() {
+    return append( "ETag: " ) && append( std::string_view( m_etag, m_etag_len ) )
+        && append( "\r\nLast-Modified: " ) && append( std::string_view( m_last_modified, m_last_modified_len ) )
+        && append( "\r\n" );
+}
+
+// 压缩过的加Content-Encoding；协商过编码的（包括没有压缩的）都要Vary，让中间的缓存按Accept-Encoding分开存
+bool http_conn::add_coding() {
+    if ( m_coding != CODING_IDENTITY
+        && !( append( "Content-Encoding: " ) && append( codings[m_coding].name ) && append( "\r\n" ) ) ) {
+        return false;
+    }
+    return !m_vary || append( "Vary: Accept-Encoding\r\n" );
+}
+
+bool http_conn::add_content_range( off_t first, off_t last ) {
+    return append( "Content-Range: bytes " ) && append_uint( first ) && append( "-" ) && append_uint( last )
+        && append( "/" ) && append_uint( m_file_stat.st_size ) && append( "\r\n" );
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+// 错误页面：模板、长度、空行和页面内容
+bool http_conn::add_error( header_templates::STATUS status, const char* form ) {
+    return add_head( status, MIME_HTML ) && add_length( strlen( form ) ) && add_blank_line() && add_content( form );
+}
+
+/*
+    multipart/byteranges：每个范围前面是一个分隔头，最后是结尾的分隔线
+        \r\n--分隔线\r\nContent-Type: text/html\r\nContent-Range: bytes 0-499/8000\r\n\r\n<文件的0~499字节>
+        ...
+        \r\n--分隔线--\r\n
+    范围最多MAX_RANGES个，分隔头一定放得下一个块；写缓冲里只放响应头
+*/
+bool http_conn::add_multipart() {
+    m_part_buf = buffer_pool::instance().get();
+    if ( !m_part_buf ) {
+        return false;
+    }
+    char boundary[24];
+    snprintf( boundary, sizeof( boundary ), "%020lu", boundary_seq.fetch_add(1, std::memory_order_relaxed) );
+
+    std::string_view type = mime_at( m_mime ).type;
+    char* text = m_part_buf->data;
+    int off = 0;
+    off_t body_len = 0;
+    for ( int i = 0; i < m_range_count; ++i ) {
+        byte_range& r = m_ranges[i];
+        r.text_off = off;
+        r.text_len = snprintf( text + off, buf_chunk::SIZE - off,
+            "\r\n--%s\r\nContent-Type: %.*s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+            boundary, (int) type.size(), type.data(), (long long) r.first, (long long) r.last, (long long) m_file_stat.st_size );
+        off += r.text_len;
+        body_len += r.text_len + r.last - r.first + 1;
+    }
+    off += snprintf( text + off, buf_chunk::SIZE - off, "\r\n--%s--\r\n", boundary );
+    body_len += off - ( m_ranges[m_range_count - 1].text_off + m_ranges[m_range_count - 1].text_len );
+    m_part_len = off;
+
+    return add_status_line( 206, "Partial Content" ) && add_validators() && add_coding() && add_content_length( body_len )
+        && add_response( "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary )
+        && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    return append( m_linger ? "Connection: keep-alive\r\n" : "Connection: close\r\n" );
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return append( "\r\n" );
 }
 
+// HEAD的响应和GET的一样，只是没有响应体
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
-}
-
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    if ( m_method == HEAD ) {
+        return true;
+    }
+    return append( content );
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    bool ok;
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
-            }
+            ok = add_error( header_templates::S_500, error_500_form );
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
-            }
+            ok = add_error( header_templates::S_400, error_400_form );
             break;
         case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
-                return false;
-            }
+            ok = add_error( header_templates::S_404, error_404_form );
             break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
-                return false;
-            }
+            ok = add_error( header_templates::S_403, error_403_form );
+            break;
+        case HEADER_TOO_LARGE:
+            // 没读完的请求头还在socket里，没法接着解析下一个请求
+            m_linger = false;
+            ok = add_error( header_templates::S_431, error_431_form );
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            ok = add_head( header_templates::S_416, MIME_HTML ) && add_length( strlen( error_416_form ) )
+                && append( "Content-Range: bytes */" ) && append_uint( m_file_stat.st_size ) && append( "\r\n" )
+                && add_blank_line() && add_content( error_416_form );
+            break;
+        case OPTIONS_REQUEST:
+            ok = add_head( header_templates::S_OPTIONS, 0 ) && add_blank_line();
+            break;
+        case NOT_MODIFIED:
+            // 没有响应体，也不带Content-Length
+            ok = add_head( header_templates::S_304, 0 ) && add_validators() && add_coding() && add_blank_line();
             break;
         case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            // 封装
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            if ( m_range_count == 0 ) {
+                ok = add_head( header_templates::S_200, m_mime ) && add_length( m_file_stat.st_size )
+                    && add_validators() && add_coding() && add_blank_line();
+            } else if ( m_range_count == 1 ) {
+                const byte_range& r = m_ranges[0];
+                ok = add_head( header_templates::S_206, m_mime ) && add_length( r.last - r.first + 1 )
+                    && add_validators() && add_coding() && add_content_range( r.first, r.last ) && add_blank_line();
+            } else {
+                ok = add_multipart();
+            }
+            break;
+        default:
+            return false;
+    }
+    if ( !ok ) {
+        return false;
+    }
+
+    queue_response();
+    return true;
+}
+
+// 响应头已经追加在写缓冲中上一个响应的后面，连同mmap的文件记为这一批的一个响应
+void http_conn::queue_response() {
+    int header_off = m_response_count > 0 ?
+        m_responses[m_response_count - 1].header_off + m_responses[m_response_count - 1].header_len : 0;
+    response& r = m_responses[m_response_count++];
+    r.header_off = header_off;
+    r.header_len = m_write_idx - header_off;
+    bool has_file = m_file_address || m_file_fd >= 0;
+    r.file_address = m_file_address;
+    r.map_size = m_file_address ? m_map_size : 0;
+    r.file_fd = m_file_fd;
+    r.cached = m_cache_entry;
+    r.bundle = m_bundle;
+    r.body_off = 0;
+    r.body_len = has_file ? m_file_stat.st_size : 0;
+    r.multipart = false;
+    if (has_file && m_range_count > 0) {
+        r.body_off = m_ranges[0].first;
+        r.body_len = m_ranges[0].last - m_ranges[0].first + 1;
+        if (m_range_count > 1) {
+            r.multipart = true;
+            r.body_len = m_part_len;
+            for (int i = 0; i < m_range_count; ++i) {
+                r.body_len += m_ranges[i].last - m_ranges[i].first + 1;
+            }
+        }
+    }
+    // 映射是从m_map_offset所在的页开始的
+    r.body = m_file_address ? m_file_address + (r.body_off - m_map_offset) : nullptr;
+    m_file_address = 0; // 映射、fd和缓存的引用归这个响应，发完后在unmap()中释放
+    m_file_fd = -1;
+    m_cache_entry = nullptr;
+    m_bundle = nullptr;
+    bytes_to_send += r.header_len + r.body_len;
+    m_keep_alive = m_linger;
+}
+
+void http_conn::build_iov() {
+    m_iv_count = 0;
+    m_iv_idx = 0;
+    bool merge = false;
+    for (int i = 0; i < m_response_count; ++i) {
+        const response& r = m_responses[i];
+        if (merge) {
+            // 上一个响应没有文件，两个响应头在写缓冲中是连着的，合成一块
+            m_iv[m_iv_count - 1].iov_len += r.header_len;
+        } else {
+            push_iov(m_write_buf + r.header_off, r.header_len);
+        }
+        merge = r.body_len == 0;
+        if (r.multipart) {
+            // 分隔头和文件中的各个范围交替，最后是结尾的分隔线
+            for (int j = 0; j < m_range_count; ++j) {
+                const byte_range& p = m_ranges[j];
+                push_iov(m_part_buf->data + p.text_off, p.text_len);
+                if (r.file_fd >= 0) {
+                    push_file_iov(r.file_fd, p.first, p.last - p.first + 1);
+                } else {
+                    push_iov(r.body + (p.first - m_ranges[0].first), p.last - p.first + 1);
+                }
+            }
+            const byte_range& p = m_ranges[m_range_count - 1];
+            push_iov(m_part_buf->data + p.text_off + p.text_len, m_part_len - p.text_off - p.text_len);
+        } else if (r.body_len > 0) {
+            if (r.file_fd >= 0) {
+                push_file_iov(r.file_fd, r.body_off, r.body_len);
+            } else {
+                push_iov(r.body, r.body_len);
+            }
+        }
+    }
+}
+
+// 线程池队列满或排队太久时调用，可能在工作线程也可能在事件循环线程中
+// 和process()一样最后交给后端发送，发完由后端按Connection: close关闭，连接状态和正常响应一致
+void http_conn::reject() {
+    static const int len = strlen(busy_503_response);
+    if (!attach_buffers()) {
+        m_backend->want_close(this);
+        return;
+    }
+    if (m_h2) {
+        // HTTP/2：发GOAWAY后关闭，还没处理的流客户端会换个连接重试
+        m_h2->reap();
+        m_h2->shutdown(http2_session::NO_ERROR);
+        m_keep_alive = false;
+        m_more_pending = false;
+        bytes_have_send = 0;
+        bytes_to_send = m_h2->build(m_iv, m_iv_fd, m_iv_off, 2 * (MAX_PIPELINE + MAX_RANGES), m_iv_count);
+        m_iv_idx = 0;
+        arm_deadline(m_write_timeout);
+        m_backend->want_write(this);
+        return;
+    }
+    // 这一批还没有响应（被拒绝的任务不会被处理），从写缓冲开头写
+    m_write_idx = 0;
+    m_response_count = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+    memcpy(m_write_buf, busy_503_response, len);
+    m_write_idx = len;
+    m_linger = false;
+    m_more_pending = false;
+    queue_response();
+    build_iov();
+    arm_deadline(m_write_timeout);
+    m_backend->want_write(this);
+}
 
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
+bool http_conn::next_request_ready() const {
+    return memmem(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx, "\r\n\r\n", 4) != nullptr;
+}
+
+// 设置TCP_NODELAY时内核会把留着的不满一个报文段的数据立即发出（已经是打开的也一样）
+void http_conn::uncork() {
+    int nodelay = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
 
+// 握手只在事件循环线程中推进，需要等对方的数据或者socket写满时注册相应的事件
+bool http_conn::handshake() {
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret == 1) {
+        m_ktls_send = tls_context::instance().handshake_done(m_ssl);
+        if (tls_context::alpn_h2(m_ssl)) {
+            m_h2 = new http2_session(m_max_header);
+            m_h2->start();
+        }
+        return true;
+    }
+    switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            m_backend->want_read(this);
+            return true;
+        case SSL_ERROR_WANT_WRITE:
+            m_backend->want_write(this);
             return true;
         default:
+            // 对方不是TLS客户端、证书被拒绝等，直接关闭
+            ERR_clear_error();
             return false;
     }
+}
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
-    return true;
+int http_conn::tls_recv(char* buf, int len) {
+    int n = SSL_read(m_ssl, buf, len);
+    if (n > 0) {
+        return n;
+    }
+    switch (SSL_get_error(m_ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            // 对方发了close_notify
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            // errno为0是对方没发close_notify就断开了，当作关闭
+            ERR_clear_error();
+            return errno == 0 ? 0 : -1;
+        default:
+            ERR_clear_error();
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+// 没有kTLS时发送要经过SSL_write加密，不能sendfile（do_request中已经换成了映射）
+// 响应头、小文件这些小块拷进一条记录大小的缓冲凑成一条记录，省下每块一条记录的头、MAC和一次加密调用；
+// 比一条记录大的块直接交给SSL_write，它按记录切分，只发出一部分时返回发出的字节数
+// WANT_WRITE后重试时m_iv没有变，拼出来的数据和上次一样，满足SSL_write重试的要求
+int http_conn::tls_send() {
+    static thread_local char record[TLS_RECORD_MAX];
+    const char* data = record;
+    int len = 0;
+    if (m_iv[m_iv_idx].iov_len >= (size_t) TLS_RECORD_MAX) {
+        data = (const char*) m_iv[m_iv_idx].iov_base;
+        len = m_iv[m_iv_idx].iov_len > INT_MAX ? INT_MAX : m_iv[m_iv_idx].iov_len;
+    } else {
+        for (int i = m_iv_idx; i < m_iv_count && len < TLS_RECORD_MAX; ++i) {
+            size_t n = m_iv[i].iov_len;
+            if (n > (size_t) (TLS_RECORD_MAX - len)) {
+                n = TLS_RECORD_MAX - len;
+            }
+            memcpy(record + len, m_iv[i].iov_base, n);
+            len += n;
+        }
+    }
+    int n = SSL_write(m_ssl, data, len);
+    if (n > 0) {
+        return n;
+    }
+    if (SSL_get_error(m_ssl, n) == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+    } else {
+        ERR_clear_error();
+        errno = EPIPE;
+    }
+    return -1;
 }
 
 // 线程池中的工作线程调用，处理http请求的入口
+// 读缓冲中可能有多个流水线请求，依次解析并把响应追加到这一批里，一次发送
 void http_conn::process() {
-    // 解析http请求
-    printf("*** 正在解析http请求 ***\n");
-
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    if (!attach_buffers()) {
+        m_backend->want_close(this);
+        return;
+    }
+    if (m_h2) {
+        process_h2();
         return;
     }
-    
+    // 明文连接上开头就是HTTP/2的序言（prior knowledge），不用经过HTTP/1.1
+    if (m_fresh && !m_ssl && m_check_state == CHECK_STATE_REQUESTLINE) {
+        int preface = h2_preface();
+        if (preface == 0) {
+            m_backend->want_read(this);
+            return;
+        }
+        if (preface > 0) {
+            m_h2 = new http2_session(m_max_header);
+            m_h2->start();
+            process_h2();
+            return;
+        }
+    }
 
-    // 生成响应
-    printf("*** 正在生成http响应 ***\n");
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
-        close_conn();
+    // 上一批最后带了MSG_MORE，等着这一批的数据一起发
+    bool corked = m_more_pending;
+    m_more_pending = false;
+    bool capped = true; // 这一批是因为数量或写缓冲的限制停下的
+    while (m_response_count < MAX_PIPELINE) {
+        // 解析http请求
+        printf("*** 正在解析http请求 ***\n");
+
+        CHECK_STATE state_before = m_check_state;
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST) {
+            if (m_response_count > 0) {
+                // 剩下的不是完整的请求，先把已经生成的响应发出去，发完再继续读
+                capped = false;
+                break;
+            }
+            if (tls_pending()) {
+                // 上次读缓冲满了，解密好的数据还在SSL里，不会有可读事件，在这里接着读
+                if (!read()) {
+                    m_backend->want_close(this);
+                    return;
+                }
+                continue;
+            }
+            if (corked) {
+                // 看起来完整的请求其实还在等请求体，这一批没有数据可发
+                uncork();
+            }
+            if (m_check_state == CHECK_STATE_CONTENT && state_before != CHECK_STATE_CONTENT) {
+                // 请求头刚读完，开始计算读请求体的超时
+                arm_deadline(m_body_timeout);
+            }
+            m_backend->want_read(this);
+            return;
+        }
+        if (m_fresh && h2_upgrade(read_ret)) {
+            return;
+        }
+        m_fresh = false;
+
+        // 生成响应
+        printf("*** 正在生成http响应 ***\n");
+        bool write_ret = process_write( read_ret );
+        if ( !write_ret ) {
+            if (m_response_count == 0) {
+                // 工作线程不直接关闭连接，交给事件循环线程，避免和它同时操作这个连接
+                m_backend->want_close(this);
+                return;
+            }
+            // 前面的响应照常发出，发完关闭连接
+            m_keep_alive = false;
+            capped = false;
+            break;
+        }
+        init_request();
+
+        // 要关闭连接、写缓冲放不下下一个响应头、或者有多个范围的响应（m_ranges要留到发完）时，这一批到此为止
+        if (!m_keep_alive || m_part_buf || m_write_idx > WRITE_BUFFER_SIZE - RESPONSE_RESERVE) {
+            break;
+        }
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+
+    // 读缓冲里还有完整的请求，这一批发完后马上就会处理，不用等对方
+    m_more_pending = capped && m_keep_alive && next_request_ready();
+    build_iov();
+    arm_deadline(m_write_timeout);
+    m_backend->want_write(this);
 
     printf("*** 处理完成！ ***\n\n");
 }
 
 
+
+int http_conn::h2_preface() const {
+    int n = m_read_idx < http2_session::PREFACE_LEN ? m_read_idx : http2_session::PREFACE_LEN;
+    if (n == 0 || memcmp(m_read_buf, http2_session::PREFACE, n) != 0) {
+        return -1;
+    }
+    return n == http2_session::PREFACE_LEN ? 1 : 0;
+}
+
+/*
+    Upgrade: h2c（RFC 7540 3.2），只在明文连接的第一个请求上
+    请求后面不能已经跟着别的数据（客户端收到101之后才发序言），也不能有请求体；
+    多个范围的请求已经按HTTP/1.1映射好了，这种少见的情况不升级
+*/
+bool http_conn::h2_upgrade(HTTP_CODE ret) {
+    if (m_ssl || ret == BAD_REQUEST || ret == HEADER_TOO_LARGE || m_content_length != 0 || m_range_count > 1 || m_checked_idx != m_read_idx
+        || !has_token(m_request.get(HDR_UPGRADE), "h2c") || !has_token(m_request.get(HDR_CONNECTION), "upgrade")) {
+        return false;
+    }
+    m_h2 = new http2_session(m_max_header);
+    if (!m_h2->upgrade(trim(m_request.find("http2-settings")))) {
+        delete m_h2;
+        m_h2 = nullptr;
+        return false;
+    }
+    m_fresh = false;
+    if (!h2_respond(1, ret)) {
+        m_h2->reset_stream(1, http2_session::INTERNAL_ERROR);
+    }
+    unmap();
+    m_read_idx = 0;
+    m_checked_idx = 0;
+    release_read_chain();
+    init_request();
+    process_h2();
+    return true;
+}
+
+/*
+    HTTP/2的一轮：先回收上一批发完的流，再处理读缓冲里的帧，每个收全的请求马上回应（响应头进m_out，
+    文件挂到流上），最后按优先级和流量控制生成这一批；和HTTP/1.1一样一批发完才会再进来
+*/
+void http_conn::process_h2() {
+    m_h2->reap();
+    while (true) {
+        int used;
+        http2_session::EVENT ev = m_h2->consume(m_read_buf + m_checked_idx, m_read_idx - m_checked_idx, used);
+        m_checked_idx += used;
+        if (ev == http2_session::REQUEST) {
+            serve_h2();
+            continue;
+        }
+        if (ev == http2_session::NEED_MORE && tls_pending()) {
+            // 读缓冲里的都处理完了（不完整的帧拷进了会话），解密好的数据还在SSL里
+            m_read_idx = m_checked_idx = 0;
+            if (!read()) {
+                m_backend->want_close(this);
+                return;
+            }
+            continue;
+        }
+        break;
+    }
+    // OUTPUT_FULL时剩下的帧留在读缓冲里，这一批发完后由finish_response移到开头，马上接着处理
+    if (m_checked_idx == m_read_idx) {
+        m_read_idx = m_checked_idx = 0;
+    }
+    m_request_start = m_start_line = m_body_start = m_checked_idx;
+
+    m_more_pending = false;
+    bytes_have_send = 0;
+    bytes_to_send = m_h2->build(m_iv, m_iv_fd, m_iv_off, 2 * (MAX_PIPELINE + MAX_RANGES), m_iv_count);
+    m_iv_idx = 0;
+    m_keep_alive = !m_h2->closing();
+    if (bytes_to_send == 0) {
+        if (!m_keep_alive) {
+            m_backend->want_close(this);
+            return;
+        }
+        // 没有可发的：空闲，或者流都在等对方的WINDOW_UPDATE
+        arm_deadline(m_h2->active() > 0 ? m_write_timeout : m_idle_timeout);
+        if (m_read_idx == 0 && !m_read_chain) {
+            // 流的状态都在会话里，等对方时不占着缓冲
+            detach_buffers();
+        }
+        m_backend->want_read(this);
+        return;
+    }
+    arm_deadline(m_write_timeout);
+    m_backend->want_write(this);
+}
+
+// 伪头部换成HTTP/1.1的请求行，:authority当作Host，之后和HTTP/1.1的请求走同样的do_request
+void http_conn::serve_h2() {
+    uint32_t id = m_h2->request_stream();
+    int count;
+    const hpack_field* fields = m_h2->request_fields(count);
+    init_request();
+    HTTP_CODE ret = GET_REQUEST;
+    for (int i = 0; i < count; ++i) {
+        const hpack_field& f = fields[i];
+        bool added = true;
+        if (f.name == ":method") {
+            m_request.method = f.value;
+        } else if (f.name == ":path") {
+            m_request.url = f.value;
+        } else if (f.name == ":authority") {
+            added = m_request.add_header("host", f.value);
+        } else if (f.name.empty() || f.name[0] != ':') {
+            added = m_request.add_header(f.name, f.value);
+        }
+        if (!added) {
+            ret = BAD_REQUEST;
+        }
+    }
+    m_request.version = "HTTP/2";
+    printf("%.*s %.*s HTTP/2 (stream %u)\n", (int) m_request.method.size(), m_request.method.data(),
+           (int) m_request.url.size(), m_request.url.data(), id);
+
+    if (m_request.method == "GET") {
+        m_method = GET;
+    } else if (m_request.method == "HEAD") {
+        m_method = HEAD;
+    } else if (m_request.method == "OPTIONS") {
+        m_method = OPTIONS;
+    } else {
+        ret = BAD_REQUEST;
+    }
+    std::string_view url = m_request.url;
+    if (url.empty() || (url[0] != '/' && !(url == "*" && m_method == OPTIONS))) {
+        ret = BAD_REQUEST;
+    }
+    if (ret != BAD_REQUEST) {
+        ret = do_request();
+    }
+    if (!h2_respond(id, ret)) {
+        m_h2->reset_stream(id, http2_session::INTERNAL_ERROR);
+    }
+    unmap();
+    m_request.reset(); // 字段指向会话的解码缓冲，下一次consume()后就失效了
+}
+
+// 和process_write的字段一样，HTTP/2没有Connection；文件的映射、fd或缓存的引用交给流，发完后由会话释放
+bool http_conn::h2_respond(uint32_t id, HTTP_CODE ret) {
+    http2_session& h2 = *m_h2;
+    http2_session::body_source body;
+    memset(&body, 0, sizeof(body));
+    body.fd = body.own_fd = -1;
+    char num[24];
+    char range[64];
+    int status;
+    const char* form = nullptr;
+    switch (ret) {
+        case INTERNAL_ERROR: status = 500; form = error_500_form; break;
+        case BAD_REQUEST: status = 400; form = error_400_form; break;
+        case NO_RESOURCE: status = 404; form = error_404_form; break;
+        case FORBIDDEN_REQUEST: status = 403; form = error_403_form; break;
+        case RANGE_NOT_SATISFIABLE: status = 416; form = error_416_form; break;
+        case OPTIONS_REQUEST: status = 200; break;
+        case NOT_MODIFIED: status = 304; break;
+        case FILE_REQUEST: status = m_range_count > 0 ? 206 : 200; break;
+        default: return false;
+    }
+
+    h2.begin_headers();
+    h2.add_status(status);
+    if (form) {
+        size_t len = strlen(form);
+        h2.add_header(HPACK_CONTENT_TYPE, "content-type", mime_at(MIME_HTML).type, true);
+        h2.add_header(HPACK_CONTENT_LENGTH, "content-length", std::string_view(num, format_uint(num, len)), false);
+        if (ret == RANGE_NOT_SATISFIABLE) {
+            memcpy(range, "bytes */", 8);
+            int n = 8 + format_uint(range + 8, m_file_stat.st_size);
+            h2.add_header(HPACK_CONTENT_RANGE, "content-range", std::string_view(range, n), false);
+        }
+        body.addr = (char*) form;
+        body.left = m_method == HEAD ? 0 : len;
+        h2.end_headers(id, &body);
+        return true;
+    }
+    if (ret == OPTIONS_REQUEST) {
+        h2.add_header(HPACK_ALLOW, "allow", "GET, HEAD, OPTIONS", true);
+        h2.add_header(HPACK_CONTENT_LENGTH, "content-length", "0", true);
+        h2.end_headers(id, nullptr);
+        return true;
+    }
+
+    off_t first = 0;
+    off_t len = m_file_stat.st_size;
+    if (ret == FILE_REQUEST) {
+        if (m_range_count > 0) {
+            first = m_ranges[0].first;
+            len = m_ranges[0].last - first + 1;
+        }
+        h2.add_header(HPACK_CONTENT_TYPE, "content-type", mime_at(m_mime).type, true);
+        h2.add_header(HPACK_CONTENT_LENGTH, "content-length", std::string_view(num, format_uint(num, len)), false);
+        h2.add_header(HPACK_ACCEPT_RANGES, "accept-ranges", "bytes", true);
+    }
+    h2.add_header(HPACK_ETAG, "etag", std::string_view(m_etag, m_etag_len), false);
+    h2.add_header(HPACK_LAST_MODIFIED, "last-modified", std::string_view(m_last_modified, m_last_modified_len), false);
+    if (m_coding != CODING_IDENTITY) {
+        h2.add_header(HPACK_CONTENT_ENCODING, "content-encoding", codings[m_coding].name, true);
+    }
+    if (m_vary) {
+        h2.add_header(HPACK_VARY, "vary", "accept-encoding", true);
+    }
+    if (ret == FILE_REQUEST && m_range_count > 0) {
+        memcpy(range, "bytes ", 6);
+        int n = 6 + format_uint(range + 6, first);
+        range[n++] = '-';
+        n += format_uint(range + n, m_ranges[0].last);
+        range[n++] = '/';
+        n += format_uint(range + n, m_file_stat.st_size);
+        h2.add_header(HPACK_CONTENT_RANGE, "content-range", std::string_view(range, n), false);
+    }
+    if (ret != FILE_REQUEST || m_method == HEAD || len == 0 || (!m_file_address && m_file_fd < 0)) {
+        h2.end_headers(id, nullptr);
+        return true;
+    }
+
+    body.left = len;
+    if (m_file_fd >= 0) {
+        body.fd = m_file_fd;
+        body.off = first;
+    } else {
+        // 映射是从m_map_offset所在的页开始的
+        body.addr = m_file_address + (first - m_map_offset);
+    }
+    if (m_cache_entry) {
+        body.cached = m_cache_entry;
+    } else if (m_bundle) {
+        body.bundle = m_bundle;
+    } else {
+        body.map = m_file_address;
+        body.map_size = m_file_address ? m_map_size : 0;
+        body.own_fd = m_file_fd;
+    }
+    m_file_address = 0;
+    m_file_fd = -1;
+    m_cache_entry = nullptr;
+    m_bundle = nullptr;
+    h2.end_headers(id, &body);
+    return true;
+}
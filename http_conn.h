@@ -20,12 +20,28 @@
 #include <errno.h>
 #include "locker.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <atomic>
+#include "io_backend.h"
+#include "timer_wheel.h"
+#include "simd_scan.h"
+#include "buffer_pool.h"
+#include "http_request.h"
+#include "file_cache.h"
+#include "bundle.h"
+#include "path_cache.h"
+#include "mime.h"
+#include "response_header.h"
+#include "tls.h"
+#include "http2.h"
 
 
 class http_conn {
 
 public:
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里只支持GET、HEAD和OPTIONS
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
@@ -46,87 +62,310 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        RANGE_NOT_SATISFIABLE : 请求的范围都不在文件内
+        NOT_MODIFIED        :   条件请求，客户端缓存的文件还是最新的
+        OPTIONS_REQUEST     :   OPTIONS请求，只回答支持哪些方法
+        HEADER_TOO_LARGE    :   请求头的一行或者整个请求头超过上限，回431后关闭连接
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+        RANGE_NOT_SATISFIABLE, NOT_MODIFIED, OPTIONS_REQUEST, HEADER_TOO_LARGE };
+
+    // grow_read_buf的结果：腾出了空间；内存不够（或者HTTP/2时超过上限），关闭连接；
+    // HTTP/1.1的请求头超过上限，不再读，交给工作线程回431
+    enum GROW_RESULT { GROW_OK, GROW_FAILED, GROW_TOO_LARGE };
     
+    // 响应体的内容编码，按Accept-Encoding选择
+    enum CONTENT_CODING { CODING_IDENTITY = 0, CODING_BR, CODING_ZSTD, CODING_GZIP };
+
     // 从状态机的三种可能状态，即当前行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚未读取完
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
 public:
-    http_conn() {}
+    http_conn() : m_sockfd(-1), m_bufs(nullptr), m_read_buf(nullptr), m_read_size(0), m_read_chain(nullptr),
+    m_write_buf(nullptr), m_responses(nullptr), m_iv(nullptr), m_iv_fd(nullptr), m_iv_off(nullptr), m_ranges(nullptr), m_real_file(nullptr),
+    m_file_address(0), m_file_fd(-1), m_cache_entry(nullptr), m_bundle(nullptr), m_bundle_entry(nullptr), m_ssl(nullptr), m_h2(nullptr), m_part_buf(nullptr), m_deadline(NO_DEADLINE) {}
     ~http_conn() {}
 
-    static int m_epollfd; // 所有socket上的事件也就是http_conn对象都注册到同一个epollfd上
-    static int m_user_count; // 统计当前用户数量
+    static std::atomic<int> m_user_count; // 统计当前用户数量，多个reactor线程同时增减
     static const int FILENAME_LEN = 200; // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲的大小
+    static const int READ_BUFFER_SIZE = 2048; // 借来的读缓冲区的大小，放不下的请求再从buffer_pool取块
+    static const int WRITE_BUFFER_SIZE = 4096; // 写缓冲的大小，流水线的一批响应头都放在这里
+    static const int MAX_PIPELINE = 32; // 一批最多发送多少个流水线请求的响应
+    static const int RESPONSE_RESERVE = 512; // 写缓冲剩余不到这么多时，先把已有的响应发出去再解析后面的请求
+    static const int MAX_RANGES = 16; // Range中最多几个范围，超过时忽略Range返回整个文件
+    static const size_t SENDFILE_MORE_MAX = 64 * 1024; // sendfile的文件不超过这么大时，响应头带MSG_MORE和文件内容一起发
+    static const off_t INLINE_BODY_MAX = 16 * 1024; // sendfile时不超过这么大的缓存文件也从映射发送，和前后的响应合进一次sendmsg
+    static const uint64_t NO_DEADLINE = UINT64_MAX; // 当前阶段没有超时限制
+    static const off_t COMPRESS_MIN = 256; // 比这还小的文件不压缩，省下的字节抵不上gzip头和压缩的开销
+    static const int TLS_RECORD_MAX = 16 * 1024; // 一条TLS记录最多的明文，没有kTLS时小块凑满一条再SSL_write
 
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新连接
-    void close_conn(); // 关闭连接
+    // 各阶段的超时（毫秒，0表示不限制），由main根据命令行设置
+    // idle：keep-alive连接两个请求之间；header：从请求的第一个字节到头部读完；
+    // body：头部读完后到请求体读完；write：发送响应时多久没有进展
+    static void set_timeouts(int idle_ms, int header_ms, int body_ms, int write_ms);
+    static bool timeouts_enabled() { return m_recheck_ms > 0; }
+    // 请求行加请求头最多占用多少字节，超过时回431后关闭连接；不超过READ_BUFFER_SIZE时不会用到块池
+    static void set_max_header(int bytes) { m_max_header = bytes; }
+    // 文件内容用sendfile从fd直接发送，不mmap；后端不支持时（io_uring）仍然mmap
+    static void set_sendfile(bool on) { m_sendfile = on; }
+    // 没有预先压缩好的文件时按level级gzip压缩后放在文件缓存里，0表示不压缩（只发送预先压缩好的）
+    static void set_gzip_level(int level) { m_gzip_level = level; }
+    // 文档根目录下路径解析结果的缓存：不存在的路径保留ttl_ms毫秒，最多max_entries条，0表示不启用
+    static bool set_path_cache(int ttl_ms, int max_entries);
 
-    void process(); //工作线程执行的代码：解析客户端的请求，把请求的资源封装好
+    void init(int sockfd, const sockaddr_in& addr, io_backend* backend); // 初始化新连接，由接受它的后端负责其I/O
+    void close_conn(bool close_fd = true); // 关闭连接，close_fd为false表示fd由后端自己关闭（如io_uring的链式close）
 
-    
+    void process(); //工作线程执行的代码：解析客户端的请求，把请求的资源封装好
+    void reject(); // 过载时代替process()：不解析请求，回写503后关闭连接
 
     bool read(); // 非阻塞的读
     bool write(); // 非阻塞写
 
+    // 与I/O后端无关的收发接口，不自己做系统调用的后端（io_uring）通过它们驱动状态机
+    int feed(const char* data, int len); // 把后端收到的数据追加到读缓冲，返回实际放入的字节数
+    GROW_RESULT grow_read_buf(); // 读缓冲满了请求还不完整时，腾出或换一块更大的空间
+    // 请求头已经处理完，请求体还没收完：read()/feed()收到的请求体直接跳过，不用交给工作线程
+    bool reading_body() const { return m_check_state == CHECK_STATE_CONTENT && m_body_left > 0; }
+    int get_iov(struct iovec** iov); // 取得待发送数据的iovec，返回iovec个数
+    bool advance(int len); // 已经发送了len字节，返回是否还有数据没发完
+    void finish_response(); // 一批响应发完后释放文件映射，把还没处理的请求数据移到读缓冲开头
+    bool keep_alive() const { return m_keep_alive; }
+    // 这一批之后马上还有下一批（读缓冲里已经有完整的请求头），最后一次发送带MSG_MORE
+    bool more_pending() const { return m_more_pending; }
+    // 这一批响应已经发完，读缓冲里还有没处理的（流水线）请求数据，应该直接交给线程池而不是等可读
+    // TLS时解密好的数据可能还留在SSL的缓冲里，不会再有可读事件；HTTP/2时还可能有流的数据等着发
+    bool has_pending_input() const {
+        return m_response_count == 0 && (m_read_idx > 0 || tls_pending() || (m_h2 && m_h2->ready()));
+    }
+    // TLS握手还没完成，read()/write()已经向后端注册了握手需要的事件，不交给线程池
+    bool handshaking() const { return m_ssl && !SSL_is_init_finished(m_ssl); }
+    int sockfd() const { return m_sockfd; }
+
+    // 超时：工作线程和事件循环线程在各自的热路径上只更新m_deadline，
+    // 时间轮里的节点只由事件循环线程在到期时检查、按新的deadline重新挂上
+    timer_node* timer() { return &m_timer; }
+    uint64_t deadline() const { return m_deadline.load(std::memory_order_relaxed); }
+    bool timed_out(uint64_t now, uint64_t& next) const; // 定时器到期时检查，没超时则在next中给出下次检查的时间
+
 private:
+    io_backend* m_backend; // 该连接所属的I/O后端（接受它的那个reactor）
     int m_sockfd; // 客户端的socket
     sockaddr_in m_address;
 
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
-    char m_write_buf[WRITE_BUFFER_SIZE];
+    struct io_buffers;
+    io_buffers* m_bufs;         // 处理请求期间借来的缓冲（见io_buffers），空闲时为nullptr
+    char* m_read_buf;           // 当前使用的读缓冲区：m_bufs->read_buf，或者m_read_chain的第一块；空闲时为nullptr
+    int m_read_size;            // 当前读缓冲区的大小
+    buf_chunk* m_read_chain;    // 大请求用到的块，新块加在链头；之前的块里是已经解析完的行（m_request指向那里），不再移动
+    int m_read_chunks;          // m_read_chain中的块数
 
     int m_read_idx; // 下一个需要读的起始点, 0 ~ idx是已读完的
     int m_checked_idx; // 当前正在分析的字符在读缓冲区中的位置
     int m_start_line; // 当前正在解析的行的起始位置
+    int m_request_start; // 当前请求在读缓冲区中的起始位置，之前的请求都已经处理完
+
+    // 一个请求的响应：响应头（错误页面的内容也在其中）在写缓冲中的位置，加上mmap或者打开的文件
+    struct response {
+        int header_off;
+        int header_len;
+        char* file_address; // 文件映射的起始位置，发完后munmap
+        size_t map_size;
+        int file_fd;        // sendfile时打开的文件，发完后close；-1表示没有
+        file_cache::entry* cached; // 文件来自缓存时file_address/file_fd是借用它的，发完只释放引用
+        asset_bundle::image* bundle; // 文件来自资源包时file_address指向包内，发完只释放包的引用
+        off_t body_off;     // 要发送的文件内容在文件中的位置：0，或者请求的（第一个）范围的开头
+        char* body;         // mmap时body_off在映射中的位置
+        size_t body_len;    // 响应体的长度，多个范围时包括各部分的分隔头
+        bool multipart;     // multipart/byteranges，按m_ranges分成多个部分发送
+    };
+
+    // Range中的一个范围[first, last]，多个范围时还有这一部分的分隔头在m_part_buf中的位置
+    struct byte_range {
+        off_t first;
+        off_t last;
+        int text_off;
+        int text_len;
+    };
+
+    /*
+        只在处理请求、发送响应期间才需要的缓冲：读写缓冲、这一批的响应和iovec、Range和文件路径
+        第一次收到数据时从每个线程的local_pool借（attach_buffers），一批响应发完、读缓冲里没有剩下的数据时还回去
+        （detach_buffers），空闲的keep-alive连接只剩http_conn本身，常驻内存随正在处理的请求数而不是连接数增长
+    */
+    struct io_buffers {
+        char read_buf[READ_BUFFER_SIZE];
+        char write_buf[WRITE_BUFFER_SIZE];
+        response responses[MAX_PIPELINE];   // 这一批要发送的响应，按请求的顺序
+        // 我们将采用writev来执行写操作，每个响应一个响应头加一个文件，m_iv_count表示被写内存块的数量。
+        // 多个范围的响应每个范围要两块，它总是一批中的最后一个
+        struct iovec iv[2 * (MAX_PIPELINE + MAX_RANGES)];
+        // sendfile时文件内容的块不在内存里：iv_fd[i] >= 0表示第i块是这个文件从iv_off[i]开始的iov_len字节
+        int iv_fd[2 * (MAX_PIPELINE + MAX_RANGES)];
+        off_t iv_off[2 * (MAX_PIPELINE + MAX_RANGES)];
+        byte_range ranges[MAX_RANGES];      // 由do_request按Range设置
+        char real_file[FILENAME_LEN];       // 客户请求的目标文件的完整路径，其内容等于 doc_root（资源路径） + url
+    };
+    static_assert(2 * (MAX_PIPELINE + MAX_RANGES) <= IOV_MAX, "一批的iovec要能在一次sendmsg中发出");
+    // 以下几个指向m_bufs中对应的成员，没有借到缓冲时为nullptr
+    char* m_write_buf;
+    response* m_responses;
+    struct iovec* m_iv;
+    int* m_iv_fd;
+    off_t* m_iv_off;
+    byte_range* m_ranges;
+    char* m_real_file;
 
     int m_write_idx;                        // 写缓冲区中待发送的字节数
     char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
+    off_t m_map_offset;                     // 映射的是文件的哪一段：有Range时只映射请求的范围所在的页
+    size_t m_map_size;
+    int m_file_fd;                          // sendfile时代替m_file_address，客户请求的目标文件的fd
+    file_cache::entry* m_cache_entry;       // 命中或放进了文件缓存时，m_file_stat、映射和fd都来自它
+    asset_bundle::image* m_bundle;          // 在资源包中找到时持有包的引用，m_file_stat和映射都来自m_bundle_entry
+    const bundle_entry* m_bundle_entry;
     struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    char m_etag[48];                        // 由m_file_stat得到的ETag和Last-Modified，响应头和条件请求都用它们
+    int m_etag_len;
+    char m_last_modified[32];
+    int m_last_modified_len;
+    int m_mime;                             // 按请求路径的扩展名得到的MIME类型编号
+    CONTENT_CODING m_coding;                // 选中的内容编码：非identity时m_real_file和m_file_stat是压缩版本的
+    bool m_vary;                            // 文本类的文件，响应随Accept-Encoding变化
+    const char* m_compressed;               // 文件缓存里压缩好的内容，m_file_stat.st_size是它的长度
+    int m_response_count;                   // m_responses中这一批的响应数
     int m_iv_count;
+    int m_iv_idx;                           // 第一个还没有发完的内存块
+    bool m_keep_alive;                      // 这一批响应发完后是否保持连接（最后一个请求的Connection）
+    bool m_more_pending;                    // 这一批是到了数量或写缓冲的上限才停下的，后面还有完整的请求
 
-    char m_real_file[ FILENAME_LEN ]; // 客户请求的目标文件的完整路径，其内容等于 doc_root（资源路径） + m_url
-    
-    char* m_url; // 请求目标文件的文件名
-    char* m_version; // 版本号 只支持 http1.1
+    SSL* m_ssl;                             // 启用TLS时的会话，没有时为nullptr
+    bool m_ktls_send;                       // 发送交给了kTLS：照常sendmsg/sendfile，由内核加密
+
+    // 协商成HTTP/2（prior knowledge、Upgrade: h2c或者ALPN的h2）后的协议状态，HTTP/1.1时为nullptr
+    // 请求仍然由m_request和do_request处理，响应头编码成HEADERS帧，一批的iovec由它按流的优先级生成
+    http2_session* m_h2;
+    bool m_fresh;                           // 连接上还没有处理过请求，只有这时才能切换到HTTP/2
+
+    http_request m_request; // 请求行和所有头部，指向读缓冲
     METHOD m_method; // 请求方法
+    bool m_http10; // HTTP/1.0的请求：默认不保持连接
+
+    // 由do_request按Range设置，排好序、合并了重叠的范围；多个范围的响应发完之前不会再解析下一个请求
+    int m_range_count;
+    buf_chunk* m_part_buf; // 多个范围时各部分的分隔头和结尾的分隔线，从块池取，发完后还回去
+    int m_part_len;        // m_part_buf中的字节数
 
-    char* m_host; // 主机名
     int m_content_length; // HTTP请求的消息总长度
+    int m_body_start;     // 请求体在读缓冲区中的起始位置，请求体边收边丢，读缓冲满时从这里重新写
+    int m_body_left;      // 请求体还有多少字节没收到
     bool m_linger; // http请求是否保持连接
+    bool m_header_too_large; // grow_read_buf发现请求头超过了上限，process_read直接返回HEADER_TOO_LARGE
 
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
 
-    int bytes_to_send;              // 将要发送的数据的字节数
-    int bytes_have_send;            // 已经发送的字节数
+    long bytes_to_send;             // 将要发送的数据的字节数，大文件的范围可能超过2G
+    long bytes_have_send;           // 已经发送的字节数
+
+    timer_node m_timer;             // 挂在所属事件循环的时间轮上
+    std::atomic<uint64_t> m_deadline; // 当前阶段的截止时间（now_ms()），NO_DEADLINE表示不限制
+
+    static int m_idle_timeout;
+    static int m_header_timeout;
+    static int m_body_timeout;
+    static int m_write_timeout;
+    static int m_recheck_ms;        // 当前阶段不限时的连接隔多久再看一次
+    static int m_max_header;
+    static bool m_sendfile;
+    static int m_gzip_level;
 
 private:
     void init(); // 初始化连接的其他信息
+    void init_request(); // 一个请求处理完，为解析下一个请求重置状态，读缓冲中的数据保留
+    void release_read_chain(); // 把块还回池里，回到借来的读缓冲
+    bool attach_buffers(); // 还没有缓冲时借一份，内存不够时返回false
+    void detach_buffers(); // 没有正在处理的请求和没发完的响应时把缓冲还回去
+    void queue_response(); // 把刚生成的响应加入这一批
+    void build_iov(); // 按这一批的响应生成m_iv
+    bool next_request_ready() const; // 读缓冲里没处理的数据中有完整的请求头
+    void uncork(); // 把上一批带MSG_MORE留在内核里的数据推出去
+    bool handshake(); // 推进TLS握手，需要等待时向后端注册事件；握手失败返回false
+    int tls_recv(char* buf, int len); // 和recv一样返回，没有数据时errno为EAGAIN
+    int tls_send(); // 没有kTLS时代替sendmsg，把m_iv_idx开始的内存块加密发送
+    int h2_preface() const; // 读缓冲开头是HTTP/2的连接序言：1是，0还不确定，-1不是
+    bool h2_upgrade(HTTP_CODE ret); // 请求带Upgrade: h2c时切换到HTTP/2，这个请求成为流1
+    void process_h2(); // HTTP/2时代替process()的主体
+    void serve_h2(); // 把一个HTTP/2请求的字段放进m_request，像HTTP/1.1一样do_request后回应
+    bool h2_respond(uint32_t id, HTTP_CODE ret); // 按do_request的结果编码响应头，把文件挂到流上
+    bool tls_pending() const { return m_ssl && SSL_pending(m_ssl) > 0; }
+    // 文件内容能用sendfile发送：后端支持，而且没有TLS或者TLS的发送交给了kTLS
+    bool use_sendfile() const { return m_sendfile && m_backend->can_sendfile() && (!m_ssl || m_ktls_send); }
+    void push_iov(char* base, size_t len) {
+        m_iv[m_iv_count].iov_base = base;
+        m_iv[m_iv_count].iov_len = len;
+        m_iv_fd[m_iv_count++] = -1;
+    }
+    void push_file_iov(int fd, off_t off, size_t len) {
+        m_iv[m_iv_count].iov_base = nullptr;
+        m_iv[m_iv_count].iov_len = len;
+        m_iv_fd[m_iv_count] = fd;
+        m_iv_off[m_iv_count++] = off;
+    }
+    void arm_deadline(int timeout_ms) {
+        m_deadline.store(timeout_ms > 0 ? now_ms() + timeout_ms : NO_DEADLINE, std::memory_order_relaxed);
+    }
     
     // 主状态机 都用于process_read
     HTTP_CODE process_read(); // 解析http请求
     HTTP_CODE parse_request_line(char* text); // 解析请求首行
     HTTP_CODE parse_headers(char* text); // 解析请求头
-    HTTP_CODE parse_content(char* text); // 解析请求体
+    static bool parse_length(std::string_view text, int& length);
+    HTTP_CODE parse_content(); // 解析请求体
     HTTP_CODE do_request();
+    HTTP_CODE parse_range(); // 按Range和If-Range确定要发送文件的哪些范围
+    bool if_range_matches();
+    void select_coding(); // 按Accept-Encoding选择发送原文件还是压缩的版本
+    bool use_precompressed(CONTENT_CODING coding); // 有预先压缩好的同名文件时换成它
+    bool use_gzip_cache(); // 换成文件缓存里gzip压缩的版本，第一次时压缩
+    bool lookup_bundle(std::string_view path); // 在资源包中找请求的路径，找到时不再访问文件系统
+    bool use_bundle_variant(CONTENT_CODING coding); // 资源包里有这个编码的版本时换成它
+    void make_validators(); // 按m_file_stat生成m_etag和m_last_modified
+    bool not_modified(); // If-None-Match / If-Modified-Since
     // 从状态机
     LINE_STATUS parse_line(); // 解析具体某一行
     char* getline() {return &m_read_buf[m_start_line];}
+    char* line_end() {return &m_read_buf[m_checked_idx - 2];} // parse_line返回LINE_OK后，当前行结尾的'\0'处
 
     // 用于process_write
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
     void unmap();
     bool add_response( const char* format, ... );
     bool add_content( const char* content );
-    bool add_content_type();
+    bool append( std::string_view s ) {
+        if ( (int) s.size() >= WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
+            return false;
+        }
+        memcpy( m_write_buf + m_write_idx, s.data(), s.size() );
+        m_write_idx += s.size();
+        return true;
+    }
+    bool append_uint( unsigned long long v ) {
+        if ( m_write_idx + 20 >= WRITE_BUFFER_SIZE - 1 ) {
+            return false;
+        }
+        m_write_idx += format_uint( m_write_buf + m_write_idx, v );
+        return true;
+    }
     bool add_status_line( int status, const char* title );
-    void add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_head( header_templates::STATUS status, int mime ); // 预先拼好的状态行和固定的头部
+    bool add_length( off_t content_length ); // 模板最后的Content-Length的值
+    bool add_content_length( off_t content_length );
+    bool add_content_range( off_t first, off_t last );
+    bool add_error( header_templates::STATUS status, const char* form );
+    bool add_multipart(); // 多个范围的响应头和各部分的分隔头
+    bool add_validators(); // ETag和Last-Modified
+    bool add_coding(); // Content-Encoding和Vary
     bool add_linger();
     bool add_blank_line();
 
@@ -0,0 +1,119 @@
+#include "http_request.h"
+#include <strings.h>
+
+namespace {
+
+// 下标就是HEADER_ID，都是小写
+constexpr std::string_view known_names[HDR_COUNT] = {
+    "host",
+    "connection",
+    "content-length",
+    "content-type",
+    "transfer-encoding",
+    "user-agent",
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "cookie",
+    "referer",
+    "range",
+    "if-range",
+    "if-match",
+    "if-none-match",
+    "if-modified-since",
+    "if-unmodified-since",
+    "cache-control",
+    "pragma",
+    "authorization",
+    "origin",
+    "upgrade",
+    "expect",
+    "te",
+};
+
+const int HASH_SIZE = 64; // 哈希表的槽数，2的幂
+static_assert(HDR_COUNT < HASH_SIZE, "哈希表的槽数要大于认识的头部个数");
+
+// 带seed的FNV-1a；头部名字只有字母、数字和'-'，'|0x20'把字母转成小写，对数字和'-'没有影响
+constexpr uint32_t hash_name(const char* s, size_t n, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (uint8_t)(s[i] | 0x20);
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 16)) & (HASH_SIZE - 1);
+}
+
+struct hash_table {
+    uint32_t seed;
+    int8_t slot[HASH_SIZE]; // 槽中的HEADER_ID，-1表示空
+};
+
+// 编译期依次尝试seed，直到所有认识的名字都落在不同的槽里，查找时不用处理冲突
+constexpr hash_table build_table() {
+    for (uint32_t seed = 0; ; ++seed) {
+        hash_table t = { seed, {} };
+        for (int i = 0; i < HASH_SIZE; ++i) {
+            t.slot[i] = -1;
+        }
+        bool ok = true;
+        for (int id = 0; id < HDR_COUNT && ok; ++id) {
+            uint32_t h = hash_name(known_names[id].data(), known_names[id].size(), seed);
+            if (t.slot[h] >= 0) {
+                ok = false;
+            } else {
+                t.slot[h] = id;
+            }
+        }
+        if (ok) {
+            return t;
+        }
+    }
+}
+
+constexpr hash_table table = build_table();
+
+}
+
+HEADER_ID http_request::lookup(std::string_view name) {
+    int id = table.slot[hash_name(name.data(), name.size(), table.seed)];
+    // 不认识的名字也会落到某个槽里，再比较一次名字
+    if (id < 0 || !equals_nocase(name, known_names[id])) {
+        return HDR_UNKNOWN;
+    }
+    return (HEADER_ID) id;
+}
+
+std::string_view http_request::name_of(HEADER_ID id) {
+    return id < HDR_COUNT ? known_names[id] : std::string_view();
+}
+
+std::string_view http_request::find(std::string_view name) const {
+    HEADER_ID id = lookup(name);
+    if (id != HDR_UNKNOWN) {
+        return get(id);
+    }
+    for (int i = 0; i < m_count; ++i) {
+        if (equals_nocase(m_headers[i].name, name)) {
+            return m_headers[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+// 空的视图（没有解析到）不移动
+static void rebase_view(std::string_view& v, long delta) {
+    if (v.data()) {
+        v = std::string_view(v.data() + delta, v.size());
+    }
+}
+
+void http_request::rebase(long delta) {
+    rebase_view(method, delta);
+    rebase_view(url, delta);
+    rebase_view(version, delta);
+    for (int i = 0; i < m_count; ++i) {
+        rebase_view(m_headers[i].name, delta);
+        rebase_view(m_headers[i].value, delta);
+    }
+}
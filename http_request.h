@@ -0,0 +1,110 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string_view>
+
+// 认识的请求头部，按名字查找时由编译期生成的完美哈希表直接得到
+enum HEADER_ID {
+    HDR_HOST = 0,
+    HDR_CONNECTION,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_USER_AGENT,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_COOKIE,
+    HDR_REFERER,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_MATCH,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_UNMODIFIED_SINCE,
+    HDR_CACHE_CONTROL,
+    HDR_PRAGMA,
+    HDR_AUTHORIZATION,
+    HDR_ORIGIN,
+    HDR_UPGRADE,
+    HDR_EXPECT,
+    HDR_TE,
+    HDR_COUNT,
+    HDR_UNKNOWN = HDR_COUNT
+};
+
+/*
+    解析出的一个请求：请求行的三部分和所有头部都是指向读缓冲的string_view，不拷贝
+    认识的头部另外记下它在头部列表中的位置，取值是O(1)的；不认识的头部也都保留，可以按名字找
+    读缓冲中的数据移动时（流水线请求的压缩）由http_conn调用rebase()让视图跟着移动
+*/
+class http_request {
+public:
+    static const int MAX_HEADERS = 48; // 头部个数上限，超过时按错误请求处理
+
+    struct header {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    http_request() { reset(); }
+
+    void reset() {
+        method = url = version = std::string_view();
+        m_count = 0;
+        memset(m_known, -1, sizeof(m_known));
+    }
+
+    // 记录一个头部，名字和值都已经去掉了两边的空白；头部太多时返回false
+    bool add_header(std::string_view name, std::string_view value) {
+        if (m_count == MAX_HEADERS) {
+            return false;
+        }
+        HEADER_ID id = lookup(name);
+        if (id != HDR_UNKNOWN && m_known[id] < 0) {
+            m_known[id] = m_count; // 重复的头部取第一个
+        }
+        m_headers[m_count].name = name;
+        m_headers[m_count].value = value;
+        ++m_count;
+        return true;
+    }
+
+    bool has(HEADER_ID id) const { return m_known[id] >= 0; }
+    // 认识的头部的值，没有这个头部时返回空
+    std::string_view get(HEADER_ID id) const {
+        return m_known[id] >= 0 ? m_headers[(int) m_known[id]].value : std::string_view();
+    }
+    // 任意头部的值，名字不区分大小写
+    std::string_view find(std::string_view name) const;
+
+    int header_count() const { return m_count; }
+    const header& header_at(int i) const { return m_headers[i]; }
+
+    // 读缓冲中的数据整体移动了delta字节
+    void rebase(long delta);
+
+    // 名字（不区分大小写）对应的HDR_*，不认识时返回HDR_UNKNOWN
+    static HEADER_ID lookup(std::string_view name);
+    // HDR_*对应的名字（小写）
+    static std::string_view name_of(HEADER_ID id);
+
+public:
+    std::string_view method;
+    std::string_view url;
+    std::string_view version;
+
+private:
+    header m_headers[MAX_HEADERS];
+    int m_count;
+    int8_t m_known[HDR_COUNT]; // 认识的头部在m_headers中的下标，-1表示没有
+};
+
+// 不区分大小写比较
+inline bool equals_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <pthread.h>
+
+class http_conn;
+
+/*
+    I/O后端：一个事件循环线程 + http_conn状态机回调它的三个接口
+    http_conn只关心"请求不完整还要读"、"响应好了要发"、"要关闭"，
+    具体是modfd重新注册epoll事件，还是往io_uring里提交sqe，由后端自己决定
+    目前有两种实现：reactor（epoll）和uring_reactor（io_uring）
+*/
+class io_backend {
+public:
+    io_backend() : m_started(false) {}
+    virtual ~io_backend() {}
+
+    virtual void loop() = 0; // 事件循环，单reactor模式下由主线程直接调用
+
+    // 以下由工作线程在process()结束时调用（epoll后端的write()也会在事件循环线程中调用）
+    virtual void want_read(http_conn* conn) = 0;  // 请求还不完整，等待更多数据
+    virtual void want_write(http_conn* conn) = 0; // 响应已生成，等待发送
+    virtual void want_close(http_conn* conn) = 0; // 出错需要关闭，由事件循环线程真正关闭
+
+    // 发送时由http_conn::write()自己做系统调用的后端可以用sendfile发文件，
+    // 只通过get_iov()/advance()发送内存的后端（io_uring）不行
+    virtual bool can_sendfile() const { return false; }
+
+    // 在新线程中运行事件循环
+    bool start() {
+        if (pthread_create(&m_thread, nullptr, worker, this)) {
+            return false;
+        }
+        m_started = true;
+        return true;
+    }
+
+    // 事件循环线程，没有start（在主线程中运行）时无意义
+    pthread_t thread() const { return m_thread; }
+
+    // 等待事件循环线程结束
+    void join() {
+        if (m_started) {
+            pthread_join(m_thread, nullptr);
+            m_started = false;
+        }
+    }
+
+private:
+    static void* worker(void* arg) {
+        io_backend* backend = (io_backend*) arg;
+        backend->loop();
+        return backend;
+    }
+
+private:
+    pthread_t m_thread;
+    bool m_started;
+};
+
+#endif
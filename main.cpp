@@ -7,132 +7,269 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <getopt.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "config.h"
+#include "tls.h"
 
-#define MAX_FD 65535 // 最大的文件描述符个数,实际可能支持不了这么高的并发
-#define MAX_EVENT_NUM 10000 // 同时监听的最大数量
-
-// 添加信号捕捉 
+// 添加信号捕捉
 void addsig(int sig, void (*handler)(int)) {
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
-    sa.sa_handler = handler; // 
+    sa.sa_handler = handler; //
     sigfillset(&sa.sa_mask); // 把所有临时阻塞的信号集全部置为1（把信号全部添加到阻塞信号集中，表示全部阻塞）
     sigaction(sig, &sa, NULL);
 }
 
-// 添加文件描述符到epoll
-extern void addfd(int epollfd, int fd, bool one_shot);
+void report_handler(int /*sig*/) {
+    file_cache::instance().request_report();
+    tls_context::instance().request_report();
+    asset_bundle::instance().request_report();
+    path_cache::instance().request_report();
+    request_timeout_report();
+}
 
-// 修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
+void reload_handler(int /*sig*/) {
+    asset_bundle::instance().request_reload();
+}
 
-// 删除文件描述符
-extern void removefd(int epollfd, int fd);
+void usage(const char* prog) {
+    printf("用法: %s 端口号 [-r reactor数量] [-b backlog] [-d 秒数] [-e epoll|uring] [-t idle,header,body,write] [-w 最少线程数[,最多线程数]] [-s] [-a] [-q target,interval] [-m KB] [-z] [-c MB[,check_ms]] [-p ttl_ms[,条目数]] [-g level] [-S cert.pem,key.pem] [-B bundle]\n", prog);
+    printf("  -r N  reactor（epoll事件循环）数量，默认1即单reactor；0表示每个核一个，各自用SO_REUSEPORT监听\n");
+    printf("  -b N  listen的全连接队列长度，默认1024\n");
+    printf("  -d N  启用TCP_DEFER_ACCEPT，客户端N秒内不发数据就不唤醒accept，默认不启用\n");
+    printf("  -e    I/O后端，默认epoll；uring需要6.0以上内核，不支持时自动退回epoll\n");
+    printf("  -t    各阶段超时秒数：keep-alive空闲、读请求头、读请求体、发送停滞，0表示不限，默认60,10,30,30；kill -USR1打印超时的连接数\n");
+    printf("  -w    工作线程数，默认4,32，按任务排队长度和处理时间在两者之间伸缩；只给一个数表示固定线程数\n");
+    printf("  -s    线程池使用每线程本地队列+工作窃取，连接交给和它的reactor亲和的线程处理，线程数固定为最少线程数\n");
+    printf("  -a    把reactor和工作线程绑定到CPU上，第i个工作线程和它所属的reactor在同一个核\n");
+    printf("  -q    按排队时间拒绝请求（CoDel）：排队时间持续interval毫秒超过target毫秒时回503，默认5,100，0表示不启用\n");
+    printf("  -m N  请求行加请求头最大N KB，超过时（或者一行超过8KB）回431后关闭连接，默认32；请求体不受限制，边收边丢\n");
+    printf("  -z    文件内容用sendfile从fd直接发送，不mmap；io_uring后端不支持，仍然mmap\n");
+    printf("  -c    热点文件缓存的容量（MB）和重新stat检查文件是否修改的间隔（毫秒），默认64,1000，0表示不缓存；kill -USR1打印命中率\n");
+    printf("  -p    路径缓存：不存在的路径多久（毫秒）之后重新stat和最多缓存多少条，默认1000,65536，条目数0表示不缓存；inotify监视文档根目录，文件变了马上失效\n");
+    printf("  -g N  文本文件没有预先压缩好的.br/.zst/.gz时，按N级（1~9）gzip压缩后放在文件缓存里，默认0不压缩\n");
+    printf("  -S    启用TLS，证书链和私钥都是PEM文件；只支持epoll后端，内核有tls模块时发送交给kTLS，kill -USR1打印会话恢复的统计；ALPN协商h2\n");
+    printf("  -B    从tools/bundle_pack打好的资源包读文件，不在包里的路径仍然找文档根目录；部署新包后kill -HUP换上，kill -USR1打印命中率\n");
+    printf("HTTP/2不用选项：明文连接上直接发序言（prior knowledge）或者Upgrade: h2c，TLS时按ALPN\n");
+}
 
 int main(int argc, char* argv[]) {
     // 主线程
 
-    if (argc <= 1) {
+    // 解析命令行选项，端口号之后可以跟若干选项
+    server_config config;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:d:e:t:w:saq:m:zc:p:g:S:B:")) != -1) {
+        switch (opt) {
+            case 'r':
+                config.reactor_num = atoi(optarg);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 'd':
+                config.defer_accept = atoi(optarg);
+                break;
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    config.use_uring = true;
+                } else if (strcmp(optarg, "epoll") != 0) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d,%d,%d,%d", &config.idle_timeout, &config.header_timeout,
+                           &config.body_timeout, &config.write_timeout) != 4) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'w':
+                if (sscanf(optarg, "%d,%d", &config.thread_num, &config.max_thread_num) == 1) {
+                    config.max_thread_num = config.thread_num;
+                }
+                break;
+            case 's':
+                config.work_stealing = true;
+                break;
+            case 'a':
+                config.pin_cpu = true;
+                break;
+            case 'q':
+                if (sscanf(optarg, "%d,%d", &config.queue_target, &config.queue_interval) < 1) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                config.max_header_kb = atoi(optarg);
+                break;
+            case 'z':
+                config.sendfile = true;
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d,%d", &config.cache_mb, &config.cache_check_ms) < 1) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d,%d", &config.path_ttl_ms, &config.path_entries) < 1) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'g':
+                config.gzip_level = atoi(optarg);
+                if (config.gzip_level < 0 || config.gzip_level > 9) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                break;
+            case 'S': {
+                char* comma = strchr(optarg, ',');
+                if (!comma) {
+                    usage(argv[0]);
+                    exit(-1);
+                }
+                *comma = '\0';
+                config.tls_cert = optarg;
+                config.tls_key = comma + 1;
+                break;
+            }
+            case 'B':
+                config.bundle = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(-1);
+        }
+    }
+
+    if (optind >= argc) {
         printf("命令行输入缺少端口号\n");
+        usage(argv[0]);
         exit(-1); // 程序退出并将异常值返回给os
     }
 
     // 获取端口号 acsii to integer
-    int port = atoi(argv[1]);
+    config.port = atoi(argv[optind]);
+
+    if (config.reactor_num <= 0) {
+        config.reactor_num = sysconf(_SC_NPROCESSORS_ONLN);
+        if (config.reactor_num <= 0) config.reactor_num = 1;
+    }
+    if (config.backlog <= 0) {
+        config.backlog = SOMAXCONN;
+    }
+
+    http_conn::set_timeouts(config.idle_timeout * 1000, config.header_timeout * 1000,
+                            config.body_timeout * 1000, config.write_timeout * 1000);
+    http_conn::set_max_header(config.max_header_kb * 1024);
+    http_conn::set_sendfile(config.sendfile);
+    http_conn::set_gzip_level(config.gzip_level);
+    file_cache::instance().configure((size_t) config.cache_mb * 1024 * 1024, config.cache_check_ms);
+    if (!http_conn::set_path_cache(config.path_ttl_ms, config.path_entries)) {
+        exit(-1);
+    }
+    if (config.bundle && !asset_bundle::instance().open(config.bundle)) {
+        exit(-1);
+    }
+    if (config.tls_cert) {
+        if (!tls_context::instance().init(config.tls_cert, config.tls_key)) {
+            exit(-1);
+        }
+        // io_uring后端由内核直接收发，中间没有机会做SSL_read/SSL_write
+        if (config.use_uring) {
+            printf("TLS只支持epoll后端，使用epoll\n");
+            config.use_uring = false;
+        }
+    }
 
     // 对sigpipe做处理
     addsig(SIGPIPE, SIG_IGN);
+    // kill -USR1 打印文件缓存、路径缓存、资源包、TLS会话和超时连接数的统计
+    addsig(SIGUSR1, report_handler);
+    // kill -HUP 换上重新打好的资源包
+    addsig(SIGHUP, reload_handler);
 
     // 创建线程池 http_connection
     threadpool<http_conn> *pool = nullptr;
     try {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(config.thread_num, 10000, config.work_stealing, config.max_thread_num);
     } catch(...) {
         exit(-1);
     }
+    pool->set_queue_delay(config.queue_target, config.queue_interval);
 
     // 所有客户端的连接请求
-    http_conn* users = new http_conn[MAX_FD]; // 已连接的客户端
-
-    // 创建监听的套接字
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-
-    // 设置端口复用
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-
-    // 绑定
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; // 绑定ip地址（一台机器有多个网卡，每个网卡都有自己的ip地址，这里表示监听所有网卡）
-    address.sin_port = htons(port); // 绑定端口号（当内核收到 TCP 报文，通过 TCP 头里面的端口号，来找到应用程序）
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address)); // listen套接字将要监听的是这个地址
-
+    conn_table users(MAX_FD); // 已连接的客户端，按fd下标，第一次accept时才创建
 
-    // 监听
-    listen(listenfd, 5);
-
-    // 创建epoll对象 IO 多路复用
-    epoll_event events[MAX_EVENT_NUM]; // ready list返回到用户态下的数组
-    int epollfd = epoll_create(1); // 任意正数，不影响实际创建多大
-
-    // 将监听的文件描述符添加
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
-
-    while (1) {
-        int request_num = epoll_wait(epollfd, events, MAX_EVENT_NUM, -1);
-        if (errno != EINTR && request_num < 0) { // 不是被中断的
-            printf("epoll failed!\n");
-            break;
-        }
+#ifndef HAVE_IO_URING
+    if (config.use_uring) {
+        printf("编译时的内核头文件不支持io_uring，使用epoll\n");
+        config.use_uring = false;
+    }
+#endif
 
-        // 遍历事件数组
-        for (int i = 0; i < request_num; i++) {
-            int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
-                // listen触发说明有新的客户端连接
-                struct sockaddr_in client_address;
-                socklen_t client_address_len = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_address_len);
-
-                if (http_conn::m_user_count >= MAX_FD) {
-                    /*
-                        TODO:
-                        给客户端回写信息：服务器正忙
-                    */
-                    close(connfd);
+    // 创建reactor，每个reactor有自己的监听socket和epollfd（或io_uring）
+    // 多于一个时用SO_REUSEPORT让它们绑定同一个端口
+    io_backend** reactors = new io_backend*[config.reactor_num];
+    for (int i = 0; i < config.reactor_num; ++i) {
+        try {
+#ifdef HAVE_IO_URING
+            if (config.use_uring) {
+                try {
+                    reactors[i] = new uring_reactor(i, config, users, pool);
                     continue;
+                } catch(...) {
+                    // 内核不支持（或被禁用）io_uring，之后的reactor都用epoll
+                    printf("io_uring不可用，使用epoll\n");
+                    config.use_uring = false;
                 }
+            }
+#endif
+            reactors[i] = new reactor(i, config, users, pool);
+        } catch(...) {
+            printf("创建第%d个reactor失败: %s\n", i, strerror(errno));
+            exit(-1);
+        }
+    }
 
-                // 将新客户的数据初始化
-                users[connfd].init(connfd, client_address);
-
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // 对方异常断开等错误事件
-                users[sockfd].close_conn();
+    // 第0个reactor在主线程运行，其余各自一个线程
+    for (int i = 1; i < config.reactor_num; ++i) {
+        if (!reactors[i]->start()) {
+            printf("启动第%d个reactor失败\n", i);
+            exit(-1);
+        }
+    }
 
-            } else if (events[i].events & EPOLLIN) {
-                if (users[sockfd].read()) {
-                    // 一次把数据都读完
-                    pool->append(&users[sockfd]);
-                } else {
-                    users[sockfd].close_conn();
-                }
-            } else if (events[i].events & EPOLLOUT) {
-                if (!users[sockfd].write()) {
-                    users[sockfd].close_conn();
-                }
-            }
+    // 第i个reactor绑定到第i个核，工作线程和它所属的reactor（见worker_hint）绑在同一个核，动态新建的线程也一样
+    if (config.pin_cpu) {
+        bool ok = pin_thread(pthread_self(), 0);
+        for (int i = 1; i < config.reactor_num; ++i) {
+            ok = pin_thread(reactors[i]->thread(), i) && ok;
+        }
+        ok = pool->pin_workers(config.reactor_num) && ok;
+        if (!ok) {
+            printf("绑定CPU失败\n");
         }
     }
+    reactors[0]->loop();
 
-    close(epollfd);
-    close(listenfd);
-    delete [] users; // 释放用户池
+    for (int i = 1; i < config.reactor_num; ++i) {
+        reactors[i]->join();
+    }
+    for (int i = 0; i < config.reactor_num; ++i) {
+        delete reactors[i];
+    }
+    delete [] reactors;
     delete pool; // 释放线程池
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,110 @@
+#include "mime.h"
+#include "http_request.h"
+
+namespace {
+
+// 顺序就是编号，0号和1号的位置不能变（见mime.h）
+constexpr mime_type types[] = {
+    { "",      "application/octet-stream", false },
+    { "html",  "text/html", true },
+    { "htm",   "text/html", true },
+    { "css",   "text/css", true },
+    { "js",    "text/javascript", true },
+    { "mjs",   "text/javascript", true },
+    { "json",  "application/json", true },
+    { "map",   "application/json", true },
+    { "xml",   "application/xml", true },
+    { "txt",   "text/plain", true },
+    { "csv",   "text/csv", true },
+    { "md",    "text/markdown", true },
+    { "svg",   "image/svg+xml", true },
+    { "wasm",  "application/wasm", true },
+    { "ico",   "image/x-icon", true },
+    { "bmp",   "image/bmp", true },
+    { "png",   "image/png", false },
+    { "jpg",   "image/jpeg", false },
+    { "jpeg",  "image/jpeg", false },
+    { "gif",   "image/gif", false },
+    { "webp",  "image/webp", false },
+    { "avif",  "image/avif", false },
+    { "ttf",   "font/ttf", true },
+    { "otf",   "font/otf", true },
+    { "woff",  "font/woff", false },
+    { "woff2", "font/woff2", false },
+    { "mp4",   "video/mp4", false },
+    { "webm",  "video/webm", false },
+    { "mp3",   "audio/mpeg", false },
+    { "ogg",   "audio/ogg", false },
+    { "wav",   "audio/wav", false },
+    { "pdf",   "application/pdf", false },
+    { "zip",   "application/zip", false },
+    { "gz",    "application/gzip", false },
+    { "tar",   "application/x-tar", false },
+};
+
+constexpr int TYPE_COUNT = sizeof(types) / sizeof(types[0]);
+const int HASH_SIZE = 128; // 哈希表的槽数，2的幂
+static_assert(TYPE_COUNT < HASH_SIZE, "哈希表的槽数要大于类型个数");
+
+// 和http_request.cpp中头部名字的哈希一样：带seed的FNV-1a，'|0x20'把字母转成小写
+constexpr uint32_t hash_ext(const char* s, size_t n, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (uint8_t)(s[i] | 0x20);
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 16)) & (HASH_SIZE - 1);
+}
+
+struct hash_table {
+    uint32_t seed;
+    int8_t slot[HASH_SIZE]; // 槽中的类型编号，-1表示空
+};
+
+// 编译期依次尝试seed，直到所有扩展名都落在不同的槽里
+constexpr hash_table build_table() {
+    for (uint32_t seed = 0; ; ++seed) {
+        hash_table t = { seed, {} };
+        for (int i = 0; i < HASH_SIZE; ++i) {
+            t.slot[i] = -1;
+        }
+        bool ok = true;
+        for (int id = 1; id < TYPE_COUNT && ok; ++id) {
+            uint32_t h = hash_ext(types[id].ext.data(), types[id].ext.size(), seed);
+            if (t.slot[h] >= 0) {
+                ok = false;
+            } else {
+                t.slot[h] = id;
+            }
+        }
+        if (ok) {
+            return t;
+        }
+    }
+}
+
+constexpr hash_table table = build_table();
+
+}
+
+int mime_count() {
+    return TYPE_COUNT;
+}
+
+const mime_type& mime_at(int id) {
+    return types[id];
+}
+
+int mime_lookup(std::string_view path) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) {
+        return 0;
+    }
+    std::string_view ext = path.substr(dot + 1);
+    int id = table.slot[hash_ext(ext.data(), ext.size(), table.seed)];
+    // 不认识的扩展名也会落到某个槽里，再比较一次
+    if (id < 0 || !equals_nocase(ext, types[id].ext)) {
+        return 0;
+    }
+    return id;
+}
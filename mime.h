@@ -0,0 +1,22 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string_view>
+
+// 按扩展名得到的Content-Type，表在编译期生成（mime.cpp）
+struct mime_type {
+    std::string_view ext;  // 小写的扩展名，不带'.'
+    std::string_view type;
+    bool compressible;     // 文本类的内容，值得协商压缩；图片、视频、压缩包本身已经压缩过了
+};
+
+// 表中的类型个数，下标就是mime_lookup返回的编号；0号是认不出扩展名时用的application/octet-stream
+int mime_count();
+const mime_type& mime_at(int id);
+// 按路径最后一段的扩展名查找，不区分大小写，O(1)
+int mime_lookup(std::string_view path);
+
+// 错误页面等服务器自己生成的内容的类型
+const int MIME_HTML = 1;
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+/*
+    有界无锁多生产者多消费者队列（Dmitry Vyukov的算法）
+    环形数组，每个格子带一个序号：
+        序号 == 位置       格子空，生产者可以写
+        序号 == 位置 + 1   格子满，消费者可以读
+    生产者/消费者各自CAS抢一个位置，抢到后只写自己的格子，不需要锁，
+    也不需要像std::list那样每个元素分配一个节点
+    容量向上取整到2的幂
+*/
+template<class T>
+class mpmc_queue {
+public:
+    explicit mpmc_queue(size_t capacity) : m_buffer(nullptr), m_mask(0) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        m_buffer = new cell[size];
+        if (!m_buffer) throw std::exception();
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            m_buffer[i].seq.store(i, std::memory_order_relaxed);
+        }
+        m_enqueue_pos.store(0, std::memory_order_relaxed);
+        m_dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    ~mpmc_queue() {
+        delete [] m_buffer;
+    }
+
+    // 队列满时返回false
+    bool push(const T& data) {
+        cell* c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                // 格子空，抢这个位置
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // 转了一圈回到还没被读走的格子，队列满
+                return false;
+            } else {
+                // 被别的生产者抢先了
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = data;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 队列空时返回false
+    bool pop(T& data) {
+        cell* c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (1) {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        data = c->data;
+        // 序号推进一圈，格子重新可写
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 大致的元素个数，并发时只是一个近似值
+    size_t size() const {
+        size_t enq = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t deq = m_dequeue_pos.load(std::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    mpmc_queue(const mpmc_queue&);
+    mpmc_queue& operator=(const mpmc_queue&);
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    // 生产者和消费者的位置放在不同的cache line，避免伪共享
+    cell* m_buffer;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos;
+    alignas(64) std::atomic<size_t> m_dequeue_pos;
+};
+
+#endif
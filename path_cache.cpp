@@ -0,0 +1,286 @@
+#include "path_cache.h"
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include "timer_wheel.h"
+
+// 目录里文件的增删改名、内容和权限的变化，以及目录自己被删掉或者移走
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY
+    | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+bool path_cache::configure(const char* root, int ttl_ms, size_t max_entries) {
+    m_root = root;
+    m_ttl_ms = ttl_ms;
+    m_max_entries = max_entries;
+    m_shard_entries = max_entries / SHARDS > 0 ? max_entries / SHARDS : 1;
+    if (max_entries == 0) {
+        return true;
+    }
+    m_inotify = inotify_init1(IN_CLOEXEC);
+    if (m_inotify < 0) {
+        printf("路径缓存: inotify: %s，所有结论只保留%d毫秒\n", strerror(errno), ttl_ms);
+        return true;
+    }
+    m_watching = true;
+    watch_tree(m_root, true);
+    if (!m_watching) {
+        printf("路径缓存: 有的目录监视不上（fs.inotify.max_user_watches？），所有结论只保留%d毫秒\n", ttl_ms);
+    }
+    if (pthread_create(&m_thread, nullptr, watcher, this)) {
+        return false;
+    }
+    pthread_detach(m_thread);
+    return true;
+}
+
+int path_cache::stat(const char* path, struct stat* st) {
+    std::string_view key(path);
+    if (!enabled() || key.compare(0, m_root.size(), m_root) != 0
+        || (key.size() > m_root.size() && key[m_root.size()] != '/')) {
+        return ::stat(path, st);
+    }
+    if (m_report.load(std::memory_order_relaxed) && m_report.exchange(false)) {
+        report();
+    }
+    shard& s = shard_of(key);
+    uint64_t now = now_ms();
+    uint64_t epoch = m_epoch.load();
+
+    s.lock.lock();
+    auto it = s.map.find(key);
+    if (it != s.map.end()) {
+        auto node = it->second;
+        if (node->epoch == epoch && now < node->expire_ms) {
+            s.lru.splice(s.lru.begin(), s.lru, node);
+            int err = node->err;
+            if (err == 0) {
+                *st = node->st;
+            }
+            s.lock.unlock();
+            if (err != 0) {
+                m_negative_hits.fetch_add(1, std::memory_order_relaxed);
+                errno = err;
+                return -1;
+            }
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        // 过期或者作废了，键指向条目自己的path，先从表里删
+        s.map.erase(it);
+        s.lru.erase(node);
+    }
+    s.lock.unlock();
+
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    uint64_t seq = m_events.load();
+    if (::stat(path, st) == 0) {
+        insert(key, st, 0, seq);
+        return 0;
+    }
+    int err = errno;
+    // 权限、路径太长之类的错误不缓存，每次照常stat
+    if (err == ENOENT || err == ENOTDIR) {
+        insert(key, nullptr, err, seq);
+    }
+    errno = err;
+    return -1;
+}
+
+void path_cache::insert(std::string_view path, const struct stat* st, int err, uint64_t seq) {
+    shard& s = shard_of(path);
+    s.lock.lock();
+    // stat之后又有了变化（监视线程先加序号再删条目），这次的结果可能已经过时
+    if (m_events.load() != seq) {
+        s.lock.unlock();
+        return;
+    }
+    auto it = s.map.find(path);
+    if (it != s.map.end()) {
+        // 别的线程刚放进来
+        auto node = it->second;
+        s.map.erase(it);
+        s.lru.erase(node);
+    }
+    s.lru.emplace_front();
+    entry& e = s.lru.front();
+    e.path = path;
+    e.err = err;
+    if (st) {
+        e.st = *st;
+    }
+    int ttl = err == 0 && m_watching.load(std::memory_order_relaxed) ? POSITIVE_TTL_MS : m_ttl_ms;
+    e.expire_ms = now_ms() + ttl;
+    e.epoch = m_epoch.load();
+    s.map.emplace(std::string_view(e.path), s.lru.begin());
+    while (s.map.size() > m_shard_entries) {
+        s.map.erase(std::string_view(s.lru.back().path));
+        s.lru.pop_back();
+    }
+    s.lock.unlock();
+}
+
+void path_cache::erase(std::string_view path) {
+    shard& s = shard_of(path);
+    s.lock.lock();
+    auto it = s.map.find(path);
+    if (it != s.map.end()) {
+        auto node = it->second;
+        s.map.erase(it);
+        s.lru.erase(node);
+    }
+    s.lock.unlock();
+}
+
+// 换一代，旧的条目查到时当作没有，慢慢被淘汰
+void path_cache::invalidate_all() {
+    m_events.fetch_add(1);
+    m_epoch.fetch_add(1);
+}
+
+void* path_cache::watcher(void* arg) {
+    ((path_cache*) arg)->run();
+    return nullptr;
+}
+
+void path_cache::run() {
+    alignas(struct inotify_event) char buf[16384];
+    while (true) {
+        ssize_t n = read(m_inotify, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // 监视不了了，之后只靠ttl
+            printf("路径缓存: 读inotify失败: %s\n", strerror(errno));
+            m_watching = false;
+            invalidate_all();
+            return;
+        }
+        for (char* p = buf; p < buf + n; ) {
+            const struct inotify_event* ev = (const struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                invalidate_all();
+                continue;
+            }
+            auto it = m_dirs.find(ev->wd);
+            if (it == m_dirs.end()) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                // 目录删掉了，父目录的事件已经让缓存作废
+                m_dirs.erase(it);
+                continue;
+            }
+            if (ev->len == 0) {
+                // 目录本身（权限、被删掉或者移走）
+                invalidate_all();
+                continue;
+            }
+            std::string path = it->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                // 子目录出现、消失或者改名，下面所有的路径都可能变了；新的目录先加上监视再作废
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_tree(path, false);
+                }
+                invalidate_all();
+                continue;
+            }
+            m_events.fetch_add(1);
+            erase(path);
+        }
+    }
+}
+
+void path_cache::watch_tree(const std::string& dir, bool top) {
+    int wd = inotify_add_watch(m_inotify, dir.c_str(), top ? WATCH_MASK : WATCH_MASK | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        m_watching = false;
+        return;
+    }
+    m_dirs[wd] = dir;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (struct dirent* ent = readdir(d)) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        std::string sub = dir + "/" + ent->d_name;
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = lstat(sub.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        // 子目录的符号链接不跟进去
+        if (is_dir) {
+            watch_tree(sub, false);
+        }
+    }
+    closedir(d);
+}
+
+void path_cache::report() {
+    size_t count = 0;
+    for (int i = 0; i < SHARDS; ++i) {
+        m_shards[i].lock.lock();
+        count += m_shards[i].map.size();
+        m_shards[i].lock.unlock();
+    }
+    unsigned long hits = m_hits.load(std::memory_order_relaxed);
+    unsigned long negative = m_negative_hits.load(std::memory_order_relaxed);
+    unsigned long misses = m_misses.load(std::memory_order_relaxed);
+    unsigned long total = hits + negative + misses;
+    printf("path cache: %zu entries, hits %lu, negative hits %lu, misses %lu (%.1f%% hit), inotify %s, epoch %lu\n",
+           count, hits, negative, misses, total ? 100.0 * (hits + negative) / total : 0.0,
+           m_watching.load() ? "on" : "off", (unsigned long) m_epoch.load());
+    fflush(stdout);
+}
+
+int path_cache::canonicalize(std::string_view url, char* out, int size) {
+    if (url.empty() || url[0] != '/' || size < 2) {
+        return -1;
+    }
+    // out总是以'/'结尾，每一段接在后面再加'/'
+    int len = 0;
+    out[len++] = '/';
+    size_t i = 1;
+    while (i <= url.size()) {
+        size_t j = url.find('/', i);
+        if (j == std::string_view::npos) {
+            j = url.size();
+        }
+        std::string_view seg = url.substr(i, j - i);
+        i = j + 1;
+        if (seg.empty() || seg == ".") {
+            continue;
+        }
+        if (seg == "..") {
+            if (len == 1) {
+                return -1;
+            }
+            --len;
+            while (out[len - 1] != '/') {
+                --len;
+            }
+            continue;
+        }
+        if (len + (int) seg.size() + 1 >= size) {
+            return -1;
+        }
+        memcpy(out + len, seg.data(), seg.size());
+        len += seg.size();
+        out[len++] = '/';
+    }
+    // 最后一段是普通的名字时去掉结尾的'/'
+    std::string_view last = url.substr(url.rfind('/') + 1);
+    if (len > 1 && !last.empty() && last != "." && last != "..") {
+        --len;
+    }
+    out[len] = '\0';
+    return len;
+}
@@ -0,0 +1,104 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+    路径解析的缓存：文档根目录下的完整路径 -> stat的结果，或者"不存在"（ENOENT、ENOTDIR）
+    do_request和找预先压缩好的.br/.zst/.gz时都先查它，命中时404/403/目录/200的判断都不用进内核，
+    扫描器反复请求不存在的路径、没有压缩版本的文本文件都不会每次stat
+    - 按路径的哈希分成SHARDS片，每片一把锁、一个哈希表和一条LRU链表，条目数超过上限时淘汰最久没用的
+    - 不存在的结论只保留ttl毫秒；存在的结论在inotify监视着时保留POSITIVE_TTL_MS，监视不了时也只保留ttl毫秒
+    - 一个后台线程读inotify：文件的变化（创建、删除、改名、修改、改权限）只删掉这个路径的条目，
+      目录本身的变化和事件队列溢出时整个缓存作废（换一代），新建的目录加上监视
+      文档根目录本身可以是符号链接，下面经过符号链接进入的目录不在监视范围内，那里的变化最多POSITIVE_TTL_MS之后才看到
+    - 没命中时先记下事件序号再stat，放进缓存前序号变了说明期间有过变化，这次的结果不缓存
+    另外负责把URL规范化成路径（canonicalize），".."不能超出文档根目录
+*/
+class path_cache {
+public:
+    static const int SHARDS = 16;
+    static const int POSITIVE_TTL_MS = 60000;
+
+    static path_cache& instance() {
+        static path_cache cache;
+        return cache;
+    }
+
+    // 条目数上限为0表示不启用；开始监视root下所有的目录，在创建工作线程之前调用
+    bool configure(const char* root, int ttl_ms, size_t max_entries);
+    bool enabled() const { return m_max_entries > 0; }
+
+    // 和::stat一样，成功返回0，失败返回-1并设置errno；不在root下的路径直接stat
+    int stat(const char* path, struct stat* st);
+    // 调用者发现缓存的结论不对了（比如stat说存在而open时已经删掉，inotify的事件还没处理到）
+    void erase(std::string_view path);
+
+    /*
+        把请求的路径规范化后写到out（最多size字节，含结尾的'\0'），返回长度：
+        合并连续的'/'，去掉"."，".."退回上一级；不以'/'开头、".."超出根目录或者放不下时返回-1
+        结尾的'/'保留（请求的是目录），"/a/.."得到"/"
+    */
+    static int canonicalize(std::string_view url, char* out, int size);
+
+    // 信号处理函数中调用：下一次查找时打印统计
+    void request_report() { m_report.store(true, std::memory_order_relaxed); }
+    void report();
+
+private:
+    struct entry {
+        std::string path;
+        int err;              // 0表示存在，否则是stat失败的errno（ENOENT或ENOTDIR）
+        struct stat st;
+        uint64_t expire_ms;
+        uint64_t epoch;       // 放进来时的代，和m_epoch不同时作废
+    };
+    struct shard {
+        locker lock;
+        std::list<entry> lru; // 表头是最近用过的
+        std::unordered_map<std::string_view, std::list<entry>::iterator> map; // 键指向条目自己的path
+    };
+
+    path_cache() : m_max_entries(0), m_shard_entries(0), m_ttl_ms(0), m_inotify(-1), m_watching(false),
+    m_epoch(0), m_events(0), m_report(false), m_hits(0), m_negative_hits(0), m_misses(0) {}
+    ~path_cache() {}
+
+    shard& shard_of(std::string_view key) {
+        return m_shards[std::hash<std::string_view>()(key) % SHARDS];
+    }
+    void insert(std::string_view path, const struct stat* st, int err, uint64_t seq);
+    void invalidate_all();
+
+    // 以下只在监视线程（configure时在主线程）中调用
+    static void* watcher(void* arg);
+    void run();
+    void watch_tree(const std::string& dir, bool top); // 监视dir和它下面所有的目录，top时dir可以是符号链接
+
+    size_t m_max_entries;
+    size_t m_shard_entries;
+    int m_ttl_ms;
+    std::string m_root;
+    shard m_shards[SHARDS];
+
+    int m_inotify;
+    std::atomic<bool> m_watching;       // 所有目录都监视上了，存在的结论可以长期保留
+    std::unordered_map<int, std::string> m_dirs; // 监视描述符 -> 目录的完整路径
+    pthread_t m_thread;
+    std::atomic<uint64_t> m_epoch;
+    std::atomic<uint64_t> m_events;     // 收到的inotify事件数
+
+    std::atomic<bool> m_report;
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_negative_hits;
+    std::atomic<unsigned long> m_misses;
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include "reactor.h"
+
+// 服务器过载时回写的完整响应，预先构造好，直接send
+extern const char* busy_503_response;
+
+// 添加文件描述符到epoll
+extern void addfd(int epollfd, int fd, bool one_shot);
+
+// 修改文件描述符
+extern void modfd(int epollfd, int fd, int ev);
+
+// 创建、绑定并监听一个socket，失败返回-1，epoll和io_uring后端共用
+int create_listenfd(const server_config& config) {
+    // 创建监听的套接字，非阻塞，accept时可以一直取到EAGAIN
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        return -1;
+    }
+
+    // 设置端口复用
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (config.reactor_num > 1) {
+        // 多个监听socket绑定同一端口，内核按四元组哈希把新连接分给其中一个
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+            close(listenfd);
+            return -1;
+        }
+    }
+
+    // 绑定
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY; // 绑定ip地址（一台机器有多个网卡，每个网卡都有自己的ip地址，这里表示监听所有网卡）
+    address.sin_port = htons(config.port); // 绑定端口号（当内核收到 TCP 报文，通过 TCP 头里面的端口号，来找到应用程序）
+    if (bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    // 延迟accept：三次握手完成后，直到客户端发来数据（或超时）才让listen可读，
+    // 只建连不发数据的连接不会唤醒我们
+    if (config.defer_accept > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept));
+    }
+
+    // 监听，全连接队列长度可配置（内核还会截断到net.core.somaxconn）
+    if (listen(listenfd, config.backlog) < 0) {
+        close(listenfd);
+        return -1;
+    }
+
+    return listenfd;
+}
+
+reactor::reactor(int id, const server_config& config, conn_table& users, threadpool<http_conn>* pool) :
+m_id(id), m_reactor_num(config.reactor_num), m_thread_num(config.thread_num), m_listenfd(-1), m_epollfd(-1), m_users(users), m_pool(pool) {
+    m_listenfd = create_listenfd(config);
+    if (m_listenfd < 0) {
+        throw std::exception();
+    }
+
+    // 创建epoll对象 IO 多路复用
+    m_epollfd = epoll_create(1); // 任意正数，不影响实际创建多大
+    if (m_epollfd < 0) {
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    // 将监听的文件描述符添加
+    addfd(m_epollfd, m_listenfd, false);
+}
+
+reactor::~reactor() {
+    close(m_epollfd);
+    close(m_listenfd);
+}
+
+// 超时不直接close：连接可能正在工作线程中处理。shutdown后，空闲的连接马上收到EPOLLHUP
+// （io_uring的recv返回0），正在处理的连接交回事件循环时也会看到，都走正常的关闭流程
+static std::atomic<unsigned long> g_expired(0);
+static std::atomic<bool> g_timeout_report(false);
+
+void expire_conn(http_conn* conn) {
+    g_expired.fetch_add(1, std::memory_order_relaxed);
+    shutdown(conn->sockfd(), SHUT_RDWR);
+}
+
+void request_timeout_report() {
+    g_timeout_report.store(true, std::memory_order_relaxed);
+}
+
+void timeout_report() {
+    if (g_timeout_report.load(std::memory_order_relaxed) && g_timeout_report.exchange(false)) {
+        printf("timeouts: %lu connections expired\n", g_expired.load(std::memory_order_relaxed));
+        fflush(stdout);
+    }
+}
+
+void reactor::close_conn(int fd) {
+    m_timers.remove(m_users[fd].timer());
+    m_users[fd].close_conn();
+}
+
+// 时间轮上的节点到期，只有deadline真的过了才算超时，否则按新的deadline重新挂上
+// 热路径上只改deadline不动时间轮，一个连接每个超时周期最多多一次重新挂入
+void reactor::on_timer(timer_node* node) {
+    http_conn* conn = (http_conn*) node->data;
+    uint64_t next;
+    if (conn->timed_out(now_ms(), next)) {
+        expire_conn(conn);
+    } else {
+        m_timers.add(node, next);
+    }
+}
+
+// 重置EPOLLONESHOT，下一次可读时再通知
+void reactor::want_read(http_conn* conn) {
+    modfd(m_epollfd, conn->sockfd(), EPOLLIN);
+}
+
+// 等待可写时由事件循环线程调用write()
+void reactor::want_write(http_conn* conn) {
+    modfd(m_epollfd, conn->sockfd(), EPOLLOUT);
+}
+
+// 关闭读写两端后重新注册，事件循环线程会收到EPOLLHUP并在自己的线程里close
+void reactor::want_close(http_conn* conn) {
+    shutdown(conn->sockfd(), SHUT_RDWR);
+    modfd(m_epollfd, conn->sockfd(), EPOLLIN);
+}
+
+// listen是水平触发的，但一次唤醒只accept一个的话，连接风暴时大部分连接都要等下一轮epoll_wait，
+// 所以这里一直accept到EAGAIN，把全连接队列取空
+void reactor::accept_all() {
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_address_len = sizeof(client_address);
+        // accept4直接得到非阻塞的fd，省去两次fcntl
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &client_address_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN说明队列已空；EMFILE等错误也只能等下一轮
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("accept failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+
+        http_conn* conn = nullptr;
+        if (connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD || !(conn = m_users.open(connfd))) {
+            reject_busy(connfd);
+            continue;
+        }
+
+        // 将新客户的数据初始化，注册到本reactor的epoll上
+        conn->init(connfd, client_address, this);
+        addfd(m_epollfd, connfd, true);
+        if (http_conn::timeouts_enabled()) {
+            uint64_t next;
+            conn->timed_out(now_ms(), next);
+            m_timers.add(conn->timer(), next);
+        }
+    }
+}
+
+// 给客户端回写信息：服务器正忙
+// 新连接的发送缓冲区是空的，一次非阻塞send就能发完；关闭前先把已到达的请求读掉，
+// 否则接收缓冲区里有未读数据时close会发RST，客户端可能收不到503
+// TLS时客户端在等握手，明文的503它也看不懂，直接关闭
+void reject_busy(int connfd) {
+    if (tls_context::instance().enabled()) {
+        close(connfd);
+        return;
+    }
+    char discard[1024];
+    while (recv(connfd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+    send(connfd, busy_503_response, strlen(busy_503_response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(connfd, SHUT_WR);
+    close(connfd);
+}
+
+void reactor::loop() {
+    printf("reactor %d running\n", m_id);
+
+    while (1) {
+        // 有定时器时最多等到下一个tick
+        int request_num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUM, m_timers.next_timeout(now_ms()));
+        if (request_num < 0) {
+            if (errno == EINTR) {
+                // 被信号中断
+                timeout_report();
+                continue;
+            }
+            printf("epoll failed!\n");
+            break;
+        }
+
+        // 遍历事件数组
+        for (int i = 0; i < request_num; i++) {
+            int sockfd = m_events[i].data.fd;
+            if (sockfd == m_listenfd) {
+                // listen触发说明有新的客户端连接
+                accept_all();
+
+            } else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                // 对方异常断开等错误事件
+                close_conn(sockfd);
+
+            } else if (m_events[i].events & EPOLLIN) {
+                if (m_users[sockfd].read()) {
+                    if (m_users[sockfd].handshaking()) {
+                        // TLS握手还没完成，read()中已经注册了握手要等的事件
+                        continue;
+                    }
+                    if (m_users[sockfd].reading_body()) {
+                        // 请求体还没收完，read()中已经跳过了收到的部分
+                        want_read(&m_users[sockfd]);
+                        continue;
+                    }
+                    // 一次把数据都读完，交给和本reactor亲和的工作线程；队列满时直接回503
+                    if (!m_pool->append(&m_users[sockfd], worker_hint(m_id, m_reactor_num, m_thread_num, sockfd))) {
+                        m_users[sockfd].reject();
+                    }
+                } else {
+                    close_conn(sockfd);
+                }
+            } else if (m_events[i].events & EPOLLOUT) {
+                if (!m_users[sockfd].write()) {
+                    close_conn(sockfd);
+                } else if (m_users[sockfd].has_pending_input()) {
+                    // 流水线：这一批发完了，后面的请求已经在读缓冲里，不用等EPOLLIN
+                    if (!m_pool->append(&m_users[sockfd], worker_hint(m_id, m_reactor_num, m_thread_num, sockfd))) {
+                        m_users[sockfd].reject();
+                    }
+                }
+            }
+        }
+
+        m_timers.advance(now_ms(), [this](timer_node* node) { on_timer(node); });
+        timeout_report();
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "threadpool.h"
+#include "http_conn.h"
+#include "conn_table.h"
+#include "config.h"
+#include "io_backend.h"
+#include "timer_wheel.h"
+
+#define MAX_FD 65535 // 最大的文件描述符个数,实际可能支持不了这么高的并发
+#define MAX_EVENT_NUM 10000 // 同时监听的最大数量
+
+// 以下epoll和io_uring后端共用
+int create_listenfd(const server_config& config); // 创建、绑定并监听，失败返回-1
+void reject_busy(int connfd); // 连接数已满时回写503后关闭
+void expire_conn(http_conn* conn); // 超时：关闭读写两端，由正常的关闭流程收尾
+// 信号处理函数中调用：事件循环的下一轮打印一共有多少个连接超时
+// 超时的连接不逐个打印，慢速攻击时不会每个连接一行输出
+void request_timeout_report();
+void timeout_report(); // 事件循环每一轮调用，有请求时才打印
+
+// 工作窃取模式下连接分给哪个工作线程：第i个线程属于第 i % reactor数 个reactor（main按这个规则绑核），
+// 同一个reactor的连接按fd分散到属于它的那几个线程上；线程数不是reactor数的倍数时各reactor的线程数差一个，
+// 线程比reactor少时没有自己线程的reactor和第 reactor_id % 线程数 个reactor共用一个线程
+// 线程池按 hint % 线程数 选线程，这里给出的hint都小于线程数
+inline int worker_hint(int reactor_id, int reactor_num, int thread_num, int fd) {
+    if (reactor_id >= thread_num) {
+        return reactor_id % thread_num;
+    }
+    int owned = (thread_num - 1 - reactor_id) / reactor_num + 1; // 第reactor_id, reactor_id + reactor_num, ...个线程
+    return reactor_id + reactor_num * (fd % owned);
+}
+
+/*
+    reactor：epoll后端，一个监听socket + 一个epoll + 一个事件循环
+    单reactor模式下只有一个实例，直接在主线程中运行（即原来main中的循环）
+    多reactor模式下每个核一个实例，各自用SO_REUSEPORT绑定同一端口，
+    由内核把新连接分散到各个监听socket上，每个reactor只处理自己accept的连接
+    连接表按fd下标共享，fd在进程内唯一，所以各reactor的连接天然不会重叠
+*/
+class reactor : public io_backend {
+public:
+    reactor(int id, const server_config& config, conn_table& users, threadpool<http_conn>* pool);
+    ~reactor();
+
+    void loop();
+
+    void want_read(http_conn* conn);
+    void want_write(http_conn* conn);
+    void want_close(http_conn* conn);
+    bool can_sendfile() const { return true; }
+
+private:
+    void close_conn(int fd);
+    void on_timer(timer_node* node);
+    void accept_all(); // 循环accept直到全连接队列为空
+
+private:
+    int m_id;
+    int m_reactor_num;
+    int m_thread_num;    // 工作线程数，按worker_hint把连接交给和本reactor同核的线程
+    int m_listenfd;
+    int m_epollfd;
+
+    conn_table& m_users; // 所有客户端连接，按fd下标
+    threadpool<http_conn>* m_pool;
+
+    epoll_event m_events[MAX_EVENT_NUM]; // ready list返回到用户态下的数组
+    timer_wheel m_timers; // 本reactor所有连接的超时
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef RESPONSE_HEADER_H
+#define RESPONSE_HEADER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "mime.h"
+
+// 十进制格式化，两位一组查表，除法次数减半；out至少要有20字节，返回长度
+inline int format_uint(char* out, unsigned long long v) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char buf[20];
+    char* p = buf + sizeof(buf);
+    while (v >= 100) {
+        int i = (v % 100) * 2;
+        v /= 100;
+        *--p = pairs[i + 1];
+        *--p = pairs[i];
+    }
+    if (v < 10) {
+        *--p = '0' + v;
+    } else {
+        *--p = pairs[v * 2 + 1];
+        *--p = pairs[v * 2];
+    }
+    int len = buf + sizeof(buf) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
+/*
+    预先拼好的响应头开头，每个(状态, MIME类型, keep-alive)一份，启动时生成，之后只读
+    生成响应时整块拷贝，再接上长度、ETag这些每个响应不同的字段，不用再逐行vsnprintf
+    - 200：状态行、Accept-Ranges、Content-Type、Connection，以"Content-Length: "结尾
+    - 206和错误页面：状态行、Content-Type、Connection，以"Content-Length: "结尾
+    - 304：状态行、Connection，没有响应体，不带Content-Length和Content-Type
+    - OPTIONS：完整的响应头，只差结尾的空行
+*/
+class header_templates {
+public:
+    enum STATUS { S_200 = 0, S_206, S_304, S_400, S_403, S_404, S_416, S_431, S_500, S_OPTIONS, STATUS_COUNT };
+
+    static const header_templates& instance() {
+        static header_templates templates;
+        return templates;
+    }
+
+    std::string_view get(STATUS status, int mime, bool keep_alive) const {
+        const std::string& s = m_blocks[status][(m_per_mime[status] ? mime : 0) * 2 + keep_alive];
+        return std::string_view(s.data(), s.size());
+    }
+
+private:
+    header_templates() {
+        static const struct {
+            int code;
+            const char* title;
+            const char* extra;     // 状态行后面固定的头部
+            bool per_mime;         // 带Content-Type
+            bool length;           // 以"Content-Length: "结尾
+        } statuses[STATUS_COUNT] = {
+            { 200, "OK", "Accept-Ranges: bytes\r\n", true, true },
+            { 206, "Partial Content", "", true, true },
+            { 304, "Not Modified", "", false, false },
+            { 400, "Bad Request", "", true, true },
+            { 403, "Forbidden", "", true, true },
+            { 404, "Not Found", "", true, true },
+            { 416, "Range Not Satisfiable", "", true, true },
+            { 431, "Request Header Fields Too Large", "", true, true },
+            { 500, "Internal Error", "", true, true },
+            { 200, "OK", "Allow: GET, HEAD, OPTIONS\r\nContent-Length: 0\r\n", false, false },
+        };
+        for (int s = 0; s < STATUS_COUNT; ++s) {
+            m_per_mime[s] = statuses[s].per_mime;
+            int mimes = statuses[s].per_mime ? mime_count() : 1;
+            m_blocks[s].resize(mimes * 2);
+            for (int m = 0; m < mimes; ++m) {
+                for (int keep_alive = 0; keep_alive < 2; ++keep_alive) {
+                    char buf[256];
+                    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n%s", statuses[s].code, statuses[s].title,
+                                       statuses[s].extra);
+                    if (statuses[s].per_mime) {
+                        std::string_view type = mime_at(m).type;
+                        len += snprintf(buf + len, sizeof(buf) - len, "Content-Type: %.*s\r\n", (int) type.size(),
+                                        type.data());
+                    }
+                    len += snprintf(buf + len, sizeof(buf) - len, "Connection: %s\r\n%s",
+                                    keep_alive ? "keep-alive" : "close", statuses[s].length ? "Content-Length: " : "");
+                    m_blocks[s][m * 2 + keep_alive].assign(buf, len);
+                }
+            }
+        }
+    }
+
+    std::vector<std::string> m_blocks[STATUS_COUNT]; // 下标是MIME类型编号*2+keep_alive
+    bool m_per_mime[STATUS_COUNT];
+};
+
+#endif
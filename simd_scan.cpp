@@ -0,0 +1,159 @@
+#include "simd_scan.h"
+#include <immintrin.h>
+
+// 查找a或b，a == b时就是查找单个字符
+typedef const char* (*find2_func)(const char* p, const char* end, char a, char b);
+
+static const char* find2_scalar(const char* p, const char* end, char a, char b) {
+    for (; p < end; ++p) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+    剩下不足一个向量时，如果整段长度够，就从end往前取一个完整的向量再比较一次：
+    和已经比较过的部分重叠，但那部分已知没有匹配，找到的第一个匹配一定在剩下的字节里，
+    这样既不用逐字节处理尾巴，也不会读出[start, end)
+*/
+
+__attribute__((target("sse4.2")))
+static const char* find2_sse42(const char* p, const char* end, char a, char b) {
+    const char* start = p;
+    // pcmpestri：在16个字节中找"等于集合中任意一个"的第一个位置，集合就是{a, b}
+    const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const int mode = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT;
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        int i = _mm_cmpestri(set, 2, block, 16, mode);
+        if (i < 16) {
+            return p + i;
+        }
+        p += 16;
+    }
+    if (p == end) {
+        return end;
+    }
+    if (end - start >= 16) {
+        const char* q = end - 16;
+        int i = _mm_cmpestri(set, 2, _mm_loadu_si128((const __m128i*) q), 16, mode);
+        return i < 16 ? q + i : end;
+    }
+    return find2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2,bmi")))
+static const char* find2_avx2(const char* p, const char* end, char a, char b) {
+    const char* start = p;
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(eq);
+        if (mask) {
+            return p + _tzcnt_u32(mask);
+        }
+        p += 32;
+    }
+    if (p == end) {
+        return end;
+    }
+    if (end - start >= 32) {
+        const char* q = end - 32;
+        __m256i block = _mm256_loadu_si256((const __m256i*) q);
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(eq);
+        return mask ? q + _tzcnt_u32(mask) : end;
+    }
+
+    // 不到32字节的短段（请求方法、url、头部名字大多如此）用16字节比较
+    const __m128i sa = _mm_set1_epi8(a);
+    const __m128i sb = _mm_set1_epi8(b);
+    if (end - p >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, sa), _mm_cmpeq_epi8(block, sb)));
+        if (mask) {
+            return p + _tzcnt_u32(mask);
+        }
+        p += 16;
+        if (p == end) {
+            return end;
+        }
+    }
+    if (end - start >= 16) {
+        const char* q = end - 16;
+        __m128i block = _mm_loadu_si128((const __m128i*) q);
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, sa), _mm_cmpeq_epi8(block, sb)));
+        return mask ? q + _tzcnt_u32(mask) : end;
+    }
+    return find2_scalar(p, end, a, b);
+}
+
+#endif
+
+static find2_func g_find2 = find2_scalar;
+static SCAN_IMPL g_impl = SCAN_SCALAR;
+
+bool scan_select(SCAN_IMPL impl) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi");
+    bool has_sse42 = __builtin_cpu_supports("sse4.2");
+#else
+    bool has_avx2 = false;
+    bool has_sse42 = false;
+#endif
+    if (impl == SCAN_AUTO) {
+        impl = has_avx2 ? SCAN_AVX2 : (has_sse42 ? SCAN_SSE42 : SCAN_SCALAR);
+    }
+    switch (impl) {
+        case SCAN_SCALAR:
+            g_find2 = find2_scalar;
+            break;
+#if defined(__x86_64__) || defined(__i386__)
+        case SCAN_SSE42:
+            if (!has_sse42) return false;
+            g_find2 = find2_sse42;
+            break;
+        case SCAN_AVX2:
+            if (!has_avx2) return false;
+            g_find2 = find2_avx2;
+            break;
+#endif
+        default:
+            return false;
+    }
+    g_impl = impl;
+    return true;
+}
+
+const char* scan_impl_name() {
+    switch (g_impl) {
+        case SCAN_SSE42: return "sse4.2";
+        case SCAN_AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+// 程序启动时按CPU选择
+__attribute__((constructor))
+static void scan_init() {
+    scan_select(SCAN_AUTO);
+}
+
+const char* scan_line_end(const char* p, const char* end) {
+    return g_find2(p, end, '\r', '\n');
+}
+
+const char* scan_space(const char* p, const char* end) {
+    return g_find2(p, end, ' ', '\t');
+}
+
+const char* scan_char(const char* p, const char* end, char c) {
+    return g_find2(p, end, c, c);
+}
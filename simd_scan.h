@@ -0,0 +1,27 @@
+#ifndef SIMD_SCAN_H
+#define SIMD_SCAN_H
+
+/*
+    解析请求时用的字符查找，按CPU支持的指令集一次比较16（SSE4.2）或32（AVX2）个字节，
+    不支持时退回逐字节查找；启动时根据cpuid自动选择，不需要编译时加-mavx2
+    都在[p, end)中查找，找不到返回end，不会读超出end的内存
+*/
+
+// 第一个'\r'或'\n'
+const char* scan_line_end(const char* p, const char* end);
+
+// 第一个空格或'\t'
+const char* scan_space(const char* p, const char* end);
+
+// 第一个字符c
+const char* scan_char(const char* p, const char* end, char c);
+
+enum SCAN_IMPL { SCAN_AUTO = 0, SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2 };
+
+// 指定使用的实现（给基准测试用），CPU不支持时返回false，SCAN_AUTO选最快的
+bool scan_select(SCAN_IMPL impl);
+
+// 当前使用的实现的名字
+const char* scan_impl_name();
+
+#endif
@@ -0,0 +1,202 @@
+/*
+    响应头生成的微基准：原来每一行一次add_response（va_start + vsnprintf），
+    对比现在整块拷贝header_templates中预先拼好的开头，长度用format_uint、ETag等用memcpy接上
+    测三种响应：小文件的200（带ETag、Last-Modified、Vary）、单个范围的206、304
+    两边的写法和http_conn中process_write的对应分支一致，写进同样的4KB写缓冲，先确认两边生成的头部相同
+
+    编译运行（在test_presure目录下）：
+        g++ -O2 -std=c++17 -I.. header_bench.cpp ../mime.cpp -o header_bench
+        ./header_bench [次数]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <x86intrin.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "response_header.h"
+
+static const int WRITE_BUFFER_SIZE = 4096;
+
+// 一个响应用到的字段
+struct fields {
+    int mime;
+    bool linger;
+    long long size;
+    long long first, last; // 206的范围
+    char etag[48];
+    int etag_len;
+    char last_modified[32];
+    int last_modified_len;
+};
+
+struct writer {
+    char buf[WRITE_BUFFER_SIZE];
+    int idx;
+
+    // 原来的做法
+    bool add_response(const char* format, ...) {
+        if (idx >= WRITE_BUFFER_SIZE) {
+            return false;
+        }
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = vsnprintf(buf + idx, WRITE_BUFFER_SIZE - 1 - idx, format, arg_list);
+        va_end(arg_list);
+        if (len >= WRITE_BUFFER_SIZE - 1 - idx) {
+            return false;
+        }
+        idx += len;
+        return true;
+    }
+
+    // 现在的做法
+    bool append(std::string_view s) {
+        if ((int) s.size() >= WRITE_BUFFER_SIZE - 1 - idx) {
+            return false;
+        }
+        memcpy(buf + idx, s.data(), s.size());
+        idx += s.size();
+        return true;
+    }
+    bool append_uint(unsigned long long v) {
+        if (idx + 20 >= WRITE_BUFFER_SIZE - 1) {
+            return false;
+        }
+        idx += format_uint(buf + idx, v);
+        return true;
+    }
+};
+
+enum KIND { K_200, K_206, K_304 };
+
+static bool build_old(writer& w, KIND kind, const fields& f) {
+    const char* connection = f.linger ? "keep-alive" : "close";
+    std::string_view type = mime_at(f.mime).type;
+    switch (kind) {
+        case K_200:
+            return w.add_response("%s %d %s\r\n", "HTTP/1.1", 200, "OK")
+                && w.add_response("Accept-Ranges: bytes\r\n")
+                && w.add_response("ETag: %s\r\nLast-Modified: %s\r\n", f.etag, f.last_modified)
+                && w.add_response("Vary: Accept-Encoding\r\n")
+                && w.add_response("Content-Length: %lld\r\n", f.size)
+                && w.add_response("Content-Type:%.*s\r\n", (int) type.size(), type.data())
+                && w.add_response("Connection: %s\r\n", connection)
+                && w.add_response("%s", "\r\n");
+        case K_206:
+            return w.add_response("%s %d %s\r\n", "HTTP/1.1", 206, "Partial Content")
+                && w.add_response("ETag: %s\r\nLast-Modified: %s\r\n", f.etag, f.last_modified)
+                && w.add_response("Vary: Accept-Encoding\r\n")
+                && w.add_response("Content-Range: bytes %lld-%lld/%lld\r\n", f.first, f.last, f.size)
+                && w.add_response("Content-Length: %lld\r\n", f.last - f.first + 1)
+                && w.add_response("Content-Type:%.*s\r\n", (int) type.size(), type.data())
+                && w.add_response("Connection: %s\r\n", connection)
+                && w.add_response("%s", "\r\n");
+        case K_304:
+            return w.add_response("%s %d %s\r\n", "HTTP/1.1", 304, "Not Modified")
+                && w.add_response("ETag: %s\r\nLast-Modified: %s\r\n", f.etag, f.last_modified)
+                && w.add_response("Vary: Accept-Encoding\r\n")
+                && w.add_response("Connection: %s\r\n", connection)
+                && w.add_response("%s", "\r\n");
+    }
+    return false;
+}
+
+static bool add_validators(writer& w, const fields& f) {
+    return w.append("ETag: ") && w.append(std::string_view(f.etag, f.etag_len))
+        && w.append("\r\nLast-Modified: ") && w.append(std::string_view(f.last_modified, f.last_modified_len))
+        && w.append("\r\n") && w.append("Vary: Accept-Encoding\r\n");
+}
+
+static bool build_new(writer& w, KIND kind, const fields& f) {
+    const header_templates& t = header_templates::instance();
+    switch (kind) {
+        case K_200:
+            return w.append(t.get(header_templates::S_200, f.mime, f.linger)) && w.append_uint(f.size)
+                && w.append("\r\n") && add_validators(w, f) && w.append("\r\n");
+        case K_206:
+            return w.append(t.get(header_templates::S_206, f.mime, f.linger)) && w.append_uint(f.last - f.first + 1)
+                && w.append("\r\n") && add_validators(w, f)
+                && w.append("Content-Range: bytes ") && w.append_uint(f.first) && w.append("-")
+                && w.append_uint(f.last) && w.append("/") && w.append_uint(f.size) && w.append("\r\n")
+                && w.append("\r\n");
+        case K_304:
+            return w.append(t.get(header_templates::S_304, 0, f.linger)) && add_validators(w, f) && w.append("\r\n");
+    }
+    return false;
+}
+
+typedef bool (*build_func)(writer&, KIND, const fields&);
+
+static writer w;
+
+static double bench(build_func build, KIND kind, const fields& f, long n) {
+    unsigned long long best = ~0ULL;
+    // 取5轮中最好的一轮，减少干扰；每次从写缓冲开头写，相当于每批第一个响应
+    for (int round = 0; round < 5; ++round) {
+        unsigned long long start = __rdtsc();
+        for (long i = 0; i < n; ++i) {
+            w.idx = 0;
+            if (!build(w, kind, f)) {
+                printf("写缓冲放不下\n");
+                exit(1);
+            }
+            __asm__ __volatile__("" : : "r"(w.buf) : "memory");
+        }
+        unsigned long long cycles = __rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return (double) best / n;
+}
+
+// 两种做法除了头部的顺序和Content-Type后的空格，内容应该一样：逐行排序后比较
+static bool same_lines(const char* a, int alen, const char* b, int blen) {
+    auto lines = [](const char* s, int len) {
+        std::vector<std::string> v;
+        std::string_view text(s, len);
+        while (!text.empty()) {
+            size_t eol = text.find("\r\n");
+            std::string line(text.substr(0, eol));
+            if (line.compare(0, 13, "Content-Type:") == 0 && line[13] != ' ') line.insert(13, " ");
+            v.push_back(line);
+            text.remove_prefix(eol + 2);
+        }
+        std::sort(v.begin() + 1, v.end());
+        return v;
+    };
+    return lines(a, alen) == lines(b, blen);
+}
+
+int main(int argc, char* argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+    fields f;
+    f.mime = mime_lookup("/assets/js/vendor.3f9a1c2e.js");
+    f.linger = true;
+    f.size = 48213;
+    f.first = 1000;
+    f.last = 8191;
+    f.etag_len = snprintf(f.etag, sizeof(f.etag), "\"%lx-%lx-%lx\"", 1181730UL, (unsigned long) f.size,
+                          1678959027123456789UL);
+    f.last_modified_len = snprintf(f.last_modified, sizeof(f.last_modified), "Thu, 16 Mar 2023 09:30:27 GMT");
+    header_templates::instance();
+
+    const char* names[] = { "200", "206", "304" };
+    for (int k = K_200; k <= K_304; ++k) {
+        writer a, b;
+        a.idx = b.idx = 0;
+        build_old(a, (KIND) k, f);
+        build_new(b, (KIND) k, f);
+        if (!same_lines(a.buf, a.idx, b.buf, b.idx)) {
+            printf("%s的响应头不一致:\n%.*s\n%.*s\n", names[k], a.idx, a.buf, b.idx, b.buf);
+            return 1;
+        }
+        double old_cycles = bench(build_old, (KIND) k, f, n);
+        double new_cycles = bench(build_new, (KIND) k, f, n);
+        printf("%s 响应头 %3d 字节: 原来 %6.0f cycles  模板 %5.0f cycles  (%.1fx)\n",
+               names[k], b.idx, old_cycles, new_cycles, old_cycles / new_cycles);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+    线程池工作队列的微基准：原来的 std::list + 互斥锁 + 每个任务一次sem_post
+    对比现在threadpool中的无锁环形队列 + 自旋后再睡眠，以及每线程本地队列的工作窃取模式
+
+    编译运行（在test_presure目录下）：
+        g++ -O2 -std=c++17 -I.. queue_bench.cpp -o queue_bench -pthread
+        ./queue_bench [生产者数] [工作线程数] [每个生产者的任务数]
+    生产者相当于reactor线程，任务只做一次原子加法，测的是排队本身的开销
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <list>
+#include <atomic>
+#include "threadpool.h"
+#include "locker.h"
+
+static std::atomic<long> g_done(0);
+
+struct task {
+    void process() { g_done.fetch_add(1, std::memory_order_relaxed); }
+    void reject() { process(); }
+};
+
+// 原来的实现：std::list + locker + sem，每个任务一次post
+template<class T>
+class list_pool {
+public:
+    list_pool(int thread_num, int max_requests) : m_max_requests(max_requests), m_stop(false) {
+        for (int i = 0; i < thread_num; ++i) {
+            pthread_t tid;
+            pthread_create(&tid, nullptr, worker, this);
+            pthread_detach(tid);
+        }
+    }
+
+    bool append(T* request) {
+        m_queuelocker.lock();
+        if ((int) m_workqueue.size() > m_max_requests) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+private:
+    static void* worker(void* arg) {
+        ((list_pool*) arg)->run();
+        return nullptr;
+    }
+
+    void run() {
+        while (!m_stop) {
+            m_queuestat.wait();
+            m_queuelocker.lock();
+            if (m_workqueue.empty()) {
+                m_queuelocker.unlock();
+                continue;
+            }
+            T* request = m_workqueue.front();
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            request->process();
+        }
+    }
+
+    int m_max_requests;
+    std::list<T*> m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+    bool m_stop;
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<class POOL>
+struct producer_arg {
+    POOL* pool;
+    long count;
+    task* t;
+};
+
+template<class POOL>
+static void* produce(void* p) {
+    producer_arg<POOL>* arg = (producer_arg<POOL>*) p;
+    for (long i = 0; i < arg->count; ++i) {
+        // 队列满时和服务器一样算作拒绝，这里重试以保证总任务数一致
+        while (!arg->pool->append(arg->t)) {
+            sched_yield();
+        }
+    }
+    return nullptr;
+}
+
+template<class POOL>
+static double run_bench(POOL* pool, int producers, long per_producer) {
+    task t;
+    g_done.store(0);
+    long total = producers * per_producer;
+    pthread_t* tids = new pthread_t[producers];
+    producer_arg<POOL> arg = { pool, per_producer, &t };
+
+    double start = now_sec();
+    for (int i = 0; i < producers; ++i) {
+        pthread_create(&tids[i], nullptr, produce<POOL>, &arg);
+    }
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(tids[i], nullptr);
+    }
+    while (g_done.load() < total) {
+        sched_yield();
+    }
+    double elapsed = now_sec() - start;
+    delete [] tids;
+    return elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int producers = argc > 1 ? atoi(argv[1]) : 2;
+    int workers = argc > 2 ? atoi(argv[2]) : 8;
+    long per_producer = argc > 3 ? atol(argv[3]) : 500000;
+    long total = producers * per_producer;
+
+    printf("生产者 %d，工作线程 %d，任务总数 %ld\n", producers, workers, total);
+
+    list_pool<task>* old_pool = new list_pool<task>(workers, 10000);
+    double t1 = run_bench(old_pool, producers, per_producer);
+    printf("list + mutex + sem : %.3f s, %.0f ns/任务, %.2f M任务/s\n", t1, t1 * 1e9 / total, total / t1 / 1e6);
+
+    threadpool<task>* new_pool = new threadpool<task>(workers, 10000);
+    double t2 = run_bench(new_pool, producers, per_producer);
+    printf("mpmc ring + spin   : %.3f s, %.0f ns/任务, %.2f M任务/s\n", t2, t2 * 1e9 / total, total / t2 / 1e6);
+
+    // 工作窃取模式，没有hint时轮流放到各线程的本地队列
+    threadpool<task>* stealing_pool = new threadpool<task>(workers, 10000, true);
+    double t3 = run_bench(stealing_pool, producers, per_producer);
+    printf("work stealing      : %.3f s, %.0f ns/任务, %.2f M任务/s\n", t3, t3 * 1e9 / total, total / t3 / 1e6);
+
+    // 不析构线程池，直接退出进程
+    return 0;
+}
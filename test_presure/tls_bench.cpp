@@ -0,0 +1,179 @@
+/*
+    TLS的基准：对着启用了-S的服务器
+    1. 完整握手：每个连接都是新会话，做一次密钥交换和证书签名
+    2. 恢复的握手：带着上一个连接的会话（TLS 1.3是票据，TLS 1.2默认也是票据），服务端共用的SSL_CTX直接恢复
+    3. keep-alive吞吐：一个连接上连续GET，看加密发送（kTLS或者SSL_write）的开销
+    每个连接握手后发一个GET并读完响应，确认连接真的可用；握手速度用每秒连接数表示
+
+    自签名证书：
+        openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -days 365 -subj /CN=localhost
+        ./run 10000 -S cert.pem,key.pem
+
+    编译运行（在test_presure目录下）：
+        g++ -O2 -std=c++17 tls_bench.cpp -o tls_bench -lssl -lcrypto
+        ./tls_bench [端口] [路径] [连接数] [请求数] [1.2|1.3]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+static int port = 10000;
+static const char* path = "/index.html";
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+// 发一个GET，按Content-Length读完响应，返回响应体的长度
+static long get(SSL* ssl) {
+    char req[256];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", path);
+    if (SSL_write(ssl, req, len) != len) {
+        printf("SSL_write失败\n");
+        exit(1);
+    }
+    static char buf[64 * 1024];
+    int have = 0;
+    char* end = nullptr;
+    while (!end) {
+        int n = SSL_read(ssl, buf + have, sizeof(buf) - 1 - have);
+        if (n <= 0) {
+            printf("响应不完整\n");
+            exit(1);
+        }
+        have += n;
+        buf[have] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0) {
+        printf("%.*s\n", (int) (end - buf), buf);
+        exit(1);
+    }
+    char* cl = strcasestr(buf, "Content-Length:");
+    long body = cl ? atol(cl + 15) : 0;
+    long left = body - (have - (end + 4 - buf));
+    while (left > 0) {
+        int n = SSL_read(ssl, buf, left < (long) sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) {
+            printf("响应体不完整\n");
+            exit(1);
+        }
+        left -= n;
+    }
+    return body;
+}
+
+// 建一个连接并GET一次；session不为空时请求恢复它，返回这个连接的会话
+static SSL_SESSION* one_connection(SSL_CTX* ctx, SSL_SESSION* session, bool& reused) {
+    int fd = connect_server();
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (session) {
+        SSL_set_session(ssl, session);
+    }
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stdout);
+        exit(1);
+    }
+    get(ssl); // TLS 1.3的票据在握手之后才发来，读响应时收到
+    reused = SSL_session_reused(ssl);
+    SSL_SESSION* next = SSL_get1_session(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return next;
+}
+
+static void handshakes(SSL_CTX* ctx, int n, bool resume) {
+    SSL_SESSION* session = nullptr;
+    bool reused;
+    if (resume) {
+        session = one_connection(ctx, nullptr, reused);
+    }
+    int reused_count = 0;
+    double start = now();
+    for (int i = 0; i < n; ++i) {
+        SSL_SESSION* next = one_connection(ctx, resume ? session : nullptr, reused);
+        reused_count += reused;
+        if (resume) {
+            SSL_SESSION_free(session);
+            session = next;
+        } else {
+            SSL_SESSION_free(next);
+        }
+    }
+    double t = now() - start;
+    printf("%s握手: %d 个连接 %.2f 秒, %.0f 连接/秒, 平均 %.0f us, 恢复了 %d 个\n",
+           resume ? "恢复的" : "完整", n, t, n / t, t * 1e6 / n, reused_count);
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+}
+
+static void keep_alive(SSL_CTX* ctx, int n) {
+    int fd = connect_server();
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stdout);
+        exit(1);
+    }
+    long bytes = 0;
+    double start = now();
+    for (int i = 0; i < n; ++i) {
+        bytes += get(ssl);
+    }
+    double t = now() - start;
+    printf("keep-alive: %d 个请求 %.2f 秒, %.0f 请求/秒, 响应体 %.1f MB/s（%s）\n",
+           n, t, n / t, bytes / t / 1e6, SSL_get_cipher(ssl));
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) port = atoi(argv[1]);
+    if (argc > 2) path = argv[2];
+    int conns = argc > 3 ? atoi(argv[3]) : 1000;
+    int requests = argc > 4 ? atoi(argv[4]) : 20000;
+    bool tls12 = argc > 5 && strcmp(argv[5], "1.2") == 0;
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, tls12 ? TLS1_2_VERSION : TLS1_3_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr); // 自签名证书
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+    printf("127.0.0.1:%d%s, TLS %s\n", port, path, tls12 ? "1.2" : "1.3");
+    handshakes(ctx, conns, false);
+    handshakes(ctx, conns, true);
+    keep_alive(ctx, requests);
+    SSL_CTX_free(ctx);
+    return 0;
+}
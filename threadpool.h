@@ -2,116 +2,530 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
+#include <atomic>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "codel.h"
 #include <exception>
 #include <cstdio>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
 
+// 取任务前自旋的次数，任务密集时工作线程不用睡下去再被信号量唤醒
+#define POOL_SPIN_COUNT 200
 
-// 线程池+工作队列 T是任务类
+// 动态伸缩：管理线程每隔多少毫秒采样一次队列长度和处理时间
+#define POOL_MANAGE_MS 100
+// 连续多少次采样都用不了这么多线程才退掉一个，避免负载抖动时反复创建销毁
+#define POOL_SHRINK_TICKS 50
+// 空闲线程睡在信号量上时，隔多久醒来看一次是否该退出
+#define POOL_IDLE_WAIT_MS 1000
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline uint64_t pool_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// 把线程绑定到一个CPU上，cpu按在线CPU数取模
+static inline bool pin_thread(pthread_t thread, int cpu) {
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 0) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+
+/*
+    线程池+工作队列 T是任务类
+    两种调度方式：
+    共享队列（默认）  所有工作线程从同一个无锁队列取任务，谁先醒谁处理
+    工作窃取          每个工作线程一个本地队列，append按hint把任务放到对应线程的队列，
+                      线程只处理自己队列里的任务，空了才随机找别的线程偷，
+                      这样同一个reactor的连接总是由同一个（可以绑在同一个核上的）线程解析、
+                      生成响应，连接对象和读写缓冲留在这个核的cache里
+    共享队列模式下线程数可以在[thread_num, max_thread_num]之间动态伸缩：
+    管理线程定期根据"平均有多少线程在忙 + 积压的任务需要多少线程"估计需要的线程数，
+    不够就立即补上，持续偏多就让空闲线程一个一个退出
+    工作窃取模式下线程和reactor、CPU一一对应，线程数固定
+    任务入队时打时间戳，启用set_queue_delay后按排队时间（CoDel）判断过载，
+    被丢弃的任务不调用process()而是调用reject()，由任务类自己以一致的状态结束；
+    队列满时append返回false，调用者同样应该reject
+*/
 template<class T>
 class threadpool {
 public:
-    threadpool(int thread_num = 8, int max_requests = 10000) :
-    m_thread_num(thread_num), m_max_requests(max_requests),
-    m_stop(false), m_threads(nullptr) {
+    threadpool(int thread_num = 8, int max_requests = 10000, bool work_stealing = false, int max_thread_num = 0) :
+    m_thread_num(thread_num), m_max_thread_num(max_thread_num), m_max_requests(max_requests),
+    m_workqueue(max_requests > 0 && !work_stealing ? max_requests : 1), m_idle(0), m_rejected(0),
+    m_stealing(work_stealing), m_slots(nullptr), m_next(0), m_pin_cpus(0),
+    m_live(0), m_retire(0), m_busy_ns(0), m_done(0), m_service_ns(0),
+    m_manager_started(false), m_stop(false) {
+        if (m_max_thread_num < m_thread_num || m_stealing) {
+            m_max_thread_num = m_thread_num;
+        }
         if (m_thread_num <= 0 || m_max_requests <= 0) {
             throw std::exception();
         }
 
-        m_threads = new pthread_t[m_thread_num];
-        if (!m_threads) throw std::exception();
+        m_slots = new worker_slot[m_max_thread_num];
+        for (int i = 0; i < m_max_thread_num; ++i) {
+            m_slots[i].pool = this;
+            m_slots[i].index = i;
+        }
+        if (m_stealing) {
+            // 每个线程的本地队列平分总容量
+            int per_thread = m_max_requests / m_thread_num;
+            if (per_thread < 64) per_thread = 64;
+            for (int i = 0; i < m_thread_num; ++i) {
+                m_slots[i].queue = new mpmc_queue<task_entry>(per_thread);
+            }
+        }
 
-        // 创建线程并设置线程分离
+        // 创建最少的线程数，线程不再分离，析构时唤醒并join
         for (int i = 0; i < m_thread_num; ++i) {
-            printf("creating %dth thread\n", i);
-            if (pthread_create(&m_threads[i], nullptr, worker, this)) {
-                delete [] m_threads;
+            if (!spawn(i)) {
+                shutdown();
                 throw std::exception();
             }
-            
-            // 主线程与子线程分离，子线程结束时资源自动回收，不产生僵尸线程
-            if (pthread_detach(m_threads[i])) {
-                delete [] m_threads;
+        }
+
+        // 能伸缩时才需要管理线程
+        if (m_max_thread_num > m_thread_num) {
+            if (pthread_create(&m_manager, nullptr, manager, this)) {
+                shutdown();
                 throw std::exception();
             }
-
+            m_manager_started = true;
         }
-
     }
 
     ~threadpool() {
-        delete [] m_threads;
-        m_stop = true;
+        shutdown();
+    }
+
+    // 当前的线程数
+    int thread_num() const { return m_live.load(std::memory_order_relaxed); }
+    bool work_stealing() const { return m_stealing; }
+
+    // 最近一个采样周期的平均任务处理时间（纳秒），只在能伸缩时统计
+    uint64_t service_ns() const { return m_service_ns.load(std::memory_order_relaxed); }
+
+    // 按排队时间拒绝任务：持续interval_ms都超过target_ms时开始丢弃，target_ms为0表示不启用
+    // 在添加任务之前设置
+    void set_queue_delay(int target_ms, int interval_ms) { m_codel.set(target_ms, interval_ms); }
+
+    // 出队时因排队太久被拒绝的任务数
+    uint64_t rejected() const { return m_rejected.load(std::memory_order_relaxed); }
+
+    // 把第i个工作线程绑定到第 i % cpus 个核上（和worker_hint的分组一致），
+    // 之后动态伸缩新建的线程在spawn时按同样的规则绑定
+    bool pin_workers(int cpus) {
+        m_pin_cpus.store(cpus, std::memory_order_relaxed);
+        bool ok = true;
+        for (int i = 0; i < m_max_thread_num; ++i) {
+            if (m_slots[i].state.load() == SLOT_RUNNING) {
+                ok = pin_thread(m_slots[i].thread, i % cpus) && ok;
+            }
+        }
+        return ok;
     }
 
-    // 添加任务
-    bool append(T* request) {
-        m_queuelocker.lock();
-        if (m_workqueue.size() > m_max_requests) {
-            m_queuelocker.unlock();
+    // 添加任务，队列满时返回false
+    // hint只在工作窃取模式下有用：任务放到第 hint % 线程数 个线程的本地队列，
+    // 同一个hint总是落在同一个线程上；小于0时轮流分配
+    bool append(T* request, int hint = -1) {
+        task_entry entry = { request, m_codel.enabled() ? pool_now_ns() : 0 };
+        if (m_stealing) {
+            return append_local(entry, hint);
+        }
+
+        if (!m_workqueue.push(entry)) {
             return false;
         }
 
-        m_workqueue.push_back(request);
-        m_queuelocker.unlock();
-        m_queuestat.post(); // 信号量增加
+        // 只有确实有线程睡在信号量上时才post，忙的时候不产生futex系统调用
+        // 与worker中的 m_idle++ -> 再取一次 配对，保证不会漏掉唤醒
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_idle.load(std::memory_order_relaxed) > 0) {
+            m_queuestat.post(); // 信号量增加
+        }
         return true;
     }
 
 private:
+    enum SLOT_STATE { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+
+    // 队列中的任务和它入队的时间
+    struct task_entry {
+        T* request;
+        uint64_t enqueue_ns;
+    };
+
+    // 每个工作线程的状态
+    struct alignas(64) worker_slot {
+        threadpool* pool;
+        int index;
+        pthread_t thread;
+        std::atomic<int> state;    // SLOT_STATE，线程退出后由管理线程join并回收
+        mpmc_queue<task_entry>* queue; // 工作窃取模式的本地队列，reactor放入，本线程和窃取者取出
+        std::atomic<bool> parked;  // 是否睡在自己的信号量上（工作窃取模式）
+        sem wakeup;
+
+        worker_slot() : pool(nullptr), index(0), state(SLOT_FREE), queue(nullptr), parked(false) {}
+        ~worker_slot() { delete queue; }
+    };
+
     static void* worker(void* arg) {
-        // 在pthread_create时和worker一起传递的arg是当前对象的this指针
+        // 在pthread_create时和worker一起传递的arg是线程自己的worker_slot
+        worker_slot* slot = (worker_slot*) arg;
+        threadpool* pool = slot->pool;
+        if (pool->m_stealing) {
+            pool->run_stealing(slot->index);
+        } else {
+            pool->run();
+        }
+        pool->m_live.fetch_sub(1, std::memory_order_relaxed);
+        slot->state.store(SLOT_EXITED, std::memory_order_release);
+        return pool;
+    }
+
+    static void* manager(void* arg) {
         threadpool* pool = (threadpool*) arg;
-        pool->run();
+        pool->manage();
         return pool;
     }
 
-    void run() {
+    // 在第i个空位上创建线程
+    bool spawn(int i) {
+        printf("creating %dth thread\n", i);
+        worker_slot& slot = m_slots[i];
+        slot.state.store(SLOT_RUNNING, std::memory_order_relaxed);
+        m_live.fetch_add(1, std::memory_order_relaxed);
+        if (pthread_create(&slot.thread, nullptr, worker, &slot)) {
+            slot.state.store(SLOT_FREE, std::memory_order_relaxed);
+            m_live.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        int cpus = m_pin_cpus.load(std::memory_order_relaxed);
+        if (cpus > 0 && !pin_thread(slot.thread, i % cpus)) {
+            printf("绑定第%d个工作线程失败\n", i);
+        }
+        return true;
+    }
+
+    // 唤醒并join所有线程
+    void shutdown() {
+        m_stop = true;
+        if (m_manager_started) {
+            m_manager_wakeup.post();
+            pthread_join(m_manager, nullptr);
+            m_manager_started = false;
+        }
+        for (int i = 0; i < m_max_thread_num; ++i) {
+            m_queuestat.post();
+            m_slots[i].wakeup.post();
+        }
+        for (int i = 0; i < m_max_thread_num; ++i) {
+            if (m_slots[i].state.load(std::memory_order_acquire) != SLOT_FREE) {
+                pthread_join(m_slots[i].thread, nullptr);
+                m_slots[i].state.store(SLOT_FREE, std::memory_order_relaxed);
+            }
+        }
+        delete [] m_slots;
+        m_slots = nullptr;
+    }
+
+    // 管理线程：回收退出的线程，按负载增减线程
+    void manage() {
+        uint64_t last = pool_now_ns();
+        uint64_t last_busy = 0, last_done = 0;
+        int low_ticks = 0;
+        while (!m_stop) {
+            m_manager_wakeup.timedwait(POOL_MANAGE_MS);
+            if (m_stop) break;
+
+            for (int i = 0; i < m_max_thread_num; ++i) {
+                if (m_slots[i].state.load(std::memory_order_acquire) == SLOT_EXITED) {
+                    pthread_join(m_slots[i].thread, nullptr);
+                    printf("%dth thread retired\n", i);
+                    m_slots[i].state.store(SLOT_FREE, std::memory_order_relaxed);
+                }
+            }
+
+            uint64_t now = pool_now_ns();
+            uint64_t busy = m_busy_ns.load(std::memory_order_relaxed);
+            uint64_t done = m_done.load(std::memory_order_relaxed);
+            double interval = (double)(now - last);
+            if (done > last_done) {
+                m_service_ns.store((busy - last_busy) / (done - last_done), std::memory_order_relaxed);
+            }
+            size_t depth = m_workqueue.size();
+            int live = m_live.load(std::memory_order_relaxed);
+
+            // 这个周期平均有多少线程在处理任务，加上一个周期内消化掉积压需要的线程，留25%余量
+            double busy_threads = (busy - last_busy) / interval;
+            double backlog_threads = depth * (double) m_service_ns.load(std::memory_order_relaxed) / interval;
+            int want = (int)((busy_threads + backlog_threads) * 1.25) + 1;
+            if (depth > 0 && done == last_done) {
+                // 有积压但一个任务都没完成（线程都卡在慢任务上），估计不出来，先加一个
+                want = live + 1;
+            }
+            if (want < m_thread_num) want = m_thread_num;
+            if (want > m_max_thread_num) want = m_max_thread_num;
+            last = now;
+            last_busy = busy;
+            last_done = done;
+
+            if (want > live) {
+                m_retire.store(0, std::memory_order_relaxed);
+                low_ticks = 0;
+                for (int i = 0; i < m_max_thread_num && live < want; ++i) {
+                    if (m_slots[i].state.load(std::memory_order_relaxed) == SLOT_FREE && spawn(i)) {
+                        ++live;
+                    }
+                }
+            } else if (want < live) {
+                // 持续偏多，让一个空闲线程退出
+                if (++low_ticks >= POOL_SHRINK_TICKS && m_retire.load(std::memory_order_relaxed) == 0) {
+                    m_retire.store(1, std::memory_order_relaxed);
+                    m_queuestat.post();
+                    low_ticks = 0;
+                }
+            } else {
+                low_ticks = 0;
+            }
+        }
+    }
+
+    // 空闲线程是否应该退出，同时只退一个且不少于最少线程数
+    bool try_retire() {
+        int r = m_retire.load(std::memory_order_relaxed);
+        while (r > 0) {
+            if (m_retire.compare_exchange_weak(r, r - 1, std::memory_order_relaxed)) {
+                return m_live.load(std::memory_order_relaxed) > m_thread_num;
+            }
+        }
+        return false;
+    }
+
+    bool append_local(const task_entry& entry, int hint) {
+        int w;
+        if (hint < 0) {
+            w = m_next.fetch_add(1, std::memory_order_relaxed) % m_thread_num;
+        } else {
+            w = hint % m_thread_num;
+        }
+        // 亲和的线程队列满了就放到后面的线程，都满才拒绝
+        int i = 0;
+        for (; i < m_thread_num; ++i) {
+            if (m_slots[w].queue->push(entry)) break;
+            w = (w + 1) % m_thread_num;
+        }
+        if (i == m_thread_num) {
+            return false;
+        }
+
+        // 和run_stealing中 parked=true -> 再取一次 配对
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        worker_slot& slot = m_slots[w];
+        if (slot.parked.load(std::memory_order_relaxed)) {
+            slot.wakeup.post();
+        } else if (m_idle.load(std::memory_order_relaxed) > 0 && slot.queue->size() > 1) {
+            // 亲和的线程正忙且已经积压，叫醒一个空闲线程来偷
+            for (int j = 0; j < m_thread_num; ++j) {
+                if (m_slots[j].parked.load(std::memory_order_relaxed)) {
+                    m_slots[j].wakeup.post();
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    // 从随机的一个线程开始，依次尝试从其他线程的队列偷一个任务
+    bool steal(int self, unsigned& seed, task_entry& entry) {
+        if (m_thread_num == 1) return false;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int victim = seed % m_thread_num;
+        for (int i = 0; i < m_thread_num; ++i, victim = (victim + 1) % m_thread_num) {
+            if (victim != self && m_slots[victim].queue->pop(entry)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 先取本地队列，再偷
+    bool find_task(int self, unsigned& seed, task_entry& entry) {
+        return m_slots[self].queue->pop(entry) || steal(self, seed, entry);
+    }
+
+    // 工作窃取模式下取一个任务：自旋一会儿，取不到再睡在自己的信号量上
+    bool take_stealing(int self, unsigned& seed, task_entry& entry) {
+        for (int i = 0; i < POOL_SPIN_COUNT; ++i) {
+            if (find_task(self, seed, entry)) {
+                return true;
+            }
+            cpu_relax();
+        }
+
+        worker_slot& slot = m_slots[self];
+        slot.parked.store(true, std::memory_order_relaxed);
+        m_idle.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool found = find_task(self, seed, entry);
+        if (!found) {
+            slot.wakeup.wait();
+        }
+        slot.parked.store(false, std::memory_order_relaxed);
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        return found || find_task(self, seed, entry);
+    }
+
+    void run_stealing(int self) {
+        unsigned seed = 2463534242u + self * 2654435761u;
         while (!m_stop) {
-            // 将信号量-1 如果 < 0 就阻塞，初始状态下线程都阻塞在这个位置
-            m_queuestat.wait();
-
-            // 到这里说明队列中有需要处理的任务，否则会阻塞在wait处
-            m_queuelocker.lock();
-            if (m_workqueue.empty()) {
-                // 再加强一下判断，实际可能是没必要的
-                m_queuelocker.unlock();
+            task_entry entry;
+            if (!take_stealing(self, seed, entry)) {
                 continue;
             }
+            handle(entry, false);
+        }
+    }
+
+    // 取一个任务：先自旋一会儿，取不到再登记为空闲、睡在信号量上
+    // 返回false且retire为true表示这个线程应该退出
+    bool take(task_entry& entry, bool& retire) {
+        for (int i = 0; i < POOL_SPIN_COUNT; ++i) {
+            if (m_workqueue.pop(entry)) {
+                return true;
+            }
+            cpu_relax();
+        }
 
-            T* request = m_workqueue.front();
-            m_workqueue.pop_front();
-            m_queuelocker.unlock();
+        m_idle.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // 登记之后再取：append在我们登记之前放入的任务不会post，要在这里取到
+        while (!m_workqueue.pop(entry)) {
+            if (m_stop) {
+                m_idle.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            // 将信号量-1 如果 < 0 就阻塞，隔一段时间醒来看看是否该退出
+            if (!m_queuestat.timedwait(POOL_IDLE_WAIT_MS) || m_retire.load(std::memory_order_relaxed) > 0) {
+                if (m_workqueue.pop(entry)) {
+                    break;
+                }
+                if (try_retire()) {
+                    m_idle.fetch_sub(1, std::memory_order_relaxed);
+                    retire = true;
+                    return false;
+                }
+            }
+        }
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
 
-            if (request) {
-                request->process();
+    void run() {
+        bool retire = false;
+        bool measure = m_max_thread_num > m_thread_num;
+        while (!m_stop && !retire) {
+            task_entry entry;
+            if (!take(entry, retire)) {
+                continue;
             }
+            handle(entry, measure);
+        }
+    }
+
+    // 处理一个任务：排队太久的调用reject()拒绝掉，其余的process()
+    void handle(const task_entry& entry, bool measure) {
+        T* request = entry.request;
+        if (!request) {
+            return;
+        }
+        uint64_t start = (measure || m_codel.enabled()) ? pool_now_ns() : 0;
+        if (m_codel.enabled() && m_codel.should_drop(entry.enqueue_ns, start)) {
+            m_rejected.fetch_add(1, std::memory_order_relaxed);
+            request->reject();
+            return;
+        }
+
+        request->process();
+        if (measure) {
+            // 统计处理时间，供管理线程估计需要的线程数
+            m_busy_ns.fetch_add(pool_now_ns() - start, std::memory_order_relaxed);
+            m_done.fetch_add(1, std::memory_order_relaxed);
         }
     }
 
 private:
-    // 线程池数量
+    // 最少线程数（工作窃取模式下就是线程数）
     int m_thread_num;
 
-    // 线程池数组，大小为m_thread_num
-    pthread_t* m_threads;
+    // 最多线程数
+    int m_max_thread_num;
 
-    // 请求队列最多允许等待的数量
+    // 请求队列最多允许等待的数量（队列容量向上取整到2的幂）
     int m_max_requests;
 
-    // 请求队列
-    std::list<T*> m_workqueue;
+    // 请求队列，无锁环形队列（共享队列模式）
+    mpmc_queue<task_entry> m_workqueue;
+
+    // 睡在信号量上的线程数
+    std::atomic<int> m_idle;
 
-    // 互斥锁
-    locker m_queuelocker;
+    // 按排队时间的过载控制，以及因此拒绝的任务数
+    codel m_codel;
+    std::atomic<uint64_t> m_rejected;
 
-    // 信号量用来判断请求队列中是否有任务需要处理
+    // 信号量用来唤醒空闲的线程（共享队列模式）
     sem m_queuestat;
 
+    // 工作窃取模式
+    bool m_stealing;
+
+    // 每个可能的线程一个worker_slot，大小为m_max_thread_num
+    worker_slot* m_slots;
+
+    // 没有hint时轮流分配的计数
+    std::atomic<unsigned> m_next;
+
+    // 工作线程绑定到几个核上（第i个线程绑第 i % m_pin_cpus 个），0表示不绑定
+    std::atomic<int> m_pin_cpus;
+
+    // 正在运行的线程数，以及管理线程要求退出的线程数
+    std::atomic<int> m_live;
+    std::atomic<int> m_retire;
+
+    // 累计处理时间和完成的任务数，最近一个周期的平均处理时间
+    std::atomic<uint64_t> m_busy_ns;
+    std::atomic<uint64_t> m_done;
+    std::atomic<uint64_t> m_service_ns;
+
+    // 管理线程
+    pthread_t m_manager;
+    bool m_manager_started;
+    sem m_manager_wakeup;
+
     // 是否结束线程
-    bool m_stop;    
+    std::atomic<bool> m_stop;
 };
 
 
-#endif
\ No newline at end of file
+#endif
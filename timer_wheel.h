@@ -0,0 +1,169 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+// 单调时钟毫秒数，COARSE版本走vDSO、不进内核，精度几毫秒，对秒级超时足够
+inline uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 定时器节点，侵入式双向链表，嵌在使用者的对象里，加入/删除都是O(1)且不分配内存
+struct timer_node {
+    timer_node* prev;
+    timer_node* next;
+    uint64_t expire; // 到期的tick
+    void* data;      // 使用者自己的对象
+
+    timer_node() : prev(nullptr), next(nullptr), expire(0), data(nullptr) {}
+    bool linked() const { return prev != nullptr; }
+};
+
+/*
+    分层时间轮（和早期Linux内核的tv1~tv4一样）
+    4层，每层64个槽，第0层一个槽是一个tick，第n层一个槽是64^n个tick，
+    加入时按到期时间离现在多远放到对应层，每转完一圈低层时把高层的一个槽"降级"重新分配，
+    所以加入、删除、每个tick的推进都是O(1)，不管挂了多少连接
+    只在所属的事件循环线程中使用，不加锁
+*/
+class timer_wheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MAX_TICKS = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+
+    explicit timer_wheel(int tick_ms = 100) : m_tick_ms(tick_ms), m_count(0) {
+        m_current = now_ms() / m_tick_ms;
+        for (int l = 0; l < LEVELS; ++l) {
+            for (int i = 0; i < SLOTS; ++i) {
+                m_slots[l][i].prev = m_slots[l][i].next = &m_slots[l][i];
+            }
+        }
+    }
+
+    // 在expire_ms（now_ms()的时间）到期
+    void add(timer_node* node, uint64_t expire_ms) {
+        if (node->linked()) {
+            remove(node);
+        }
+        node->expire = (expire_ms + m_tick_ms - 1) / m_tick_ms;
+        place(node);
+        ++m_count;
+    }
+
+    void remove(timer_node* node) {
+        if (!node->linked()) {
+            return;
+        }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        --m_count;
+    }
+
+    bool empty() const { return m_count == 0; }
+
+    // 距离下一个tick的毫秒数，作为epoll_wait的超时；没有定时器时返回-1（一直等）
+    int next_timeout(uint64_t now) const {
+        if (m_count == 0) {
+            return -1;
+        }
+        uint64_t next = m_current * m_tick_ms;
+        return next > now ? (int)(next - now) : 0;
+    }
+
+    int tick_ms() const { return m_tick_ms; }
+
+    // 推进到now，对每个到期的节点调用on_expire(node)；回调里可以重新add
+    template<class F>
+    void advance(uint64_t now, F on_expire) {
+        uint64_t target = now / m_tick_ms;
+        if (m_count == 0) {
+            // 没有定时器，直接跳过中间的tick
+            if (target >= m_current) m_current = target + 1;
+            return;
+        }
+        while (m_current <= target) {
+            int index = m_current & (SLOTS - 1);
+            // 第0层转完一圈，把上一层对应的槽降级，逐层向上
+            if (index == 0) {
+                for (int l = 1; l < LEVELS; ++l) {
+                    int i = (m_current >> (SLOT_BITS * l)) & (SLOTS - 1);
+                    cascade(l, i);
+                    if (i != 0) break;
+                }
+            }
+            ++m_current;
+
+            // 把这个槽整个摘下来再处理，回调里重新加入的节点不会被这一轮看到
+            timer_node list;
+            take(&m_slots[0][index], &list);
+            while (list.next != &list) {
+                timer_node* node = list.next;
+                node->prev->next = node->next;
+                node->next->prev = node->prev;
+                node->prev = node->next = nullptr;
+                --m_count;
+                on_expire(node);
+            }
+        }
+    }
+
+private:
+    void place(timer_node* node) {
+        if (node->expire < m_current) {
+            node->expire = m_current; // 已经过期的放到下一个要处理的槽
+        }
+        uint64_t delta = node->expire - m_current;
+        if (delta > MAX_TICKS) {
+            node->expire = m_current + MAX_TICKS;
+            delta = MAX_TICKS;
+        }
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+            ++level;
+        }
+        timer_node* head = &m_slots[level][(node->expire >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    // 把某一层某个槽里的节点按新的剩余时间重新分配到低层
+    void cascade(int level, int index) {
+        timer_node list;
+        take(&m_slots[level][index], &list);
+        while (list.next != &list) {
+            timer_node* node = list.next;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            place(node);
+        }
+    }
+
+    // 把head链表整个移到to上
+    static void take(timer_node* head, timer_node* to) {
+        if (head->next == head) {
+            to->prev = to->next = to;
+            return;
+        }
+        to->next = head->next;
+        to->prev = head->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        head->prev = head->next = head;
+    }
+
+private:
+    int m_tick_ms;
+    uint64_t m_current; // 下一个要处理的tick
+    int m_count;
+    timer_node m_slots[LEVELS][SLOTS];
+};
+
+#endif
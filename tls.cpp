@@ -0,0 +1,118 @@
+#include "tls.h"
+#include <stdio.h>
+#include <string.h>
+
+static const int SESSION_CACHE_SIZE = 20480; // 会话ID缓存的条目数，满了以后淘汰最旧的
+static const long SESSION_TIMEOUT = 3600;    // 会话（包括票据）多久以内可以恢复，秒
+
+// ALPN按服务端的顺序：h2优先，其次http/1.1
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+static int select_alpn(SSL* /*ssl*/, const unsigned char** out, unsigned char* outlen,
+                       const unsigned char* in, unsigned int inlen, void* /*arg*/) {
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, outlen, alpn_protos, sizeof(alpn_protos) - 1, in, inlen)
+        != OPENSSL_NPN_NEGOTIATED) {
+        // 没有共同的协议时不选，按HTTP/1.1处理
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void print_errors(const char* what) {
+    unsigned long err = ERR_get_error();
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    printf("%s: %s\n", what, err ? buf : "unknown error");
+    ERR_clear_error();
+}
+
+bool tls_context::init(const char* cert_file, const char* key_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        print_errors("SSL_CTX_new");
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+        print_errors(cert_file);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        print_errors(key_file);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    // 会话ID缓存和票据都在这个SSL_CTX里，所有reactor的连接共用
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+
+    // 发送时SSL_write可以只写一部分，EAGAIN后重试的数据按同样的内容重新拼，地址可以不同
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                     | SSL_MODE_RELEASE_BUFFERS);
+    // 优先选服务端的算法顺序（AES-GCM在前，有AES-NI时最快，也是kTLS支持的）
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, nullptr);
+    m_ctx = ctx;
+    return true;
+}
+
+tls_context::~tls_context() {
+    if (m_ctx) {
+        SSL_CTX_free(m_ctx);
+    }
+}
+
+SSL* tls_context::new_session(int fd) {
+    SSL* ssl = SSL_new(m_ctx);
+    if (!ssl) {
+        ERR_clear_error();
+        return nullptr;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return nullptr;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+bool tls_context::handshake_done(SSL* ssl) {
+    if (m_report.load(std::memory_order_relaxed) && m_report.exchange(false)) {
+        report();
+    }
+    bool ktls = false;
+#ifndef OPENSSL_NO_KTLS
+    ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+    if (ktls) {
+        m_ktls.fetch_add(1, std::memory_order_relaxed);
+    }
+    return ktls;
+}
+
+bool tls_context::alpn_h2(const SSL* ssl) {
+    const unsigned char* proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+void tls_context::report() {
+    long accepted = SSL_CTX_sess_accept_good(m_ctx);
+    long resumed = SSL_CTX_sess_hits(m_ctx);
+    printf("tls: %ld handshakes, %ld resumed (%.1f%%), %ld sessions cached, %ld cache misses, %lu kTLS\n",
+           accepted, resumed, accepted ? 100.0 * resumed / accepted : 0.0, SSL_CTX_sess_number(m_ctx),
+           SSL_CTX_sess_misses(m_ctx), m_ktls.load(std::memory_order_relaxed));
+    fflush(stdout);
+}
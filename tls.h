@@ -0,0 +1,50 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <atomic>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/*
+    监听socket上的TLS：所有reactor共用一个SSL_CTX，证书、会话缓存和会话票据的密钥都在里面
+    - 会话恢复：TLS 1.2的会话ID缓存在SSL_CTX内部（带锁，所有线程共用），TLS 1.3和1.2的会话票据
+      用同一个SSL_CTX的密钥加解密，哪个reactor accept的连接都能恢复，不用再做完整的密钥交换
+    - kTLS：握手完成后OpenSSL把密钥交给内核（内核要有tls模块，算法是AES-GCM或ChaCha20-Poly1305），
+      之后http_conn直接对socket sendmsg/sendfile，由内核加密，响应体不经过用户态；
+      内核不支持时退回SSL_write，响应体先拷进记录缓冲再加密
+    - ALPN：客户端支持时选h2，否则http/1.1（或者客户端没有发ALPN）
+    握手和读写都在连接所属的事件循环线程中进行（读缓冲里还留着解密好的数据时工作线程也会读一次），
+    同一时刻只有一个线程操作一个SSL；用到OpenSSL，链接时加-lssl -lcrypto
+*/
+class tls_context {
+public:
+    static tls_context& instance() {
+        static tls_context tls;
+        return tls;
+    }
+
+    // 加载证书链和私钥，失败时打印原因并返回false；在创建reactor之前调用
+    bool init(const char* cert_file, const char* key_file);
+    bool enabled() const { return m_ctx != nullptr; }
+
+    // 新连接的SSL，服务端模式；失败返回nullptr
+    SSL* new_session(int fd);
+    // 握手完成时调用，kTLS接管了发送时返回true
+    bool handshake_done(SSL* ssl);
+    // 握手时ALPN选中了h2
+    static bool alpn_h2(const SSL* ssl);
+
+    // 信号处理函数中调用：下一次握手完成时打印统计
+    void request_report() { m_report.store(true, std::memory_order_relaxed); }
+    void report();
+
+private:
+    tls_context() : m_ctx(nullptr), m_report(false), m_ktls(0) {}
+    ~tls_context();
+
+    SSL_CTX* m_ctx;
+    std::atomic<bool> m_report;
+    std::atomic<unsigned long> m_ktls; // 发送交给了kTLS的连接数
+};
+
+#endif
@@ -0,0 +1,281 @@
+/*
+    资源包打包工具：把文档根目录下所有对其他用户可读的普通文件打成一个资源包（格式见bundle.h），
+    服务器用 -B 包文件 加载
+    - 路径按字节序排好，服务器二分查找；每个文件的Last-Modified和按内容算的ETag预先生成好
+    - 文本类的文件如果有不比它旧的file.br、file.zst、file.gz，作为它的压缩版本（这些文件本身也照常打进包里，
+      内容只存一份）；给了gzip级别时，没有file.gz的文件在这里压缩，至少省下1/8才用
+    - 超过一页的文件从页边界开始，小文件按64字节对齐挤在一起
+    先写到 输出文件.tmp，fsync后rename，服务器不会读到写了一半的包；之后kill -HUP让服务器换上
+
+    编译运行（在tools目录下）：
+        g++ -O2 -std=c++17 -I.. bundle_pack.cpp ../mime.cpp -o bundle_pack -lz
+        ./bundle_pack 文档根目录 输出文件 [gzip级别]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "bundle.h"
+#include "mime.h"
+
+static const size_t PAGE = 4096;
+static const size_t SMALL_ALIGN = 64;
+static const size_t GZIP_MIN = 256; // 和服务器的COMPRESS_MIN一致，太小的文件压缩不划算
+// 下标和bundle_variant一致
+static const char* suffixes[BUNDLE_VARIANTS] = { "", ".br", ".zst", ".gz" };
+
+struct source {
+    std::string path;  // 以'/'开头，相对文档根目录
+    struct stat st;
+};
+
+struct body {
+    std::string data;
+    uint64_t off;
+};
+
+static std::string g_root;
+static dev_t g_skip_dev;
+static ino_t g_skip_ino;
+static std::vector<source> g_files;
+
+static int collect(const char* path, const struct stat* st, int type, struct FTW*) {
+    if (type != FTW_F || !S_ISREG(st->st_mode) || !(st->st_mode & S_IROTH)) {
+        return 0; // 目录、链接和别人读不了的文件留给服务器按文件系统处理
+    }
+    if (st->st_dev == g_skip_dev && st->st_ino == g_skip_ino) {
+        return 0; // 包就输出在文档根目录下时不把旧包打进去
+    }
+    source s;
+    s.path = path + g_root.size();
+    s.st = *st;
+    g_files.push_back(s);
+    return 0;
+}
+
+static bool read_file(const std::string& path, std::string& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    out.clear();
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        out.append(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+static bool gzip(const std::string& in, int level, std::string& out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef*) in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef*) &out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static bool not_older(const struct stat& a, const struct stat& b) {
+    return a.st_mtim.tv_sec > b.st_mtim.tv_sec
+        || (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec >= b.st_mtim.tv_nsec);
+}
+
+// "长度-FNV-1a"：只取决于内容，重新打包时没变的文件客户端的缓存仍然有效
+static void make_etag(const std::string& data, bundle_variant& v) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : data) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    v.etag_len = snprintf(v.etag, sizeof(v.etag), "\"%lx-%016lx\"", (unsigned long) data.size(), (unsigned long) h);
+}
+
+static size_t align(size_t off, size_t a) {
+    return (off + a - 1) & ~(a - 1);
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        printf("用法: %s 文档根目录 输出文件 [gzip级别1~9]\n", argv[0]);
+        return 1;
+    }
+    g_root = argv[1];
+    while (g_root.size() > 1 && g_root.back() == '/') {
+        g_root.pop_back();
+    }
+    std::string output = argv[2];
+    int level = argc > 3 ? atoi(argv[3]) : 0;
+    if (level < 0 || level > 9) {
+        printf("gzip级别要在1~9之间\n");
+        return 1;
+    }
+    struct stat out_st;
+    if (stat(output.c_str(), &out_st) == 0) {
+        g_skip_dev = out_st.st_dev;
+        g_skip_ino = out_st.st_ino;
+    }
+    if (nftw(g_root.c_str(), collect, 64, FTW_PHYS) != 0) {
+        printf("遍历%s失败: %s\n", g_root.c_str(), strerror(errno));
+        return 1;
+    }
+    std::sort(g_files.begin(), g_files.end(), [](const source& a, const source& b) { return a.path < b.path; });
+    std::map<std::string, size_t> by_path;
+    for (size_t i = 0; i < g_files.size(); ++i) {
+        by_path[g_files[i].path] = i;
+    }
+
+    // 每个文件的内容只存一份：file.gz既是自己的内容，也是file的gzip版本
+    std::vector<body> bodies;
+    std::vector<long> file_body(g_files.size(), -1);
+    auto body_of = [&](size_t i) -> long {
+        if (file_body[i] < 0) {
+            body b;
+            if (!read_file(g_root + g_files[i].path, b.data)) {
+                printf("读%s失败: %s\n", g_files[i].path.c_str(), strerror(errno));
+                exit(1);
+            }
+            file_body[i] = bodies.size();
+            bodies.push_back(std::move(b));
+        }
+        return file_body[i];
+    };
+
+    // 先按顺序排好每个条目的各个版本用哪一块内容
+    std::vector<bundle_entry> entries(g_files.size());
+    std::vector<std::vector<long>> variant_body(g_files.size(), std::vector<long>(BUNDLE_VARIANTS, -1));
+    size_t generated = 0;
+    for (size_t i = 0; i < g_files.size(); ++i) {
+        const source& f = g_files[i];
+        variant_body[i][0] = body_of(i);
+        if (!mime_at(mime_lookup(f.path)).compressible) {
+            continue;
+        }
+        for (int c = 1; c < BUNDLE_VARIANTS; ++c) {
+            auto it = by_path.find(f.path + suffixes[c]);
+            if (it != by_path.end() && not_older(g_files[it->second].st, f.st)) {
+                variant_body[i][c] = body_of(it->second);
+            }
+        }
+        const std::string& data = bodies[variant_body[i][0]].data;
+        int gz = BUNDLE_VARIANTS - 1;
+        if (level > 0 && variant_body[i][gz] < 0 && data.size() >= GZIP_MIN) {
+            body b;
+            if (gzip(data, level, b.data) && b.data.size() <= data.size() - data.size() / 8) {
+                variant_body[i][gz] = bodies.size();
+                bodies.push_back(std::move(b));
+                ++generated;
+            }
+        }
+    }
+
+    // 排版：头部、路径、索引、内容
+    size_t off = sizeof(bundle_header);
+    std::vector<uint64_t> path_off(g_files.size());
+    for (size_t i = 0; i < g_files.size(); ++i) {
+        path_off[i] = off;
+        off += g_files[i].path.size();
+    }
+    uint64_t index_off = align(off, alignof(bundle_entry));
+    off = index_off + entries.size() * sizeof(bundle_entry);
+    for (body& b : bodies) {
+        off = align(off, b.data.size() > PAGE ? PAGE : SMALL_ALIGN);
+        b.off = off;
+        off += b.data.size();
+    }
+    size_t total = off;
+
+    for (size_t i = 0; i < g_files.size(); ++i) {
+        bundle_entry& e = entries[i];
+        memset(&e, 0, sizeof(e));
+        e.path_off = path_off[i];
+        e.path_len = g_files[i].path.size();
+        e.mtime = g_files[i].st.st_mtime;
+        struct tm tm;
+        time_t t = e.mtime;
+        gmtime_r(&t, &tm);
+        e.last_modified_len = strftime(e.last_modified, sizeof(e.last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        for (int c = 0; c < BUNDLE_VARIANTS; ++c) {
+            if (variant_body[i][c] < 0) {
+                continue;
+            }
+            const body& b = bodies[variant_body[i][c]];
+            e.variants[c].off = b.off;
+            e.variants[c].len = b.data.size();
+            make_etag(b.data, e.variants[c]);
+        }
+    }
+
+    bundle_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BUNDLE_MAGIC, sizeof(h.magic));
+    h.version = BUNDLE_VERSION;
+    h.count = entries.size();
+    h.index_off = index_off;
+    h.size = total;
+
+    // 对齐留下的空隙写0
+    std::string tmp = output + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("创建%s失败: %s\n", tmp.c_str(), strerror(errno));
+        return 1;
+    }
+    std::string zeros(PAGE, '\0');
+    size_t pos = 0;
+    auto put = [&](uint64_t at, const char* data, size_t len) {
+        if (!write_all(fd, zeros.data(), at - pos) || !write_all(fd, data, len)) {
+            printf("写%s失败: %s\n", tmp.c_str(), strerror(errno));
+            unlink(tmp.c_str());
+            exit(1);
+        }
+        pos = at + len;
+    };
+    put(0, (const char*) &h, sizeof(h));
+    for (size_t i = 0; i < g_files.size(); ++i) {
+        put(path_off[i], g_files[i].path.data(), g_files[i].path.size());
+    }
+    put(index_off, (const char*) entries.data(), entries.size() * sizeof(bundle_entry));
+    for (const body& b : bodies) {
+        put(b.off, b.data.data(), b.data.size());
+    }
+    if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp.c_str(), output.c_str()) < 0) {
+        printf("保存%s失败: %s\n", output.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("%s: %zu 个文件，%zu 块内容（其中gzip压缩了 %zu 个），共 %zu KB\n",
+           output.c_str(), g_files.size(), bodies.size(), generated, total / 1024);
+    return 0;
+}
@@ -0,0 +1,663 @@
+#include "uring_reactor.h"
+
+#ifdef HAVE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "reactor.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_reactor::uring_reactor(int id, const server_config& config, conn_table& users, threadpool<http_conn>* pool) :
+m_id(id), m_reactor_num(config.reactor_num), m_thread_num(config.thread_num), m_listenfd(-1), m_users(users), m_pool(pool), m_conns(nullptr),
+m_ringfd(-1), m_ring_ptr(MAP_FAILED), m_ring_size(0), m_sqes((io_uring_sqe*) MAP_FAILED), m_sqes_size(0),
+m_buf_ring((io_uring_buf_ring*) MAP_FAILED), m_buf_ring_size(0), m_bufs(nullptr), m_buf_tail(0),
+m_eventfd(-1), m_eventfd_val(0), m_timeout_armed(false) {
+    // 先确认内核支持（io_uring_setup + provided buffer ring，后者要求6.0+，
+    // 同时也意味着multishot accept/recv可用），不支持时由main退回epoll
+    if (!setup_ring() || !setup_buffers()) {
+        cleanup();
+        throw std::exception();
+    }
+
+    m_listenfd = create_listenfd(config);
+    m_eventfd = eventfd(0, EFD_CLOEXEC);
+    // 按fd下标，calloc的零页在第一次用到时才分配，没用到的fd不占物理内存
+    m_conns = (conn_state*) calloc(MAX_FD, sizeof(conn_state));
+    if (m_listenfd < 0 || m_eventfd < 0 || !m_conns) {
+        cleanup();
+        throw std::exception();
+    }
+}
+
+uring_reactor::~uring_reactor() {
+    cleanup();
+}
+
+void uring_reactor::cleanup() {
+    if (m_listenfd >= 0) close(m_listenfd);
+    if (m_eventfd >= 0) close(m_eventfd);
+    if (m_ringfd >= 0) close(m_ringfd);
+    if (m_ring_ptr != MAP_FAILED) munmap(m_ring_ptr, m_ring_size);
+    if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_size);
+    if (m_buf_ring != MAP_FAILED) munmap(m_buf_ring, m_buf_ring_size);
+    delete [] m_bufs;
+    free(m_conns);
+    m_listenfd = m_eventfd = m_ringfd = -1;
+    m_ring_ptr = MAP_FAILED;
+    m_sqes = (io_uring_sqe*) MAP_FAILED;
+    m_buf_ring = (io_uring_buf_ring*) MAP_FAILED;
+    m_bufs = nullptr;
+    m_conns = nullptr;
+}
+
+bool uring_reactor::setup_ring() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = RING_ENTRIES * 4; // multishot会持续产生cqe，cq开大一些
+    m_ringfd = io_uring_setup(RING_ENTRIES, &p);
+    if (m_ringfd < 0) {
+        return false;
+    }
+    // 5.4以后sq和cq共用一次mmap
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        return false;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    m_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    m_ring_ptr = mmap(0, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+    if (m_ring_ptr == MAP_FAILED) {
+        return false;
+    }
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (io_uring_sqe*) mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        return false;
+    }
+
+    char* ptr = (char*) m_ring_ptr;
+    m_sq_head = (unsigned*)(ptr + p.sq_off.head);
+    m_sq_tail = (unsigned*)(ptr + p.sq_off.tail);
+    m_sq_array = (unsigned*)(ptr + p.sq_off.array);
+    m_sq_mask = *(unsigned*)(ptr + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+    m_cq_head = (unsigned*)(ptr + p.cq_off.head);
+    m_cq_tail = (unsigned*)(ptr + p.cq_off.tail);
+    m_cq_mask = *(unsigned*)(ptr + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(ptr + p.cq_off.cqes);
+    return true;
+}
+
+// 注册provided buffer ring：recv时不用事先给每个连接分配缓冲，由内核从这里取
+bool uring_reactor::setup_buffers() {
+    m_buf_ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+    m_buf_ring = (io_uring_buf_ring*) mmap(0, m_buf_ring_size, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_buf_ring == MAP_FAILED) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t) m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = 0;
+    if (io_uring_register(m_ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    m_bufs = new char[BUF_COUNT * BUF_SIZE];
+    m_buf_tail = 0;
+    for (unsigned i = 0; i < BUF_COUNT; ++i) {
+        recycle_buffer(i);
+    }
+    return true;
+}
+
+// 把用完的buffer放回ring，内核下次recv可以再用
+// 注意不能用m_buf_ring->bufs：内核头文件里包着它的空结构体在C++中占1字节，bufs会错开8字节
+void uring_reactor::recycle_buffer(uint16_t bid) {
+    struct io_uring_buf* buf = (struct io_uring_buf*) m_buf_ring + (m_buf_tail & (BUF_COUNT - 1));
+    buf->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t) bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* uring_reactor::get_sqe() {
+    unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    if (m_sq_local_tail - head >= m_sq_entries) {
+        // sq满了，先提交一批
+        submit(0);
+        head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_sq_local_tail - head >= m_sq_entries) {
+            return nullptr;
+        }
+    }
+    unsigned idx = m_sq_local_tail & m_sq_mask;
+    m_sq_array[idx] = idx;
+    ++m_sq_local_tail;
+    io_uring_sqe* sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// 提交所有新sqe，并等待至少wait_nr个完成事件
+int uring_reactor::submit(unsigned wait_nr) {
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    return io_uring_enter(m_ringfd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// multishot accept：只提交一次，之后每来一个连接产生一个cqe
+void uring_reactor::prep_accept() {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_data(OP_ACCEPT, 0, m_listenfd);
+}
+
+// multishot recv：数据到达时内核从buffer ring中选一个buffer收进去
+void uring_reactor::prep_recv(int fd) {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        close_conn(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = make_data(OP_RECV, m_conns[fd].gen, fd);
+    m_conns[fd].recv_armed = true;
+    m_conns[fd].throttled = false;
+}
+
+// 取消连接上挂着的multishot recv，recv以-ECANCELED结束
+void uring_reactor::prep_cancel_recv(int fd) {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_data(OP_RECV, m_conns[fd].gen, fd);
+    sqe->user_data = make_data(OP_CANCEL, m_conns[fd].gen, fd);
+}
+
+// 发送http_conn准备好的iovec；短连接的最后一次发送后面链接shutdown，
+// 一次提交完成"发完就关"，shutdown同时结束挂着的multishot recv
+void uring_reactor::prep_send(int fd) {
+    conn_state& st = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    bool last = !conn.keep_alive();
+
+    // 链式提交的两个sqe必须连续，sq剩余空间不够时先把已有的提交掉
+    if (last && m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) + 2 > m_sq_entries) {
+        submit(0);
+    }
+
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) {
+        close_conn(fd);
+        return;
+    }
+    memset(&st.msg, 0, sizeof(st.msg));
+    struct iovec* iov = nullptr;
+    st.msg.msg_iovlen = conn.get_iov(&iov);
+    st.msg.msg_iov = iov;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) &st.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (conn.more_pending() ? MSG_MORE : 0);
+    sqe->user_data = make_data(OP_SEND, st.gen, fd);
+    st.sending = true;
+    if (!last) {
+        return;
+    }
+
+    // 发送不完整时链会断开，shutdown返回-ECANCELED，由on_send重新提交
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = fd;
+    sqe->len = SHUT_RDWR;
+    sqe->user_data = make_data(OP_SHUTDOWN, st.gen, fd);
+}
+
+// 读eventfd，工作线程有通知时完成
+void uring_reactor::prep_notify() {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_eventfd;
+    sqe->addr = (uint64_t)(uintptr_t) &m_eventfd_val;
+    sqe->len = sizeof(m_eventfd_val);
+    sqe->user_data = make_data(OP_NOTIFY, 0, m_eventfd);
+}
+
+// 一个tick后完成的超时请求，用来推进时间轮
+void uring_reactor::prep_timeout() {
+    io_uring_sqe* sqe = get_sqe();
+    if (!sqe) return;
+    m_tick_ts.tv_sec = m_timers.tick_ms() / 1000;
+    m_tick_ts.tv_nsec = (long long)(m_timers.tick_ms() % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t) &m_tick_ts;
+    sqe->len = 1;
+    sqe->user_data = make_data(OP_TIMEOUT, 0, 0);
+    m_timeout_armed = true;
+}
+
+void uring_reactor::on_timer(timer_node* node) {
+    http_conn* conn = (http_conn*) node->data;
+    uint64_t next;
+    if (conn->timed_out(now_ms(), next)) {
+        expire_conn(conn);
+    } else {
+        m_timers.add(node, next);
+    }
+}
+
+void uring_reactor::loop() {
+    printf("reactor %d running (io_uring)\n", m_id);
+
+    prep_accept();
+    prep_notify();
+
+    while (1) {
+        if (!m_timeout_armed && !m_timers.empty()) {
+            prep_timeout();
+        }
+        int ret = submit(1);
+        if (ret < 0 && errno != EINTR && errno != EBUSY) {
+            printf("io_uring_enter failed: %s\n", strerror(errno));
+            break;
+        }
+
+        // 处理所有完成事件
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_cqe(&m_cqes[head & m_cq_mask]);
+            ++head;
+            if (head == tail) {
+                // 处理过程中可能又有新的完成事件
+                __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+                tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        m_timers.advance(now_ms(), [this](timer_node* node) { on_timer(node); });
+        timeout_report();
+    }
+}
+
+void uring_reactor::handle_cqe(const io_uring_cqe* cqe) {
+    URING_OP op = (URING_OP)(cqe->user_data >> 56);
+    uint32_t gen = (uint32_t)(cqe->user_data >> 32) & 0xffffff;
+    int fd = (int)(uint32_t) cqe->user_data;
+
+    if (op == OP_ACCEPT) {
+        on_accept(cqe->res, cqe->flags);
+        return;
+    }
+    if (op == OP_NOTIFY) {
+        on_notify();
+        return;
+    }
+    if (op == OP_TIMEOUT) {
+        m_timeout_armed = false;
+        return;
+    }
+
+    // 属于已经关闭的旧连接（fd可能已经被新连接复用），只回收buffer
+    if (fd < 0 || fd >= MAX_FD || (m_conns[fd].gen & 0xffffff) != gen || !m_conns[fd].open) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            on_recv(fd, cqe->res, cqe->flags);
+            break;
+        case OP_SEND:
+            on_send(fd, cqe->res);
+            break;
+        case OP_SHUTDOWN:
+            on_shutdown(fd, cqe->res);
+            break;
+        default:
+            break;
+    }
+}
+
+void uring_reactor::on_accept(int res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        // multishot accept被终止（如EMFILE），重新提交
+        prep_accept();
+    }
+    if (res < 0) {
+        return;
+    }
+
+    int connfd = res;
+    http_conn* conn = nullptr;
+    if (connfd >= MAX_FD || http_conn::m_user_count >= MAX_FD || !(conn = m_users.open(connfd))) {
+        reject_busy(connfd);
+        return;
+    }
+
+    conn_state& st = m_conns[connfd];
+    uint32_t gen = st.gen + 1;
+    memset(&st, 0, sizeof(st));
+    st.gen = gen;
+    st.open = true;
+
+    // multishot accept不带对端地址（所有连接共用同一个地址缓冲，处理cqe时已被覆盖），这里留空
+    struct sockaddr_in client_address;
+    memset(&client_address, 0, sizeof(client_address));
+    conn->init(connfd, client_address, this);
+    prep_recv(connfd);
+    if (http_conn::timeouts_enabled()) {
+        uint64_t next;
+        conn->timed_out(now_ms(), next);
+        m_timers.add(conn->timer(), next);
+    }
+}
+
+void uring_reactor::on_recv(int fd, int res, uint32_t flags) {
+    conn_state& st = m_conns[fd];
+    if (!(flags & IORING_CQE_F_MORE)) {
+        st.recv_armed = false;
+    }
+
+    if (res > 0) {
+        uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (st.closing) {
+            recycle_buffer(bid);
+            return;
+        }
+        if (st.npending < MAX_PENDING && st.overflow.empty()) {
+            st.pending_bid[st.npending] = bid;
+            st.pending_len[st.npending] = res;
+            ++st.npending;
+        } else {
+            // 停掉recv之前已经收到的数据，拷到块里，buffer马上还给内核给别的连接用
+            bool ok = st.overflow.chunks < MAX_OVERFLOW
+                && st.overflow.append(m_bufs + (size_t) bid * BUF_SIZE, res);
+            recycle_buffer(bid);
+            if (!ok) {
+                // 还是放不下，工作线程正在处理时不能马上关闭，当作对方已关闭，处理完再关
+                if (st.busy || st.sending) {
+                    st.peer_closed = true;
+                } else {
+                    close_conn(fd);
+                }
+                return;
+            }
+        }
+        if (st.npending >= MAX_PENDING / 2 && st.recv_armed && !st.throttled) {
+            // 客户端发得比处理得快（如很大的请求体），先停掉multishot recv，
+            // 数据留在socket的接收缓冲里，由TCP的流量控制让对方慢下来
+            st.throttled = true;
+            prep_cancel_recv(fd);
+        } else if (!st.recv_armed && !st.throttled) {
+            prep_recv(fd);
+        }
+        if (!st.busy && !st.sending) {
+            dispatch(fd);
+        }
+        return;
+    }
+
+    if (res == -ENOBUFS) {
+        // buffer暂时用完了，重新挂上recv
+        if (!st.recv_armed && !st.closing) prep_recv(fd);
+        return;
+    }
+
+    if (res == -ECANCELED && st.throttled) {
+        // 上面主动停掉的recv，暂存的数据已经消化掉时马上重新收
+        if (st.npending < MAX_PENDING / 2 && st.overflow.empty() && !st.busy && !st.sending && !st.closing) {
+            prep_recv(fd);
+        }
+        return;
+    }
+
+    // 对方关闭或出错
+    if (st.closing) {
+        return;
+    }
+    st.peer_closed = true;
+    if (!st.busy && !st.sending) {
+        close_conn(fd);
+    }
+}
+
+// 把暂存的数据尽量喂给http_conn，返回喂了多少字节
+int uring_reactor::feed_pending(int fd) {
+    conn_state& st = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    int fed = 0;
+    while (st.npending > 0) {
+        const char* data = m_bufs + (size_t) st.pending_bid[0] * BUF_SIZE + st.pending_off;
+        int len = st.pending_len[0] - st.pending_off;
+        int n = conn.feed(data, len);
+        fed += n;
+        if (n < len) {
+            // 读缓冲满了
+            st.pending_off += n;
+            break;
+        }
+        recycle_buffer(st.pending_bid[0]);
+        --st.npending;
+        memmove(&st.pending_bid[0], &st.pending_bid[1], st.npending * sizeof(st.pending_bid[0]));
+        memmove(&st.pending_len[0], &st.pending_len[1], st.npending * sizeof(st.pending_len[0]));
+        st.pending_off = 0;
+    }
+    while (st.npending == 0 && !st.overflow.empty()) {
+        const char* data;
+        int len = st.overflow.front(&data);
+        int n = conn.feed(data, len);
+        fed += n;
+        st.overflow.consume(n);
+        if (n < len) {
+            break;
+        }
+    }
+    return fed;
+}
+
+// 把暂存的数据喂给http_conn，交给线程池解析
+void uring_reactor::dispatch(int fd, bool pipelined) {
+    conn_state& st = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    int fed = feed_pending(fd);
+    if (fed == 0 && !pipelined) {
+        if (!st.has_pending()) {
+            return;
+        }
+        // 读缓冲满了请求还不完整，换更大的缓冲；内存不够时和epoll后端的read()一样直接关闭
+        http_conn::GROW_RESULT grown = conn.grow_read_buf();
+        if (grown == http_conn::GROW_FAILED) {
+            close_conn(fd);
+            return;
+        }
+        // 请求头超过上限时不再喂数据，交给线程池回431
+        if (grown == http_conn::GROW_OK) {
+            feed_pending(fd);
+        }
+    }
+    if (st.throttled && st.npending < MAX_PENDING / 2 && st.overflow.empty() && !st.recv_armed) {
+        // 暂存的数据消化得差不多了，重新开始收
+        prep_recv(fd);
+    }
+    if (conn.reading_body()) {
+        // 请求体还没收完，feed()中已经跳过了收到的部分
+        return;
+    }
+    st.busy = true;
+    if (!m_pool->append(&conn, worker_hint(m_id, m_reactor_num, m_thread_num, fd))) {
+        // 队列满，回503，发送经过通知队列，和工作线程处理完的流程一样
+        conn.reject();
+    }
+}
+
+void uring_reactor::on_send(int fd, int res) {
+    conn_state& st = m_conns[fd];
+    http_conn& conn = m_users[fd];
+    st.sending = false;
+    if (res < 0) {
+        close_conn(fd);
+        return;
+    }
+
+    if (conn.advance(res)) {
+        // 没发完（链式的shutdown已被取消），继续发
+        prep_send(fd);
+        return;
+    }
+
+    if (!conn.keep_alive()) {
+        // 后面链接的shutdown会接着执行，等它的cqe再关闭
+        st.closing = true;
+        return;
+    }
+
+    conn.finish_response();
+    if (st.peer_closed) {
+        close_conn(fd);
+    } else if (conn.has_pending_input()) {
+        // 流水线：读缓冲里还有请求，有没有新数据都交给线程池
+        dispatch(fd, true);
+    } else if (st.has_pending()) {
+        dispatch(fd);
+    } else if (!st.recv_armed) {
+        // recv因为暂存太多被停掉了
+        prep_recv(fd);
+    }
+}
+
+void uring_reactor::on_shutdown(int fd, int res) {
+    if (res == -ECANCELED) {
+        // 前面的send不完整，链被取消
+        return;
+    }
+    close_conn(fd);
+}
+
+// 工作线程处理完了，按通知继续
+void uring_reactor::on_notify() {
+    m_notice_locker.lock();
+    m_notices_swap.swap(m_notices);
+    m_notice_locker.unlock();
+
+    for (size_t i = 0; i < m_notices_swap.size(); ++i) {
+        int fd = m_notices_swap[i].fd;
+        conn_state& st = m_conns[fd];
+        st.busy = false;
+        switch (m_notices_swap[i].what) {
+            case NOTICE_READ:
+                if (st.peer_closed) {
+                    close_conn(fd);
+                } else if (st.has_pending()) {
+                    dispatch(fd);
+                } else if (!st.recv_armed) {
+                    prep_recv(fd);
+                }
+                break;
+            case NOTICE_WRITE:
+                prep_send(fd);
+                break;
+            case NOTICE_CLOSE:
+                close_conn(fd);
+                break;
+        }
+    }
+    m_notices_swap.clear();
+    prep_notify();
+}
+
+void uring_reactor::release_pending(int fd) {
+    conn_state& st = m_conns[fd];
+    for (int i = 0; i < st.npending; ++i) {
+        recycle_buffer(st.pending_bid[i]);
+    }
+    st.npending = 0;
+    st.pending_off = 0;
+    st.overflow.clear();
+}
+
+// 关闭连接：短连接的链式shutdown完成后，或出错、对方关闭时，在本线程用系统调用close
+void uring_reactor::close_conn(int fd) {
+    conn_state& st = m_conns[fd];
+    if (!st.open) {
+        return;
+    }
+    release_pending(fd);
+    if (st.recv_armed) {
+        // 结束挂着的multishot recv，否则它持有socket的引用，close后socket也不会释放
+        shutdown(fd, SHUT_RDWR);
+    }
+    m_timers.remove(m_users[fd].timer());
+    m_users[fd].close_conn();
+    st.open = false;
+    ++st.gen;
+}
+
+// 以下由工作线程调用：放入通知队列，队列由空变非空时才写eventfd唤醒ring线程
+void uring_reactor::notify(int fd, NOTICE what) {
+    notice n = { fd, what };
+    m_notice_locker.lock();
+    bool wake = m_notices.empty();
+    m_notices.push_back(n);
+    m_notice_locker.unlock();
+    if (wake) {
+        uint64_t one = 1;
+        ::write(m_eventfd, &one, sizeof(one));
+    }
+}
+
+void uring_reactor::want_read(http_conn* conn) {
+    notify(conn->sockfd(), NOTICE_READ);
+}
+
+void uring_reactor::want_write(http_conn* conn) {
+    notify(conn->sockfd(), NOTICE_WRITE);
+}
+
+void uring_reactor::want_close(http_conn* conn) {
+    notify(conn->sockfd(), NOTICE_CLOSE);
+}
+
+#endif // HAVE_IO_URING
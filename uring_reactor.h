@@ -0,0 +1,165 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <stdint.h>
+#include <vector>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "threadpool.h"
+#include "http_conn.h"
+#include "conn_table.h"
+#include "config.h"
+#include "locker.h"
+#include "io_backend.h"
+#include "timer_wheel.h"
+#include "buffer_pool.h"
+
+// 内核头文件太旧（< 6.0，没有multishot recv）时不编译io_uring后端，只能用epoll
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef HAVE_IO_URING
+
+/*
+    uring_reactor：io_uring后端，与reactor（epoll）二选一
+    - 监听socket上挂一个multishot accept，一次提交持续产生新连接
+    - 每个连接挂一个multishot recv，数据直接收进注册好的provided buffer ring，
+      不需要每次可读都epoll_wait + recv到EAGAIN
+    - 发送用sendmsg，短连接的最后一个响应和shutdown链接在一起提交，
+      shutdown完成后在本线程close：fd是整个进程共用的，如果close也异步执行，
+      fd释放后可能马上被别的reactor accept复用，这时再处理close的cqe会清掉别人的连接
+    - 工作线程处理完后把通知放进队列并写eventfd，eventfd的读也在ring里
+    - 有连接时挂一个IORING_OP_TIMEOUT，每个tick推进一次时间轮
+    http_conn的状态机不变，只通过feed()/get_iov()/advance()收发数据
+    不依赖liburing，直接用io_uring_setup/io_uring_enter/io_uring_register系统调用
+*/
+class uring_reactor : public io_backend {
+public:
+    uring_reactor(int id, const server_config& config, conn_table& users, threadpool<http_conn>* pool);
+    ~uring_reactor();
+
+    void loop();
+
+    void want_read(http_conn* conn);
+    void want_write(http_conn* conn);
+    void want_close(http_conn* conn);
+
+private:
+    static const unsigned RING_ENTRIES = 1024;      // sq大小，cq是它的4倍
+    static const unsigned BUF_COUNT = 1024;         // provided buffer个数，必须是2的幂
+    static const unsigned BUF_SIZE = 2048;          // 每个buffer的大小，和http_conn的读缓冲一样
+    static const int MAX_PENDING = 16;              // 连接在工作线程中处理时，最多暂存的recv结果数
+    // 暂存的recv结果放满后最多再拷进多少个块：停掉recv生效之前，内核最多把整个buffer ring收满
+    static const int MAX_OVERFLOW = BUF_COUNT * BUF_SIZE / buf_chunk::SIZE;
+
+    // user_data中的操作类型
+    enum URING_OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SHUTDOWN, OP_NOTIFY, OP_TIMEOUT, OP_CANCEL };
+
+    // 工作线程发回来的通知
+    enum NOTICE { NOTICE_READ, NOTICE_WRITE, NOTICE_CLOSE };
+    struct notice {
+        int fd;
+        NOTICE what;
+    };
+
+    // 每个连接在ring线程中的状态，只有ring线程访问
+    struct conn_state {
+        uint32_t gen;       // 每次关闭+1，用来识别属于旧连接的cqe
+        bool open;
+        bool busy;          // 在工作线程中处理
+        bool sending;       // 有sendmsg在飞
+        bool closing;       // 最后一个响应已发完，等链式shutdown完成后关闭
+        bool recv_armed;    // multishot recv还挂着
+        bool throttled;     // 暂存的数据太多，主动停掉了recv，消化掉一半后再重新挂上
+        bool peer_closed;   // 对端已关闭
+        int npending;       // 暂存的recv数据，等工作线程处理完再喂给http_conn
+        uint16_t pending_bid[MAX_PENDING];
+        uint32_t pending_len[MAX_PENDING];
+        uint32_t pending_off; // 第一个暂存buffer中已经喂掉的字节数
+        chunk_queue overflow; // pending放满后（停掉recv之前已经收到的）数据拷到这里，buffer马上还给内核
+        bool has_pending() const { return npending > 0 || !overflow.empty(); }
+        struct msghdr msg;
+    };
+
+private:
+    void cleanup();
+    bool setup_ring();
+    bool setup_buffers();
+    io_uring_sqe* get_sqe();
+    int submit(unsigned wait_nr);
+
+    static uint64_t make_data(URING_OP op, uint32_t gen, int fd) {
+        return ((uint64_t)op << 56) | ((uint64_t)(gen & 0xffffff) << 32) | (uint32_t)fd;
+    }
+
+    void prep_accept();
+    void prep_recv(int fd);
+    void prep_cancel_recv(int fd);
+    void prep_send(int fd);
+    void prep_notify();
+    void prep_timeout();
+
+    void handle_cqe(const io_uring_cqe* cqe);
+    void on_accept(int res, uint32_t flags);
+    void on_recv(int fd, int res, uint32_t flags);
+    void on_send(int fd, int res);
+    void on_shutdown(int fd, int res);
+    void on_notify();
+
+    void recycle_buffer(uint16_t bid);
+    int feed_pending(int fd);
+    void dispatch(int fd, bool pipelined = false); // pipelined: 读缓冲中还有上一批留下的请求，没有新数据也要处理
+    void close_conn(int fd);
+    void release_pending(int fd);
+    void notify(int fd, NOTICE what);
+    void on_timer(timer_node* node);
+
+private:
+    int m_id;
+    int m_reactor_num;
+    int m_thread_num;
+    int m_listenfd;
+    conn_table& m_users;
+    threadpool<http_conn>* m_pool;
+    conn_state* m_conns;
+
+    // ring
+    int m_ringfd;
+    void* m_ring_ptr;
+    size_t m_ring_size;
+    io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_sq_local_tail;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    // provided buffer ring
+    io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    char* m_bufs;
+    unsigned short m_buf_tail;
+
+    // 工作线程 -> ring线程的通知
+    int m_eventfd;
+    uint64_t m_eventfd_val;
+    locker m_notice_locker;
+    std::vector<notice> m_notices;
+    std::vector<notice> m_notices_swap;
+
+    // 超时
+    timer_wheel m_timers;
+    struct __kernel_timespec m_tick_ts;
+    bool m_timeout_armed;
+};
+
+#endif // HAVE_IO_URING
+
+#endif